@@ -14,32 +14,58 @@
  *   limitations under the License.
  */
 #include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <glog/logging.h>
 #include <gflags/gflags.h>
 #include <iostream>
+#include <set>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <vector>
 
 #include "db.h"
 #include "base.h"
 #include "automationstate.h"
+#include "catalog.h"
+#include "clock.h"
 #include "http.h"
 #include "mplayersession.h"
 #include "playableitem.h"
 #include "playlist.h"
 #include "requirementengine.h"
+#include "scanner.h"
+#include "simulatedplayer.h"
 #include "playlist.pb.h"
 #include "protostore.h"
 
 DEFINE_string(bumpers, "unused", "bumpers - this is unused in this binary needed as a linking hack");
-DEFINE_string(command, "list", "Command to run - list, load, replace, append, dump, setup");
+DEFINE_string(command, "list", "Command to run - list, load, replace, append, remove, dump, setup, "
+              "simulate, scan, snapshot.  replace, append and remove read PlayableItemIDs from "
+              "stdin; scan takes the files and directories to scan as arguments.  snapshot writes "
+              "the catalog snapshot automation starts from.");
 DEFINE_string(playlist, "default-playlist", "Target playlist");
 DEFINE_int32(weight, -1, "used with command=setup to set the weight");
+DEFINE_int64(simulate_start, 0, "used with command=simulate: unix time to start the simulation at, "
+             "or 0 for now");
+DEFINE_int64(simulate_seconds, 7 * 86400, "used with command=simulate: how much time to simulate");
+DEFINE_string(as_run_log, "", "used with command=simulate: file to write the as-run log to, "
+              "instead of stdout");
+DEFINE_int32(scan_threads, 0, "used with command=scan: threads to walk directories and measure "
+             "new files with, or 0 for one per core");
+DEFINE_bool(simulate_reboot, true, "used with command=simulate: first run the requirements "
+            "marked to run on reboot, as automation --doinit does");
+DEFINE_int64(simulate_seed, 1, "used with command=simulate: seed for the choice of mainshows and "
+             "the order of their tracks, so that runs over the same database play out the same; "
+             "0 seeds from the time instead");
+
+DECLARE_int32(prefetch_items);
 
 int shutdown_requested;
  
@@ -51,12 +77,12 @@ int main(int argc, char **argv) {
   std::srand(time(NULL));
 
   DatabaseHandle db(DatabaseOpen());
+  UpgradeSchema(db);
 
-  PlaylistPtr null;
-  AutomationState automation(db, NULL);
-  MplayerSession mp;
+  // acmd is run from scripts, often many times over, so each command sets up
+  // only what it uses: nothing but the database for most, and no player or
+  // AutomationState (which picks a mainshow) outside of simulate.
   Playlist candidate(db);
-  candidate.Fetch(FLAGS_playlist);
   if (FLAGS_command == "list") {
     printf("%s", Playlist::FetchAllLists(db).DebugString().c_str());
   } else if (FLAGS_command == "load") {
@@ -70,20 +96,19 @@ int main(int argc, char **argv) {
       }
       PlayableItem item(db);
       bool found = item.fetch(buf);
-      VLOG(30) << "found state " << found << " duration " << item.data().duration();
-      if (!found && item.data().duration() > 0) {
+      const int duration = item.snapshot()->duration();
+      VLOG(30) << "found state " << found << " duration " << duration;
+      if (!found && duration > 0) {
         VLOG(5) << "Attempting to store";
         item.Replace();
-      } else if (item.data().duration() <= 0) {
+      } else if (duration <= 0) {
         continue;
       }
 
-      printf("%ld\t%s\n", item.data().playableitemid(), buf);
-    }
-  } else if (FLAGS_command == "replace" || FLAGS_command == "append") {
-    if (FLAGS_command == "replace") {
-      candidate.mutable_data().clear_playableitemid();
+      printf("%ld\t%s\n", item.snapshot()->playableitemid(), buf);
     }
+  } else if (FLAGS_command == "replace" || FLAGS_command == "append" || FLAGS_command == "remove") {
+    std::vector<int> itemids;
     char buf[1024];
     while (fgets(buf, sizeof(buf), stdin)) {
       char *p = buf;
@@ -91,17 +116,133 @@ int main(int argc, char **argv) {
         ++p;
       }
       *p = '\0';
-      int itemid = atoi(buf);
-      candidate.mutable_data().add_playableitemid(itemid);
+      itemids.push_back(atoi(buf));
     } 
-    candidate.Replace();
+    candidate.FetchUnordered(FLAGS_playlist);
+    if (!candidate.snapshot()->has_playlistid()) {
+      // New (or empty) playlist: create it, so there is something to add to.
+      candidate.Replace();
+    }
+    // Only the differences from what is stored are written.
+    automation::PlaylistDelta delta;
+    std::shared_ptr<const automation::Playlist> current = candidate.snapshot();
+    const std::set<int64> have(current->playableitemid().begin(), current->playableitemid().end());
+    const std::set<int64> given(itemids.begin(), itemids.end());
+    if (FLAGS_command == "remove") {
+      for (int64 itemid : given) {
+        if (have.count(itemid)) {
+          delta.add_remove(itemid);
+        }
+      }
+    } else {
+      for (int64 itemid : given) {
+        if (!have.count(itemid)) {
+          delta.add_add(itemid);
+        }
+      }
+      if (FLAGS_command == "replace") {
+        for (int64 itemid : have) {
+          if (!given.count(itemid)) {
+            delta.add_remove(itemid);
+          }
+        }
+      }
+    }
+    candidate.ApplyDelta(delta);
+    fprintf(stderr, "%s: added %d, removed %d\n", current->name().c_str(), delta.add_size(),
+            delta.remove_size());
   } else if (FLAGS_command == "dump") {
-    printf("%s",candidate.data().DebugString().c_str());
+    candidate.FetchUnordered(FLAGS_playlist);
+    printf("%s",candidate.snapshot()->DebugString().c_str());
   } else if (FLAGS_command == "setup") {
+    candidate.FetchUnordered(FLAGS_playlist);
     if (FLAGS_weight >= 0) {
-      candidate.mutable_data().set_weight(FLAGS_weight);
+      candidate.Mutate([](automation::Playlist* playlist) { playlist->set_weight(FLAGS_weight); });
     } 
     candidate.Replace();
+  } else if (FLAGS_command == "simulate") {
+    // Runs the scheduler on a virtual clock against a simulated player, as
+    // fast as it will go.  Point --dbname at a copy of the station database:
+    // playlists are locked and consumed just as they would be on air.
+    VirtualClock clock(FLAGS_simulate_start ? FLAGS_simulate_start : time(NULL));
+    Clock::Set(&clock);
+    std::srand(FLAGS_simulate_seed ? FLAGS_simulate_seed : time(NULL));
+    // Playlists are only shuffled with std::rand, and so by the seed, when read
+    // from a catalog snapshot; SQLite's RANDOM() can't be seeded.
+    auto use_snapshot = [&db]() {
+      CHECK(Catalog::Write(db, CatalogPath())) << "Unable to write the catalog snapshot";
+      Catalog::Set(Catalog::Open(CatalogPath()));
+      CHECK(Catalog::Get(db)) << "Unable to read back " << CatalogPath();
+    };
+    use_snapshot();
+    // Nothing is really played, so there's nothing to read ahead.
+    FLAGS_prefetch_items = 0;
+    FILE* log = stdout;
+    if (!FLAGS_as_run_log.empty()) {
+      log = fopen(FLAGS_as_run_log.c_str(), "w");
+      CHECK(log) << "Unable to open " << FLAGS_as_run_log;
+    }
+    SimulatedPlayer player(&clock, log);
+    AutomationState simulated(db, &player);
+    simulated.set_manual_override(false);
+    if (FLAGS_simulate_reboot) {
+      simulated.get_requirement_engine()->HandleReboot();
+    }
+
+    const time_t end = clock.Now() + FLAGS_simulate_seconds;
+    const auto started = std::chrono::steady_clock::now();
+    int64_t iterations = 0, dead_air = 0;
+    while (clock.Now() < end) {
+      const int64_t before = clock.NowMicros();
+      ++iterations;
+      if (!Catalog::Get(db)) {
+        // A playlist was changed along the way.
+        use_snapshot();
+      }
+      if (!simulated.RunOnce() && clock.NowMicros() == before) {
+        // On air RunOnce would spin here until its deadline came; move the
+        // clock along instead of spinning forever.
+        clock.Advance(1000000);
+        ++dead_air;
+      }
+    }
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    if (log != stdout) {
+      fclose(log);
+    }
+    fprintf(stderr, "Simulated %ld seconds in %.3f seconds: %ld iterations (%.0f/s), %ld items "
+            "totalling %ld seconds, %ld seconds of intentional silence, %ld seconds of dead air\n",
+            (long)FLAGS_simulate_seconds, wall, (long)iterations, iterations / wall,
+            (long)player.items_played(), (long)player.seconds_played(), (long)clock.slept(),
+            (long)dead_air);
+    Clock::Set(nullptr);
+  } else if (FLAGS_command == "scan") {
+    // Replaces find | acmd --command=load: only what changed since the last
+    // scan is measured, and files that have gone are marked missing.
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+      struct stat st;
+      CHECK(!stat(argv[i], &st)) << "Unable to scan " << argv[i] << ": " << strerror(errno);
+      paths.push_back(argv[i]);
+    }
+    CHECK(!paths.empty()) << "Give the files and directories to scan as arguments.";
+    const auto started = std::chrono::steady_clock::now();
+    const LibraryScanner::Stats stats = LibraryScanner(db).Scan(paths, FLAGS_scan_threads);
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    fprintf(stderr, "Scanned %ld files in %.3f seconds: %ld unchanged, %ld added, %ld changed, "
+            "%ld moved, %ld restored, %ld newly missing, %ld unplayable\n", (long)stats.files, wall,
+            (long)stats.unchanged, (long)stats.added, (long)stats.changed, (long)stats.moved,
+            (long)stats.restored, (long)stats.missing, (long)stats.failed);
+  } else if (FLAGS_command == "snapshot") {
+    // automation keeps this up to date itself; this is for having it ready
+    // before automation is (re)started after a big change.
+    const auto started = std::chrono::steady_clock::now();
+    CHECK(Catalog::Write(db, CatalogPath())) << "Unable to write the catalog snapshot";
+    std::shared_ptr<const Catalog> catalog = Catalog::Open(CatalogPath());
+    CHECK(catalog) << "Unable to read back " << CatalogPath();
+    fprintf(stderr, "Wrote %ld items, version %ld, to %s in %.3f seconds\n", (long)catalog->item_count(),
+            (long)catalog->version(), CatalogPath().c_str(),
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
   }
   google::protobuf::ShutdownProtobufLibrary();
   sqlite3_close(db); 
@@ -25,8 +25,13 @@
 #include "playlist.h"
 #include "requirementengine.h"
 #include "mplayersession.h"
+#include "clock.h"
+#include "metrics.h"
 #include "stdio.h"
+#include <map>
 #include <string>
+#include <utility>
+#include <boost/thread/mutex.hpp>
 #include <glog/logging.h>
 #include "registerable-inl.h"
 #include <boost/tokenizer.hpp>
@@ -37,6 +42,45 @@ DEFINE_int32(legalid_max_length, 60, "Maximium length of legal ID to consider pl
 namespace automator {
 
 class ScheduleCommand : public RequirementEngine::Registrar {
+ public:
+  // Also registers Prepare, for commands that can get ready ahead of time.
+  bool register_commands() {
+    RequirementEngine::AddPreparer(get_command(),
+        [this](const time_t &deadline, const automation::Requirement &command) {
+      this->Prepare(deadline, command);
+    });
+    return RequirementEngine::Registrar::register_commands();
+  }
+
+ protected:
+  // Called shortly before deadline, on the thread that will then run
+  // handle_command for it.  Anything slow (the database, opening and decoding
+  // files) is best done here rather than on the clock.
+  virtual void Prepare(const time_t &deadline, const automation::Requirement& command) {}
+
+  // Records how far from deadline the audio the command played started.
+  static void RecordAudioStart(const time_t &deadline, MplayerSession* player,
+                               const std::string& command) {
+    if (!deadline) {
+      // Run once, not on a schedule.
+      return;
+    }
+    const int64_t offset = player->last_start_micros() - deadline * 1000000LL;
+    const std::string labels = "command=\"" + command + "\"";
+    if (offset >= 0) {
+      metrics::GetHistogram("requirement_audio_start_late_seconds",
+          "How long after its scheduled time the audio of each requirement started.",
+          labels, 1e-6)->Record(offset);
+    } else {
+      metrics::GetHistogram("requirement_audio_start_early_seconds",
+          "How long before its scheduled time the audio of each requirement started.",
+          labels, 1e-6)->Record(-offset);
+    }
+    LOG(INFO) << command << " due at " << deadline << " started playing " << offset / 1000 << "ms "
+              << (offset >= 0 ? "late" : "early");
+  }
+
+ private:
   virtual void handle_command(const time_t &deadline, const automation::Requirement& command) = 0;
   RequirementEngine::Registrar::callback get_callback() {
     return [this](const time_t &deadline, const automation::Requirement &command) {
@@ -59,6 +103,23 @@ REGISTER_COMMAND(DoNothingCommand);
 class PlayFilesCommand : public ScheduleCommand {
  public:
   const std::string get_command() { return "PLAY_FILES"; }
+  // Only the first file has to be on time.
+  void Prepare(const time_t &deadline, const automation::Requirement& req) {
+    if (req.playlist().items_size() == 0) {
+      return;
+    }
+    MplayerSession& player = *CHECK_NOTNULL(AutomationState::get_state()->get_player());
+    const automation::PlayableItem& first = req.playlist().items(0);
+    if (!first.has_playableitemid()) {
+      player.Preload(first);
+      return;
+    }
+    sqlite3 *db = DatabaseOpen();
+    PlayableItem item(db);
+    item.Fetch(first.playableitemid());
+    player.Preload(*item.snapshot());
+    sqlite3_close(db);
+  }
   void handle_command(const time_t &deadline, const automation::Requirement& req) {
     AutomationState *as = AutomationState::get_state();
     MplayerSession& player = *CHECK_NOTNULL(as->get_player());
@@ -69,11 +130,16 @@ class PlayFilesCommand : public ScheduleCommand {
     for (RepeatedPtrField<automation::PlayableItem>::const_iterator it = req.playlist().items().begin();
          it != req.playlist().items().end();
          ++it) {
+      bool played;
       if (it->has_playableitemid()) {
         item.Fetch(it->playableitemid());
-        player.Play(item);
+        played = player.Play(item);
       } else {
-        player.Play(*it);
+        played = player.Play(*it);
+      }
+      // A file that didn't play leaves last_start_micros at some earlier start.
+      if (played && it == req.playlist().items().begin()) {
+        RecordAudioStart(deadline, &player, get_command());
       }
     }
     sqlite3_close(db);
@@ -84,9 +150,44 @@ REGISTER_COMMAND(PlayFilesCommand);
 class LegalIDCommand : public ScheduleCommand {
  public:
   const std::string get_command() { return "LEGAL_ID"; }
+  // Picks the ID and loads it into the player, so that at the deadline all
+  // that's left is to unpause it.
+  void Prepare(const time_t &deadline, const automation::Requirement &command) {
+    AutomationState *as = AutomationState::get_state();
+    sqlite3 *db = DatabaseOpen();
+    Playlist legalid(db);
+    Playlist::LockByName(db, FLAGS_legalid);
+    if (legalid.FetchShuffled(FLAGS_legalid)) {
+      PlayableItem item(db);
+      while (legalid.Size() > 0) {
+        legalid.PopWithTimelimit(FLAGS_legalid_max_length, &item);
+        std::shared_ptr<const automation::PlayableItem> id = item.snapshot();
+        if (!id->has_filename()) {
+          break;
+        }
+        if (as->get_player()->Preload(*id)) {
+          boost::mutex::scoped_lock lock(staged_mutex_);
+          staged_[as] = std::make_pair(deadline, *id);
+          break;
+        }
+      }
+    }
+    sqlite3_close(db);
+  }
   void handle_command(const time_t &deadline, const automation::Requirement &command) {
     AutomationState *as = AutomationState::get_state();
     LOG(INFO) << "Playing ID";
+    automation::PlayableItem staged;
+    if (TakeStaged(as, deadline, &staged) && as->get_player()->Play(staged)) {
+      RecordAudioStart(deadline, as->get_player(), get_command());
+      // Now that it's played, count it.
+      sqlite3 *db = DatabaseOpen();
+      PlayableItem item(db);
+      item.Fetch(staged.playableitemid());
+      item.IncrementPlaycount();
+      sqlite3_close(db);
+      return;
+    }
     sqlite3 *db = DatabaseOpen();
     Playlist legalid(db);
     Playlist::LockByName(db, FLAGS_legalid);
@@ -98,8 +199,29 @@ class LegalIDCommand : public ScheduleCommand {
       }
       legalid.PopWithTimelimit(FLAGS_legalid_max_length, &item);
     } while (!as->get_player()->Play(item));
+    RecordAudioStart(deadline, as->get_player(), get_command());
     sqlite3_close(db);
   }
+
+ private:
+  // Takes the ID Prepare staged for this channel, if it was for deadline.
+  bool TakeStaged(AutomationState* as, time_t deadline, automation::PlayableItem* item) {
+    boost::mutex::scoped_lock lock(staged_mutex_);
+    auto it = staged_.find(as);
+    if (it == staged_.end()) {
+      return false;
+    }
+    const bool ok = it->second.first == deadline;
+    if (ok) {
+      item->Swap(&it->second.second);
+    }
+    staged_.erase(it);
+    return ok;
+  }
+
+  // Channels run on their own threads, but share this command.
+  boost::mutex staged_mutex_;
+  std::map<AutomationState*, std::pair<time_t, automation::PlayableItem> > staged_;
 };
 REGISTER_COMMAND(LegalIDCommand);
 
@@ -18,23 +18,30 @@
 #include <glog/logging.h>
 #include <gflags/gflags.h>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <stdlib.h>
 #include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <vector>
 #include <pion/http/server.hpp>
 #include <pion/scheduler.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "db.h"
 #include "base.h"
 #include "automationstate.h"
+#include "catalog.h"
 #include "http.h"
 #include "mplayersession.h"
 #include "playableitem.h"
 #include "playlist.h"
 #include "requirementengine.h"
+#include "scanner.h"
+#include "trace.h"
 
 DEFINE_string(bumpers, "", "Name of playlist which contains bumpers.  If empty, use all playableitems instead.");
 DEFINE_bool(webapi, true, "If false, do not setup a web backend.");
@@ -44,6 +51,10 @@ DEFINE_bool(secure, true, "If true, only clients with valid SSL certs can perfor
 DEFINE_string(ssl_ca, "", "If set, path to the trusted CA for client authentication.");
 DEFINE_string(ssl_crt, "", "If set, path to our SSL certificate. (PEM-encoded)");
 DEFINE_string(ssl_key, "", "If set, path to our SSL host key. (PEM-encoded)");
+DEFINE_int32(ssl_session_timeout, 3600, "Seconds for which a client may resume its TLS session "
+             "on a new connection instead of doing the full handshake again.");
+DEFINE_int32(ssl_session_cache_size, 1024, "Most TLS sessions to remember for resumption; "
+             "clients holding session tickets don't need a place in it.");
 
 // If you do have some need to go above 50, you'll want to boost AUTOMATION_MAX_FD as well.  Note we give ourselves
 // 5 in this calculation, but we probably are using ~half that.  So there's a bit of a safety margin with 50, here,
@@ -53,8 +64,22 @@ DEFINE_string(interface, "127.0.0.1", "IP of interface to listen on");
 DEFINE_bool(doinit, true, "If true, we play commands marked @reboot on startup, pre-webserver standup.");
 DEFINE_bool(fast_shutdown, false, "If true, shutdown immediately on exit request. "
                                   "Otherwise, attempt to defer shutdown until after the track ends.");
+DEFINE_string(channels, "", "Comma-separated list of channels to run alongside the default one, "
+  "each as name or name=audio-device.  Channels share the database and web server; channel "
+  "foo's API is served under /channel/foo/ and it keeps its own schedule, playlists and player.");
+DEFINE_string(trace_file, "/tmp/automation-trace.json", "Where SIGUSR1 writes the buffered tracing spans.");
+DEFINE_string(watch_library, "", "Comma-separated directories to keep the library up to date "
+              "with: scanned at startup, then watched for changes, which are added as they "
+              "happen.  Files removed from them stop being played.");
+DEFINE_bool(catalog_snapshot, true, "If true, a snapshot of the playlists is kept in --dbname "
+            "with .catalog appended, and used instead of SQLite while it is up to date, "
+            "which makes startup much faster on big libraries.");
+DEFINE_int32(catalog_snapshot_seconds, 60, "How often to check whether the catalog snapshot "
+             "needs rewriting.");
+DECLARE_bool(trace);
 
 int shutdown_requested = 0;
+volatile sig_atomic_t trace_dump_requested = 0;
 
 void signalhandler(int);
 void signalhandler(int signal) {
@@ -62,6 +87,7 @@ void signalhandler(int signal) {
    case SIGPIPE:
     break;
    case SIGUSR1:
+    trace_dump_requested = 1;
     break;
    default:
     shutdown_requested = 1;
@@ -95,6 +121,19 @@ int main(int argc, char **argv) {
   sigaction(SIGPIPE, &ignored_signals, NULL); 
 
   RequirementEngine::CheckValidity();
+  trace::SetEnabled(FLAGS_trace);
+
+  // Writing the trace isn't async-signal-safe, and the main loop may be blocked
+  // for a whole track, so SIGUSR1 is serviced from here.
+  boost::thread([]() {
+    while (!shutdown_requested) {
+      sleep(1);
+      if (trace_dump_requested) {
+        trace_dump_requested = 0;
+        trace::DumpToFile(FLAGS_trace_file);
+      }
+    }
+  }).detach();
 
   LOG(INFO) << "automation-ng starting up";
 
@@ -107,17 +146,65 @@ int main(int argc, char **argv) {
   sqlite3 *db;
 
   db = DatabaseOpen();
+  UpgradeSchema(db);
   if (sqlite3_exec(db, "DELETE FROM PlaylistLock;", NULL, NULL, NULL) != SQLITE_OK) {
     LOG(WARNING) << "Unable to truncate locked playlist list.";
   }
+  if (FLAGS_catalog_snapshot) {
+    Catalog::Maintain(DatabaseOpen(), CatalogPath(), FLAGS_catalog_snapshot_seconds);
+  }
+
+  std::unique_ptr<LibraryWatcher> library_watcher;
+  if (!FLAGS_watch_library.empty()) {
+    std::vector<std::string> roots;
+    std::stringstream root_list(FLAGS_watch_library);
+    std::string root;
+    while (std::getline(root_list, root, ',')) {
+      if (!root.empty()) {
+        roots.push_back(root);
+      }
+    }
+    library_watcher.reset(new LibraryWatcher(DatabaseOpen(), roots));
+  }
 
   MplayerSession mp;
   
   fclose(stdin);
 
   AutomationState automation(db, &mp); 
+
+  // Each channel runs on its own thread, so each gets its own connection:
+  // serialized mode only makes single calls safe, not the transactions and
+  // temporary views the playlists use.  Declared first so they outlive the
+  // channels using them.
+  std::vector<std::unique_ptr<DatabaseHandle> > channel_dbs;
+  std::vector<std::unique_ptr<MplayerSession> > channel_players;
+  std::vector<std::unique_ptr<AutomationState> > channels;
+  std::stringstream channel_list(FLAGS_channels);
+  std::string channel;
+  while (std::getline(channel_list, channel, ',')) {
+    if (channel.empty()) {
+      continue;
+    }
+    std::string audio_device;
+    const std::string::size_type equals = channel.find('=');
+    if (equals != std::string::npos) {
+      audio_device = channel.substr(equals + 1);
+      channel.resize(equals);
+    }
+    CHECK(!channel.empty() && channel.find('/') == std::string::npos && !AutomationState::get_state(channel))
+        << "Invalid or duplicate channel name in --channels: " << channel;
+    LOG(INFO) << "Starting channel " << channel;
+    channel_players.emplace_back(new MplayerSession(audio_device));
+    channel_dbs.emplace_back(new DatabaseHandle(DatabaseOpen()));
+    channels.emplace_back(new AutomationState(*channel_dbs.back(), channel_players.back().get(), channel));
+  }
+
   if (FLAGS_doinit) {
-    automation.get_requirement_engine()->HandleReboot();
+    automation.HandleReboot();
+    for (const auto& state : channels) {
+      state->HandleReboot();
+    }
   }
 
   pion::http::server_ptr webapi_server;
@@ -143,10 +230,16 @@ int main(int argc, char **argv) {
       if (FLAGS_secure) {
         webapi_server->get_ssl_context_type().set_verify_mode(boost::asio::ssl::context::verify_peer | boost::asio::ssl::context::verify_fail_if_no_peer_cert);
       }
+      EnableSessionResumption(webapi_server->get_ssl_context_type().native_handle(),
+                              FLAGS_ssl_session_cache_size, FLAGS_ssl_session_timeout);
     }
     WebAPI::Registrar::CallbackMap &cm = WebAPI::Registrar::get_callbackmap();
     for (const auto& callback_pair : cm) {
       webapi_server->add_resource(callback_pair.first, callback_pair.second);
+      for (const auto& state : channels) {
+        webapi_server->add_resource(WebAPI::ChannelResource(state->get_channel(), callback_pair.first),
+                                    callback_pair.second);
+      }
     }
 
     try {
@@ -158,11 +251,23 @@ int main(int argc, char **argv) {
   }
 
   LOG(INFO) << "Entering main loop";
+  boost::thread_group channel_threads;
+  for (const auto& state : channels) {
+    AutomationState *as = state.get();
+    channel_threads.create_thread([as]() {
+      while (!shutdown_requested) {
+        if (!as->RunOnce()) {
+          LOG(ERROR) << "Automation::RunOnce returned false on channel " << as->get_channel();
+        }
+      }
+    });
+  }
   while (!shutdown_requested) {
     if (!automation.RunOnce()) {
       LOG(ERROR) << "Automation::RunOnce returned false";
     }
   }
+  channel_threads.join_all();
   LOG(INFO) << "Main loop exit.";
 
   webapi_server.reset();
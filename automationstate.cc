@@ -15,6 +15,7 @@
  */
 
 #include "automationstate.h"
+#include "clock.h"
 #include "playlist.h"
 #include <glog/logging.h>
 #include <stdio.h>
@@ -22,6 +23,8 @@
 #include <gflags/gflags.h>
 #include "requirementengine.h"
 #include "mplayersession.h"
+#include "prefetcher.h"
+#include "protostore.h"
 
 DEFINE_bool(defaulthuman, false, "If true, when automation starts a human is in control.");
 DEFINE_int32(bumpercutoff, 200, "If we have <= bumpercutoff seconds remaining after we have "
@@ -31,14 +34,23 @@ DEFINE_int32(sleepcutoff, 4, "If we have <= sleepcutoff seconds remaining after
   "exhausted our options with mainshow, override, and bumperlist [assuming sleepcutoff < bumpercutoff]"
   " playlists, we can sleep for the remainder of time.  This value => max amount of dead air "
   "we'll intentionally generate.");
+DEFINE_int32(prestage_seconds, 0, "Requirements due within this many seconds are prepared "
+  "ahead of time, e.g. a legal ID is picked and loaded, paused, into a second mpv instance so "
+  "that it starts on the second.  The audio output must allow two clients (e.g. pulse), and "
+  "preparing runs on the on-air thread, so it can hold up the current item for up to five seconds "
+  "plus the database work of preparing.  0 (the default) disables this.");
 
 DECLARE_string(bumpers);
+DECLARE_int32(prefetch_items);
 
-AutomationState *AutomationState::state_;
+boost::mutex AutomationState::channels_mutex_;
+std::map<std::string, AutomationState*> AutomationState::channels_;
+thread_local AutomationState* AutomationState::current_;
 
-AutomationState::AutomationState(sqlite3* db, MplayerSession* player) :
+AutomationState::AutomationState(sqlite3* db, MplayerSession* player, const std::string& channel) :
+  channel_(channel),
   db_(db),
-  re_(std::shared_ptr<RequirementEngine>(new RequirementEngine(db))),
+  re_(std::shared_ptr<RequirementEngine>(new RequirementEngine(db, channel))),
   main_player_(player),
   override_(FLAGS_defaulthuman),
   override_playlist_(new Playlist(db)),
@@ -50,17 +62,57 @@ AutomationState::AutomationState(sqlite3* db, MplayerSession* player) :
   override_playlist_->NeverSave();
 
   SetMainshow();
-  state_ = this;
+  boost::mutex::scoped_lock lock(channels_mutex_);
+  channels_[channel_] = this;
+}
+
+AutomationState::~AutomationState() {
+  boost::mutex::scoped_lock lock(channels_mutex_);
+  auto it = channels_.find(channel_);
+  if (it != channels_.end() && it->second == this) {
+    channels_.erase(it);
+  }
+  if (current_ == this) {
+    current_ = NULL;
+  }
+}
+
+AutomationState *AutomationState::get_state() {
+  if (current_) {
+    return current_;
+  }
+  return get_state("");
+}
+
+AutomationState *AutomationState::get_state(const std::string& channel) {
+  boost::mutex::scoped_lock lock(channels_mutex_);
+  auto it = channels_.find(channel);
+  return it == channels_.end() ? NULL : it->second;
+}
+
+std::vector<std::string> AutomationState::get_channels() {
+  boost::mutex::scoped_lock lock(channels_mutex_);
+  std::vector<std::string> channels;
+  for (const auto& channel : channels_) {
+    channels.push_back(channel.first);
+  }
+  return channels;
+}
+
+void AutomationState::HandleReboot() {
+  MakeCurrent();
+  re_->HandleReboot();
 }
 
 bool AutomationState::RunOnce() {
   time_t deadline, gap;
+  MakeCurrent();
 
   // Attempt to yield to a human
   if (ManualOverride()) {
     // If we did anything in manual override, skip any requirements that happened
     // before we returned.
-    re_->set_time(time(NULL));
+    re_->set_time(Clock::Get()->Now());
   }
 
   if (bumperlist_->Size() == 0) {
@@ -72,20 +124,26 @@ bool AutomationState::RunOnce() {
   automation::Schedule next_requirements;
   re_->FillNext(&next_requirements, &deadline, &gap);
   VLOG(10) << "Deadline set to " << deadline << "after which we play " << next_requirements.DebugString();
+  if (FLAGS_prefetch_items > 0) {
+    Prefetch(next_requirements);
+  }
 
-  if (time(NULL) >= deadline) {
+  if (Clock::Get()->Now() >= deadline) {
     re_->RunBlock(deadline, &next_requirements);
     // We're doing this needlessly most of the time.  We only need to do this if we
     // played bumpers...
     ResetBumpers();
     return true;
   }
+  if (FLAGS_prestage_seconds > 0 && deadline - Clock::Get()->Now() <= FLAGS_prestage_seconds) {
+    re_->Prepare(deadline, &next_requirements);
+  }
 
   PlayableItem next_track(db_);
-  GetMainshow()->PopWithTimelimit(deadline - time(NULL) + gap, &next_track);
+  GetMainshow()->PopWithTimelimit(deadline - Clock::Get()->Now() + gap, &next_track);
 
   MplayerSession &mp = *CHECK_NOTNULL(get_player());
-  if (next_track.data().has_filename()) {
+  if (next_track.snapshot()->has_filename()) {
     // We found something in our mainshow_ that fits in the alloted time; play it.
     mp.Play(next_track);
     return true;
@@ -94,7 +152,7 @@ bool AutomationState::RunOnce() {
 
     PlayableItem next_bumper(db_);
 
-    if((deadline - time(NULL)) >= FLAGS_bumpercutoff && !GetMainshow()->Size()) {
+    if((deadline - Clock::Get()->Now()) >= FLAGS_bumpercutoff && !GetMainshow()->Size()) {
       // We have more than 200 seconds left before our requirement is due,
       // or the mainshow_ is empty.  Instead of falling back to bumpers,
       // let's just get a new mainshow_.
@@ -102,8 +160,8 @@ bool AutomationState::RunOnce() {
       SetMainshow();
       return false;
     } else {
-      bumperlist_->PopWithTimelimit(deadline - time(NULL) + gap, &next_bumper);
-      if (next_bumper.data().has_filename()) {
+      bumperlist_->PopWithTimelimit(deadline - Clock::Get()->Now() + gap, &next_bumper);
+      if (next_bumper.snapshot()->has_filename()) {
         // We found a bumper to play.  Play it.
         mp.Play(next_bumper);
         return true;
@@ -111,14 +169,22 @@ bool AutomationState::RunOnce() {
 
       // We have no bumpers left.  Let's check one time to see if we still
       // have time to kill...
-      int time_left = deadline - time(NULL);
+      int time_left = deadline - Clock::Get()->Now();
       if(time_left <= 0) {
         return true;
       }
       // Well, shoot, we do have time to kill.  If it's under sleepcutoff,
       // sleep it off
       if(time_left <= FLAGS_sleepcutoff) {
-        sleep(time_left);
+        if (FLAGS_prestage_seconds > 0 && !get_manual_override() && !override_playlist_->Size()) {
+          // Nothing can come before the requirement now; start it on the second
+          // rather than whenever the next RunOnce gets to it.
+          Clock::Get()->SleepUntil(deadline * 1000000LL);
+          re_->RunBlock(deadline, &next_requirements);
+          ResetBumpers();
+          return true;
+        }
+        Clock::Get()->Sleep(time_left);
         return true; // we "played" silence, so return true here
       } else {
         LOG(ERROR) << "Too much time left to sleep post-bumpers.";
@@ -133,20 +199,22 @@ extern int shutdown_requested;
 
 bool AutomationState::ManualOverride() {
   bool did_anything = false;
-  PlaylistPtr op = AutomationState::get_state()->get_override_playlist();
+  PlaylistPtr op = get_override_playlist();
 
-  while (AutomationState::get_state()->get_manual_override() || op->Size()) {
+  while (get_manual_override() || op->Size()) {
     did_anything = true;
     PlayableItem next(db_);
     op->PopFront(&next);
-    if (next.data().has_filename()) {
-      AutomationState::get_state()->get_player()->Play(next);
+    if (next.snapshot()->has_filename()) {
+      get_player()->Play(next);
     } else {
-      // The value of override_ might have changed by now as we didn't hold
-      // a lock on this, which means we'll sleep (and possibly return
-      // true here, although typically we'd be doing that anyway if in this
-      // codepath) perhaps incorrectly here.  I don't think this is a concern.
-      usleep(500);
+      // Nothing queued: sleep until WakeOverride.  Shutdown comes from a
+      // signal handler, which can't notify us, so also check for it now
+      // and then.
+      boost::mutex::scoped_lock lock(override_mutex_);
+      override_wakeup_.timed_wait(lock, boost::posix_time::seconds(1), [this, &op]() {
+        return !override_ || op->Size() || shutdown_requested;
+      });
       if (shutdown_requested) {
         exit(0);
       }
@@ -155,6 +223,13 @@ bool AutomationState::ManualOverride() {
   return did_anything;
 }
 
+void AutomationState::WakeOverride() {
+  // Taking the lock orders this after any ManualOverride that is between
+  // checking for work and going to sleep.
+  boost::mutex::scoped_lock lock(override_mutex_);
+  override_wakeup_.notify_all();
+}
+
 void AutomationState::SetMainshow() {
   mainshow_->Fetch();
   LOG(INFO) << "Randomly selected playlist \"" << mainshow_->Name() << "\" as mainshow.";
@@ -183,3 +258,31 @@ void AutomationState::ResetBumpers() {
     bumperlist_->Fetch(FLAGS_bumpers);
   }
 } 
+void AutomationState::Prefetch(const automation::Schedule& next) {
+  automation::ProtoStore<automation::PlayableItem> store(db_);
+  automation::PlayableItem item;
+  std::vector<std::string> upcoming;
+  auto add = [&](int64 id) {
+    item.Clear();
+    if (store.LoadById(&item, id)) {
+      upcoming.push_back(item.filename());
+    }
+  };
+
+  for (int64 id : mainshow_->Peek(FLAGS_prefetch_items)) {
+    add(id);
+  }
+  for (const automation::Requirement& req : next.schedule()) {
+    for (const automation::PlayableItem& file : req.playlist().items()) {
+      if (file.has_playableitemid()) {
+        add(file.playableitemid());
+      } else {
+        upcoming.push_back(file.filename());
+      }
+    }
+  }
+  for (int64 id : bumperlist_->Peek(1)) {
+    add(id);
+  }
+  Prefetcher::Get()->SetUpcoming(channel_, upcoming);
+}
@@ -20,22 +20,35 @@
 #include "base.h"
 #include "playlist.h"
 #include "mplayersession.h"
+#include "requirement.pb.h"
+#include <atomic>
+#include <map>
 #include <string>
+#include <vector>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 
 class RequirementEngine;
 
-// AutomationState is a singleton class that holds pointers to the
-// current state of the automation system.  It is typically used
-// by code running in different subsystems that are attempting to
-// query or modify the state of the system.  It is thread safe.
+// AutomationState holds pointers to the current state of one channel of the
+// automation system: its player, schedule and playlists.  A process runs one
+// or more channels, which share the database and web server; the default
+// channel has an empty name.  It is typically used by code running in
+// different subsystems that are attempting to query or modify the state of
+// the system.  It is thread safe.
 class AutomationState {
  public:
   // Constructor for the AutomationState object.  The AutomationState class is provided with a copy
   // of the open sqlite3 database associated with the current instance, a reference to
   // the RequirementEngine that dictates the schedule of events (Requirements) for us.  It should already
   // be configured at this point.  It receives a reference to the MplayerSession object it is to use,
-  // a reference to the PlaylistCollection it should use.
-  AutomationState(sqlite3 *db, MplayerSession *mp);
+  // a reference to the PlaylistCollection it should use, and the name of the channel it runs.  Each
+  // channel's schedule is stored separately.
+  AutomationState(sqlite3 *db, MplayerSession *mp, const std::string& channel = "");
+  ~AutomationState();
+
+  // Runs the requirements marked @reboot on this channel.
+  void HandleReboot();
 
   // Advance the running automation state, by possibly playing a track (and blocking until that track
   // has finished playing)
@@ -55,10 +68,26 @@ class AutomationState {
   // to us.  This enables a user of the Web API to use the automation system
   // not as automation, but as a server to deliver digital tracks on-demand in an
   // interactive fashion.
-  void set_manual_override(bool value) { override_ = value; } 
+  void set_manual_override(bool value) { override_ = value; WakeOverride(); }
   bool get_manual_override() { return override_; } 
 
-  static AutomationState *get_state() { return AutomationState::state_; };
+  // Wakes RunOnce if it is idling in manual override, so it notices tracks
+  // added to the override playlist or the end of manual override at once.
+  // Call after making the change, without holding the playlist's lock.
+  void WakeOverride();
+
+  // Makes this the channel get_state() returns on the calling thread.  RunOnce
+  // and HandleReboot do this for themselves, so requirement callbacks act on
+  // the channel that is running them.
+  void MakeCurrent() { current_ = this; }
+
+  // The calling thread's current channel, or failing that the default channel.
+  static AutomationState *get_state();
+  // The named channel, or NULL if this process isn't running it.
+  static AutomationState *get_state(const std::string& channel);
+  static std::vector<std::string> get_channels();
+
+  const std::string& get_channel() const { return channel_; }
   std::shared_ptr<RequirementEngine> get_requirement_engine() const { return re_; }
   PlaylistPtr get_override_playlist() { return override_playlist_; }
   PlaylistPtr get_bumperlist() { return bumperlist_; }
@@ -68,16 +97,26 @@ class AutomationState {
   PlaylistPtr GetMainshow();
  private:
   void ResetBumpers();
+  // Tells the Prefetcher what we're likely to play next: the front of the
+  // mainshow, the files of the requirements in next, and a bumper.
+  void Prefetch(const automation::Schedule& next);
   DISALLOW_COPY_AND_ASSIGN(AutomationState);
   bool ManualOverride();
 
-  static AutomationState* state_;
+  static boost::mutex channels_mutex_;
+  static std::map<std::string, AutomationState*> channels_;
+  static thread_local AutomationState* current_;
+
+  const std::string channel_;
   sqlite3* const db_;
   std::shared_ptr<RequirementEngine> const re_;
 
   MplayerSession* main_player_;
 
-  bool override_;
+  std::atomic<bool> override_;
+  // ManualOverride sleeps on override_wakeup_ while there's nothing to play.
+  boost::mutex override_mutex_;
+  boost::condition_variable override_wakeup_;
   PlaylistPtr const override_playlist_;
   PlaylistPtr const mainshow_;
   PlaylistPtr const bumperlist_;
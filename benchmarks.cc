@@ -0,0 +1,576 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+// Microbenchmarks for the storage, scheduling and selection paths, run against
+// synthetic in-memory databases.  Build with 'make benchmarks' and compare
+// releases with the JSON written by 'make benchmarks.json', e.g. using
+// compare.py from Google Benchmark's tools.
+
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <string>
+#include <tuple>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "catalog.h"
+#include "compression.h"
+#include "db.h"
+#include "http.h"
+#include "metrics.h"
+#include "playableitem.h"
+#include "playlist.h"
+#include "requirementengine.h"
+#include "playlist.pb.h"
+#include "requirement.pb.h"
+
+// The common objects expect these from the binary, as in acmd.
+DEFINE_string(bumpers, "unused", "bumpers - this is unused in this binary needed as a linking hack");
+int shutdown_requested;
+
+namespace {
+
+// Every generated playlist is named like this, numbered from 0.
+std::string PlaylistName(int playlist) {
+  return "playlist" + std::to_string(playlist);
+}
+
+// A database with items PlayableItems of 1 to 10 minutes, spread round-robin
+// over playlists Playlists, and a Schedule of requirements requirements each
+// due at some minute of some hours.  Generation is deterministic, and
+// databases are kept for the life of the process, so every benchmark of a
+// given shape sees the same data.
+sqlite3* SyntheticDatabase(int items, int playlists, int requirements) {
+  static std::map<std::tuple<int, int, int>, sqlite3*> databases;
+  sqlite3*& db = databases[std::make_tuple(items, playlists, requirements)];
+  if (db) {
+    return db;
+  }
+  CHECK(sqlite3_open(":memory:", &db) == SQLITE_OK);
+  InitializeSchema(db);
+  CHECK(sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL) == SQLITE_OK);
+
+  sqlite3_stmt* ps;
+  CHECK(sqlite3_prepare_v2(db, "INSERT INTO Playlist (PlaylistID, name, weight) VALUES (?, ?, ?)",
+                           -1, &ps, NULL) == SQLITE_OK);
+  for (int i = 0; i < playlists; ++i) {
+    const std::string name = PlaylistName(i);
+    sqlite3_bind_int64(ps, 1, i + 1);
+    sqlite3_bind_text(ps, 2, name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(ps, 3, 1 + i % 10);
+    CHECK(sqlite3_step(ps) == SQLITE_DONE) << sqlite3_errmsg(db);
+    sqlite3_reset(ps);
+  }
+  sqlite3_finalize(ps);
+
+  sqlite3_stmt* join;
+  CHECK(sqlite3_prepare_v2(db, "INSERT INTO PlayableItem (PlayableItemID, filename, duration, "
+                           "description, playcount) VALUES (?, ?, ?, ?, 0)", -1, &ps, NULL) == SQLITE_OK);
+  CHECK(sqlite3_prepare_v2(db, "INSERT INTO Playlist_PlayableItemID (PlaylistID, PlayableItemID) "
+                           "VALUES (?, ?)", -1, &join, NULL) == SQLITE_OK);
+  for (int i = 0; i < items; ++i) {
+    char filename[64], description[64];
+    snprintf(filename, sizeof filename, "/music/artist%d/track%d.mp3", i % 997, i);
+    snprintf(description, sizeof description, "Artist %d - Track %d", i % 997, i);
+    sqlite3_bind_int64(ps, 1, i + 1);
+    sqlite3_bind_text(ps, 2, filename, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(ps, 3, 60 + (i * 7919) % 540);
+    sqlite3_bind_text(ps, 4, description, -1, SQLITE_TRANSIENT);
+    CHECK(sqlite3_step(ps) == SQLITE_DONE) << sqlite3_errmsg(db);
+    sqlite3_reset(ps);
+    if (playlists) {
+      sqlite3_bind_int64(join, 1, i % playlists + 1);
+      sqlite3_bind_int64(join, 2, i + 1);
+      CHECK(sqlite3_step(join) == SQLITE_DONE) << sqlite3_errmsg(db);
+      sqlite3_reset(join);
+    }
+  }
+  sqlite3_finalize(ps);
+  sqlite3_finalize(join);
+
+  automation::Schedule schedule;
+  for (int i = 0; i < requirements; ++i) {
+    automation::Requirement* req = schedule.add_schedule();
+    req->set_type(automation::Requirement::NO_OP);
+    req->mutable_when()->add_constrained_seconds(0);
+    req->mutable_when()->add_constrained_minutes((i * 13) % 60);
+    req->mutable_when()->add_constrained_hours(i % 24);
+    req->mutable_when()->set_gap(180);
+  }
+  CHECK(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+  RequirementEngine(db).Import(db, &schedule);
+  return db;
+}
+
+// SyntheticDatabase copied to a file, for code that opens further connections
+// to the same database; an in-memory one can't be shared that way.
+sqlite3* SyntheticDatabaseFile(int items, int playlists, int requirements) {
+  static std::map<std::tuple<int, int, int>, sqlite3*> databases;
+  sqlite3*& db = databases[std::make_tuple(items, playlists, requirements)];
+  if (db) {
+    return db;
+  }
+  const std::string path = "/tmp/benchmarks-" + std::to_string(getpid()) + "-" +
+      std::to_string(databases.size()) + ".db";
+  unlink(path.c_str());
+  CHECK(sqlite3_open(path.c_str(), &db) == SQLITE_OK);
+  sqlite3_backup* backup = sqlite3_backup_init(
+      db, "main", SyntheticDatabase(items, playlists, requirements), "main");
+  CHECK(backup);
+  CHECK(sqlite3_backup_step(backup, -1) == SQLITE_DONE) << sqlite3_errmsg(db);
+  sqlite3_backup_finish(backup);
+  return db;
+}
+
+void BM_MessageStoreLoad(benchmark::State& state) {
+  sqlite3* db = SyntheticDatabase(state.range(0), 1, 0);
+  automation::ProtoStore<automation::PlayableItem> store(db);
+  automation::PlayableItem item;
+  int i = 0;
+  for (auto _ : state) {
+    char filename[64];
+    snprintf(filename, sizeof filename, "/music/artist%d/track%d.mp3", i % 997, i);
+    item.Clear();
+    item.set_filename(filename);
+    benchmark::DoNotOptimize(store.Load(&item));
+    i = (i + 1) % state.range(0);
+  }
+}
+BENCHMARK(BM_MessageStoreLoad)->Range(1 << 10, 1 << 17);
+
+void BM_MessageStoreLoadById(benchmark::State& state) {
+  sqlite3* db = SyntheticDatabase(state.range(0), 1, 0);
+  automation::ProtoStore<automation::PlayableItem> store(db);
+  automation::PlayableItem item;
+  int i = 0;
+  for (auto _ : state) {
+    item.Clear();
+    benchmark::DoNotOptimize(store.LoadById(&item, i + 1));
+    i = (i + 1) % state.range(0);
+  }
+}
+BENCHMARK(BM_MessageStoreLoadById)->Range(1 << 10, 1 << 17);
+
+void BM_MessageStoreInsert(benchmark::State& state) {
+  // A database of its own, since this one keeps growing.
+  sqlite3* db = SyntheticDatabase(state.range(0), 0, 1);
+  automation::ProtoStore<automation::PlayableItem> store(db);
+  static int next = 0;
+  for (auto _ : state) {
+    automation::PlayableItem item;
+    item.set_filename("/music/inserted/track" + std::to_string(next++) + ".mp3");
+    item.set_duration(180);
+    store.Insert(&item);
+  }
+}
+BENCHMARK(BM_MessageStoreInsert)->Range(1 << 10, 1 << 17);
+
+void BM_MessageStoreReplace(benchmark::State& state) {
+  sqlite3* db = SyntheticDatabase(state.range(0), 1, 0);
+  automation::ProtoStore<automation::PlayableItem> store(db);
+  automation::PlayableItem item;
+  CHECK(store.LoadById(&item, 1));
+  for (auto _ : state) {
+    item.set_playcount(item.playcount() + 1);
+    store.Replace(&item);
+  }
+}
+BENCHMARK(BM_MessageStoreReplace)->Range(1 << 10, 1 << 17);
+
+void BM_ProtoStoreLoadAll(benchmark::State& state) {
+  sqlite3* db = SyntheticDatabase(state.range(0), 1, 0);
+  automation::ProtoStore<automation::PlayableItem> store(db);
+  for (auto _ : state) {
+    RepeatedPtrField<automation::PlayableItem> items;
+    benchmark::DoNotOptimize(store.LoadAll(&items, INT64_MAX, 0));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ProtoStoreLoadAll)->Range(1 << 10, 1 << 17);
+
+// In builds with -DCOUNT_ALLOCATIONS, reports the heap allocations made on
+// the benchmark's thread since before, per iteration.
+void CountAllocations(benchmark::State& state, int64_t before) {
+  if (metrics::kCountAllocations) {
+    state.counters["allocations"] = benchmark::Counter(
+        metrics::ThreadAllocations() - before, benchmark::Counter::kAvgIterations);
+  }
+}
+
+// Playlist benchmarks are over a database of range(0) items in 16 playlists.
+void BM_PlaylistFetchByName(benchmark::State& state) {
+  Playlist playlist(SyntheticDatabase(state.range(0), 16, 0));
+  int i = 0;
+  const int64_t allocations = metrics::ThreadAllocations();
+  for (auto _ : state) {
+    CHECK(playlist.Fetch(PlaylistName(i++ % 16)));
+  }
+  CountAllocations(state, allocations);
+  state.SetItemsProcessed(state.iterations() * state.range(0) / 16);
+}
+BENCHMARK(BM_PlaylistFetchByName)->Range(1 << 10, 1 << 17);
+
+void BM_PlaylistFetchShuffled(benchmark::State& state) {
+  Playlist playlist(SyntheticDatabase(state.range(0), 16, 0));
+  int i = 0;
+  for (auto _ : state) {
+    CHECK(playlist.FetchShuffled(PlaylistName(i++ % 16)));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) / 16);
+}
+BENCHMARK(BM_PlaylistFetchShuffled)->Range(1 << 10, 1 << 17);
+
+// Weighted random choice of mainshow, as on startup and by SET_MAINSHOW.
+void BM_PlaylistFetchRandom(benchmark::State& state) {
+  Playlist playlist(SyntheticDatabase(state.range(0), 16, 0));
+  for (auto _ : state) {
+    CHECK(playlist.Fetch());
+  }
+}
+BENCHMARK(BM_PlaylistFetchRandom)->Range(1 << 10, 1 << 17);
+
+void BM_PlaylistFetchSuperlist(benchmark::State& state) {
+  Playlist playlist(SyntheticDatabase(state.range(0), 16, 0));
+  const int64_t allocations = metrics::ThreadAllocations();
+  for (auto _ : state) {
+    CHECK(playlist.FetchSuperlist(LLONG_MAX, 0));
+  }
+  CountAllocations(state, allocations);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PlaylistFetchSuperlist)->Range(1 << 10, 1 << 17);
+
+// What automation does before it can start its first track: pick a mainshow,
+// load every item as bumpers and pop something to play, from SQLite if
+// range(1) is 0, or else from a catalog snapshot, mapped afresh each time (the
+// file stays in the page cache, so this is a warm start).
+void BM_ColdStart(benchmark::State& state) {
+  sqlite3* db = SyntheticDatabase(state.range(0), 16, 0);
+  const std::string path = "/tmp/benchmarks-" + std::to_string(getpid()) + ".catalog";
+  if (state.range(1)) {
+    CHECK(Catalog::Write(db, path));
+  }
+  for (auto _ : state) {
+    Catalog::Set(state.range(1) ? Catalog::Open(path) : nullptr);
+    Playlist mainshow(db), bumpers(db);
+    mainshow.NeverSave();
+    bumpers.NeverSave();
+    CHECK(mainshow.Fetch());
+    CHECK(bumpers.FetchSuperlist(LLONG_MAX, 0));
+    PlayableItem item(db);
+    mainshow.PopWithTimelimit(600, &item);
+    CHECK(item.snapshot()->has_filename());
+  }
+  Catalog::Set(nullptr);
+  unlink(path.c_str());
+}
+BENCHMARK(BM_ColdStart)->Ranges({{1 << 14, 1 << 18}, {0, 1}})->Unit(benchmark::kMillisecond);
+
+// Pops with a limit of range(1) seconds, so short limits have to skip (and
+// load) more items before finding one that fits.
+void BM_PlaylistPopWithTimelimit(benchmark::State& state) {
+  sqlite3* db = SyntheticDatabase(state.range(0), 16, 0);
+  Playlist playlist(db);
+  PlayableItem item(db);
+  for (auto _ : state) {
+    if (playlist.Size() == 0) {
+      state.PauseTiming();
+      CHECK(playlist.FetchShuffled(PlaylistName(0)));
+      state.ResumeTiming();
+    }
+    playlist.PopWithTimelimit(state.range(1), &item);
+    if (!item.snapshot()->has_filename()) {
+      // Nothing left fits; start over.
+      state.PauseTiming();
+      playlist.Clear();
+      state.ResumeTiming();
+    }
+  }
+}
+BENCHMARK(BM_PlaylistPopWithTimelimit)->Ranges({{1 << 10, 1 << 17}, {90, 600}});
+
+// Pops from the front of all range(0) items, as the bumper list falls back
+// to with no --bumpers.  Each pop changes the list, so it shouldn't cost more
+// for a longer one.
+void BM_PlaylistPopSuperlist(benchmark::State& state) {
+  sqlite3* db = SyntheticDatabase(state.range(0), 16, 0);
+  Playlist playlist(db);
+  PlayableItem item(db);
+  CHECK(playlist.FetchSuperlist(LLONG_MAX, 0));
+  for (auto _ : state) {
+    if (!playlist.Size()) {
+      state.PauseTiming();
+      CHECK(playlist.FetchSuperlist(LLONG_MAX, 0));
+      state.ResumeTiming();
+    }
+    playlist.PopFront(&item);
+  }
+}
+BENCHMARK(BM_PlaylistPopSuperlist)->Range(1 << 10, 1 << 17);
+
+// range(1) is the number of threads Filter may use; with range(2) set the
+// database is on disk, so workers beyond the first read through their own
+// connections.  Only the calling thread's allocations are counted, so all of
+// them show up only with one thread.
+void BM_PlaylistFilter(benchmark::State& state) {
+  Playlist playlist(state.range(2) ? SyntheticDatabaseFile(state.range(0), 16, 0)
+                                   : SyntheticDatabase(state.range(0), 16, 0));
+  CHECK(playlist.FetchSuperlist(LLONG_MAX, 0));
+  const int64_t allocations = metrics::ThreadAllocations();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(playlist.Filter("artist(1|2)[0-9]/track[0-9]*7\\.mp3", state.range(1)));
+  }
+  CountAllocations(state, allocations);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PlaylistFilter)
+    ->ArgsProduct({{1 << 10, 1 << 14}, {1, 4}, {0}})
+    ->ArgsProduct({{200000}, {1, 4, 16}, {0, 1}})
+    ->UseRealTime();
+
+// range(0) requirements, spread over the hours of the day.
+void BM_RequirementEngineFillNext(benchmark::State& state) {
+  RequirementEngine engine(SyntheticDatabase(0, 0, state.range(0)));
+  for (auto _ : state) {
+    automation::Schedule next;
+    time_t deadline, gap;
+    engine.FillNext(&next, &deadline, &gap);
+    benchmark::DoNotOptimize(deadline);
+  }
+}
+BENCHMARK(BM_RequirementEngineFillNext)->RangeMultiplier(4)->Range(1, 256);
+
+void BM_RequirementEngineIsDue(benchmark::State& state) {
+  automation::Requirement req;
+  req.set_type(automation::Requirement::NO_OP);
+  req.mutable_when()->add_constrained_seconds(0);
+  req.mutable_when()->add_constrained_minutes(30);
+  for (int i = 0; i < state.range(0); ++i) {
+    req.mutable_when()->add_constrained_hours(i);
+  }
+  time_t when = 1500000000;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(RequirementEngine::IsDue(req, when++));
+  }
+}
+BENCHMARK(BM_RequirementEngineIsDue)->Arg(0)->Arg(1)->Arg(24);
+
+// A fetchall response for a library of items items, as ReturnMessage would
+// serialize it.
+std::string FetchallBody(int items, const std::string& format, bool pretty) {
+  sqlite3* db = SyntheticDatabase(items, 1, 0);
+  automation::Playlist playlist;
+  automation::ProtoStore<automation::PlayableItem>(db).LoadAll(
+      playlist.mutable_items(), INT64_MAX, 0);
+  std::string output;
+  SerializeMessage(playlist, format, &output, pretty);
+  return output;
+}
+
+// What ReturnMessage spends serializing a playlist of range(0) expanded items.
+void BM_SerializeMessage(benchmark::State& state, const std::string& format, bool pretty) {
+  sqlite3* db = SyntheticDatabase(state.range(0), 1, 0);
+  automation::Playlist playlist;
+  automation::ProtoStore<automation::PlayableItem>(db).LoadAll(
+      playlist.mutable_items(), INT64_MAX, 0);
+  std::string output;
+  for (auto _ : state) {
+    output.clear();
+    SerializeMessage(playlist, format, &output, pretty);
+  }
+  state.SetBytesProcessed(state.iterations() * output.size());
+  state.counters["bytes"] = output.size();
+}
+BENCHMARK_CAPTURE(BM_SerializeMessage, pb, std::string("pb"), true)->Range(1 << 6, 1 << 14);
+BENCHMARK_CAPTURE(BM_SerializeMessage, json, std::string("json"), true)->Range(1 << 6, 1 << 14);
+BENCHMARK_CAPTURE(BM_SerializeMessage, compact_json, std::string("json"), false)
+    ->Range(1 << 6, 1 << 14);
+
+// What compressing a fetchall response of range(0) items costs, and how much
+// smaller it gets ("ratio" is compressed over original size).  The wire size
+// of a response is bytes * ratio.
+void BM_CompressResponse(benchmark::State& state, ContentCoding coding,
+                         const std::string& format, bool pretty) {
+  const std::string body = FetchallBody(state.range(0), format, pretty);
+  std::string output;
+  for (auto _ : state) {
+    output.clear();
+    Compressor::ForThread(coding)->Compress(body.data(), body.size(), true, &output);
+  }
+  state.SetBytesProcessed(state.iterations() * body.size());
+  state.counters["bytes"] = body.size();
+  state.counters["ratio"] = double(output.size()) / body.size();
+}
+BENCHMARK_CAPTURE(BM_CompressResponse, gzip_json, ContentCoding::GZIP, std::string("json"), true)
+    ->Range(1 << 10, 1 << 14);
+BENCHMARK_CAPTURE(BM_CompressResponse, zstd_json, ContentCoding::ZSTD, std::string("json"), true)
+    ->Range(1 << 10, 1 << 14);
+BENCHMARK_CAPTURE(BM_CompressResponse, gzip_compact_json, ContentCoding::GZIP,
+                  std::string("json"), false)->Range(1 << 10, 1 << 14);
+BENCHMARK_CAPTURE(BM_CompressResponse, zstd_compact_json, ContentCoding::ZSTD,
+                  std::string("json"), false)->Range(1 << 10, 1 << 14);
+BENCHMARK_CAPTURE(BM_CompressResponse, gzip_pb, ContentCoding::GZIP, std::string("pb"), true)
+    ->Range(1 << 10, 1 << 14);
+BENCHMARK_CAPTURE(BM_CompressResponse, zstd_pb, ContentCoding::ZSTD, std::string("pb"), true)
+    ->Range(1 << 10, 1 << 14);
+
+// A server and a client SSL_CTX configured as the Web API's is under
+// --secure, sharing one self-signed certificate that each side trusts.
+struct TlsContexts {
+  SSL_CTX *server;
+  SSL_CTX *client;
+};
+
+const TlsContexts& Contexts() {
+  static const TlsContexts contexts = []() {
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *keygen = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+    CHECK(EVP_PKEY_keygen_init(keygen) > 0);
+    CHECK(EVP_PKEY_CTX_set_rsa_keygen_bits(keygen, 2048) > 0);
+    CHECK(EVP_PKEY_keygen(keygen, &key) > 0);
+    EVP_PKEY_CTX_free(keygen);
+    X509 *certificate = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 86400);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(certificate), "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char*>("benchmarks"), -1, -1, 0);
+    X509_set_issuer_name(certificate, X509_get_subject_name(certificate));
+    X509_set_pubkey(certificate, key);
+    CHECK(X509_sign(certificate, key, EVP_sha256()) > 0);
+
+    TlsContexts contexts{SSL_CTX_new(TLS_server_method()), SSL_CTX_new(TLS_client_method())};
+    for (SSL_CTX *ctx : {contexts.server, contexts.client}) {
+      CHECK_EQ(SSL_CTX_use_certificate(ctx, certificate), 1);
+      CHECK_EQ(SSL_CTX_use_PrivateKey(ctx, key), 1);
+      CHECK_EQ(X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx), certificate), 1);
+    }
+    SSL_CTX_set_verify(contexts.server, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
+    SSL_CTX_set_verify(contexts.client, SSL_VERIFY_PEER, nullptr);
+    EnableSessionResumption(contexts.server, 1024, 3600);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return contexts;
+  }();
+  return contexts;
+}
+
+// A client connected to a server through a pair of memory BIOs, so that only
+// the TLS work is measured and not the network.
+class TlsConnection {
+ public:
+  // Connects, resuming session if it isn't null.
+  explicit TlsConnection(SSL_SESSION *session)
+      : client_(SSL_new(Contexts().client)), server_(SSL_new(Contexts().server)) {
+    BIO *client_bio, *server_bio;
+    CHECK_EQ(BIO_new_bio_pair(&client_bio, 0, &server_bio, 0), 1);
+    SSL_set_bio(client_, client_bio, client_bio);
+    SSL_set_bio(server_, server_bio, server_bio);
+    if (session) {
+      SSL_set_session(client_, session);
+    }
+    SSL_set_connect_state(client_);
+    SSL_set_accept_state(server_);
+    bool client_done = false, server_done = false;
+    for (int i = 0; !client_done || !server_done; ++i) {
+      CHECK_LT(i, 16) << "TLS handshake didn't finish";
+      client_done = SSL_do_handshake(client_) == 1;
+      server_done = SSL_do_handshake(server_) == 1;
+    }
+  }
+  ~TlsConnection() {
+    // Closed cleanly, as a session cut short isn't resumed.
+    SSL_shutdown(client_);
+    SSL_shutdown(server_);
+    SSL_free(client_);
+    SSL_free(server_);
+  }
+
+  // A small API request and its response, with the server looking up who the
+  // client is as handle_command does.
+  void Request() {
+    static const char request[] = "GET /status HTTP/1.1\r\nHost: automation\r\n\r\n";
+    static const std::string response(512, 'x');
+    char buf[1024];
+    CHECK_EQ(SSL_write(client_, request, sizeof request - 1), int(sizeof request - 1));
+    CHECK_EQ(SSL_read(server_, buf, sizeof buf), int(sizeof request - 1));
+    benchmark::DoNotOptimize(PeerIdentity(server_));
+    CHECK_EQ(SSL_write(server_, response.data(), response.size()), int(response.size()));
+    CHECK_EQ(SSL_read(client_, buf, sizeof buf), int(response.size()));
+  }
+
+  bool resumed() const { return SSL_session_reused(client_); }
+  // The session to resume on the next connection.  Only call after a
+  // Request, as TLS 1.3 servers send tickets after the handshake.
+  SSL_SESSION* session() const { return SSL_get1_session(client_); }
+
+ private:
+  SSL *client_;
+  SSL *server_;
+};
+
+// API requests over TLS with mutual authentication, as under --secure: with
+// range(0) 0 each request opens a connection and does the full handshake, 1
+// opens one but resumes the previous connection's session, and 2 sends every
+// request down one kept-alive connection.
+void BM_ApiRequestTls(benchmark::State& state) {
+  const int reuse = state.range(0);
+  std::unique_ptr<TlsConnection> kept_alive;
+  SSL_SESSION *session = nullptr;
+  if (reuse == 1) {
+    TlsConnection first(nullptr);
+    first.Request();
+    session = first.session();
+  } else if (reuse == 2) {
+    kept_alive.reset(new TlsConnection(nullptr));
+  }
+  int64_t resumed = 0;
+  for (auto _ : state) {
+    if (kept_alive) {
+      kept_alive->Request();
+      continue;
+    }
+    TlsConnection connection(session);
+    connection.Request();
+    resumed += connection.resumed();
+    if (session) {
+      SSL_SESSION_free(session);
+      session = connection.session();
+    }
+  }
+  SSL_SESSION_free(session);
+  state.counters["requests/s"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+  state.counters["resumed"] = benchmark::Counter(resumed, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_ApiRequestTls)->DenseRange(0, 2);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,417 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "catalog.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <glog/logging.h>
+#include "metrics.h"
+#include "trace.h"
+
+namespace {
+const char kMagic[8] = {'A', 'C', 'A', 'T', 'L', 'G', '0', '1'};
+
+std::shared_ptr<const Catalog> current;
+
+size_t Align(size_t offset) {
+  return (offset + 7) & ~size_t(7);
+}
+
+// Appends the bytes of values to file at its next 8-byte boundary, returning
+// where they went.
+template<class T> uint64_t Append(std::string* file, const std::vector<T>& values) {
+  file->resize(Align(file->size()));
+  const uint64_t offset = file->size();
+  file->append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+  return offset;
+}
+
+// Steps ps, returning false at the end of its rows and throwing on error.
+bool Step(sqlite3 *db, sqlite3_stmt *ps) {
+  const int result = sqlite3_step(ps);
+  if (result != SQLITE_ROW && result != SQLITE_DONE) {
+    throw std::runtime_error(sqlite3_errmsg(db));
+  }
+  return result == SQLITE_ROW;
+}
+
+const char* Text(sqlite3_stmt *ps, int column) {
+  const unsigned char *text = sqlite3_column_text(ps, column);
+  return text ? reinterpret_cast<const char*>(text) : "";
+}
+}
+
+Catalog::Catalog(const void *base, size_t length) :
+  base_(base),
+  length_(length),
+  header_(static_cast<const Header*>(base)) {
+}
+
+Catalog::~Catalog() {
+  munmap(const_cast<void*>(base_), length_);
+}
+
+int64_t Catalog::Version(sqlite3 *db) {
+  sqlite3_stmt *ps;
+  if (sqlite3_prepare_v2(db, "SELECT version FROM CatalogVersion", -1, &ps, NULL) != SQLITE_OK) {
+    return -1;  // Not upgraded yet.
+  }
+  const int64_t version = sqlite3_step(ps) == SQLITE_ROW ? sqlite3_column_int64(ps, 0) : -1;
+  sqlite3_finalize(ps);
+  return version;
+}
+
+bool Catalog::Write(sqlite3 *db, const std::string& path) {
+  TRACE_SCOPE("Catalog::Write");
+  std::vector<int64_t> ids;
+  std::vector<int32_t> durations, playcounts, by_duration, members;
+  std::vector<uint32_t> filenames;
+  std::vector<PlaylistEntry> playlists;
+  std::string strings;
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+
+  // Read in one transaction, so that the version is that of what is read.
+  if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+    LOG(WARNING) << "Unable to snapshot the catalog: " << sqlite3_errmsg(db);
+    return false;
+  }
+  sqlite3_stmt *items = NULL, *lists = NULL, *joins = NULL;
+  try {
+    header.version = Version(db);
+    if (header.version < 0) {
+      throw std::runtime_error("no CatalogVersion; the schema needs upgrading");
+    }
+    CHECK(sqlite3_prepare_v2(db, "SELECT PlayableItemID, duration, playcount, filename FROM PlayableItem "
+                                 "WHERE NOT missing ORDER BY PlayableItemID", -1, &items, NULL) == SQLITE_OK)
+        << sqlite3_errmsg(db);
+    while (Step(db, items)) {
+      ids.push_back(sqlite3_column_int64(items, 0));
+      durations.push_back(sqlite3_column_int(items, 1));
+      playcounts.push_back(sqlite3_column_int(items, 2));
+      filenames.push_back(strings.size());
+      strings += Text(items, 3);
+    }
+    filenames.push_back(strings.size());
+
+    CHECK(sqlite3_prepare_v2(db, "SELECT PlaylistID, name, weight FROM Playlist ORDER BY PlaylistID",
+                             -1, &lists, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+    while (Step(db, lists)) {
+      const char *name = Text(lists, 1);
+      playlists.push_back({sqlite3_column_int64(lists, 0), sqlite3_column_int64(lists, 2),
+                           static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(strlen(name)),
+                           0, 0});
+      strings += name;
+    }
+
+    CHECK(sqlite3_prepare_v2(db, "SELECT PlaylistID, PlayableItemID FROM Playlist_PlayableItemID "
+                                 "ORDER BY PlaylistID", -1, &joins, NULL) == SQLITE_OK)
+        << sqlite3_errmsg(db);
+    size_t playlist = 0;
+    while (Step(db, joins)) {
+      const int64_t playlistid = sqlite3_column_int64(joins, 0);
+      while (playlist < playlists.size() && playlists[playlist].id < playlistid) {
+        ++playlist;
+      }
+      auto item = std::lower_bound(ids.begin(), ids.end(), sqlite3_column_int64(joins, 1));
+      if (playlist == playlists.size() || playlists[playlist].id != playlistid ||
+          item == ids.end() || *item != sqlite3_column_int64(joins, 1)) {
+        continue;  // Missing from disk.
+      }
+      if (!playlists[playlist].member_count) {
+        playlists[playlist].first_member = members.size();
+      }
+      ++playlists[playlist].member_count;
+      members.push_back(item - ids.begin());
+    }
+  } catch (const std::exception& e) {
+    LOG(WARNING) << "Unable to snapshot the catalog: " << e.what();
+    sqlite3_finalize(items);
+    sqlite3_finalize(lists);
+    sqlite3_finalize(joins);
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    return false;
+  }
+  sqlite3_finalize(items);
+  sqlite3_finalize(lists);
+  sqlite3_finalize(joins);
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  if (strings.size() > UINT32_MAX || ids.size() > INT32_MAX) {
+    LOG(WARNING) << "The catalog is too big to snapshot.";
+    return false;
+  }
+
+  // Longest first, ties in ID order.  FindPlaylist shuffles the ties.
+  auto longer = [&durations](int32_t a, int32_t b) {
+    return durations[a] > durations[b] || (durations[a] == durations[b] && a < b);
+  };
+  for (int32_t i = 0; i < static_cast<int32_t>(ids.size()); ++i) {
+    by_duration.push_back(i);
+  }
+  std::sort(by_duration.begin(), by_duration.end(), longer);
+  for (const PlaylistEntry& entry : playlists) {
+    std::sort(members.begin() + entry.first_member,
+              members.begin() + entry.first_member + entry.member_count, longer);
+  }
+
+  header.item_count = ids.size();
+  header.playlist_count = playlists.size();
+  header.member_count = members.size();
+  header.string_bytes = strings.size();
+  std::string file(sizeof(header), '\0');
+  header.ids = Append(&file, ids);
+  header.durations = Append(&file, durations);
+  header.playcounts = Append(&file, playcounts);
+  header.filenames = Append(&file, filenames);
+  header.by_duration = Append(&file, by_duration);
+  header.playlists = Append(&file, playlists);
+  header.members = Append(&file, members);
+  header.strings = Append(&file, std::vector<char>(strings.begin(), strings.end()));
+  memcpy(&file[0], &header, sizeof(header));
+
+  // Written aside and renamed over, so that a reader only ever maps a whole one.
+  const std::string temp = path + ".tmp." + std::to_string(getpid());
+  FILE *out = fopen(temp.c_str(), "w");
+  if (!out) {
+    LOG(WARNING) << "Unable to write " << temp << ": " << strerror(errno);
+    return false;
+  }
+  const bool written = fwrite(file.data(), 1, file.size(), out) == file.size();
+  if (fclose(out) || !written || rename(temp.c_str(), path.c_str())) {
+    LOG(WARNING) << "Unable to write " << path << ": " << strerror(errno);
+    unlink(temp.c_str());
+    return false;
+  }
+  VLOG(5) << "Wrote catalog snapshot version " << header.version << " of " << ids.size()
+          << " items to " << path;
+  return true;
+}
+
+std::shared_ptr<const Catalog> Catalog::Open(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      LOG(WARNING) << "Unable to open " << path << ": " << strerror(errno);
+    }
+    return nullptr;
+  }
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (!fstat(fd, &st) && st.st_size > 0) {
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) {
+    LOG(WARNING) << "Unable to map " << path << ": " << strerror(errno);
+    return nullptr;
+  }
+  std::shared_ptr<const Catalog> catalog(new Catalog(base, st.st_size));
+  if (!catalog->Valid()) {
+    LOG(WARNING) << "Ignoring corrupt catalog snapshot " << path;
+    return nullptr;
+  }
+  return catalog;
+}
+
+bool Catalog::Valid() const {
+  if (length_ < sizeof(Header) || memcmp(header_->magic, kMagic, sizeof(kMagic)) ||
+      header_->item_count < 0 || header_->playlist_count < 0 || header_->member_count < 0 ||
+      header_->string_bytes < 0) {
+    return false;
+  }
+  // Each section must lie within the file; the counts are checked first so
+  // that the sizes can't overflow.
+  const uint64_t limit = length_;
+  auto fits = [limit](uint64_t offset, uint64_t count, uint64_t size) {
+    return count <= limit && offset <= limit && offset % 8 == 0 && count * size <= limit - offset;
+  };
+  const uint64_t items = header_->item_count;
+  if (!fits(header_->ids, items, sizeof(int64_t)) ||
+      !fits(header_->durations, items, sizeof(int32_t)) ||
+      !fits(header_->playcounts, items, sizeof(int32_t)) ||
+      !fits(header_->filenames, items + 1, sizeof(uint32_t)) ||
+      !fits(header_->by_duration, items, sizeof(int32_t)) ||
+      !fits(header_->playlists, header_->playlist_count, sizeof(PlaylistEntry)) ||
+      !fits(header_->members, header_->member_count, sizeof(int32_t)) ||
+      !fits(header_->strings, header_->string_bytes, 1)) {
+    return false;
+  }
+  // And everything that refers elsewhere must point within it.
+  const uint32_t* filenames = Section<uint32_t>(header_->filenames);
+  for (uint64_t i = 0; i < items; ++i) {
+    if (filenames[i] > filenames[i + 1]) {
+      return false;
+    }
+  }
+  if (filenames[items] > static_cast<uint64_t>(header_->string_bytes)) {
+    return false;
+  }
+  const int32_t* by_duration = Section<int32_t>(header_->by_duration);
+  for (uint64_t i = 0; i < items; ++i) {
+    if (by_duration[i] < 0 || static_cast<uint64_t>(by_duration[i]) >= items) {
+      return false;
+    }
+  }
+  const int32_t* members = Section<int32_t>(header_->members);
+  for (int64_t i = 0; i < header_->member_count; ++i) {
+    if (members[i] < 0 || static_cast<uint64_t>(members[i]) >= items) {
+      return false;
+    }
+  }
+  const PlaylistEntry* playlists = Section<PlaylistEntry>(header_->playlists);
+  for (int64_t i = 0; i < header_->playlist_count; ++i) {
+    if (uint64_t(playlists[i].name) + playlists[i].name_length > uint64_t(header_->string_bytes) ||
+        uint64_t(playlists[i].first_member) + playlists[i].member_count > uint64_t(header_->member_count)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<const Catalog> Catalog::Get(sqlite3 *db) {
+  static metrics::Counter* stale = metrics::GetCounter("catalog_stale_total",
+      "Times the catalog snapshot was out of date, so SQLite was used instead.", "");
+  std::shared_ptr<const Catalog> catalog = std::atomic_load(&current);
+  if (!catalog) {
+    return nullptr;
+  }
+  if (catalog->version() != Version(db)) {
+    stale->Increment();
+    return nullptr;
+  }
+  return catalog;
+}
+
+void Catalog::Set(std::shared_ptr<const Catalog> catalog) {
+  std::atomic_store(&current, catalog);
+}
+
+void Catalog::Maintain(sqlite3 *db, const std::string& path, int interval_seconds) {
+  Set(Open(path));
+  boost::thread([db, path, interval_seconds]() {
+    while (true) {
+      std::shared_ptr<const Catalog> catalog = std::atomic_load(&current);
+      if ((!catalog || catalog->version() != Version(db)) && Write(db, path)) {
+        Set(Open(path));
+      }
+      sleep(std::max(1, interval_seconds));
+    }
+  }).detach();
+}
+
+bool Catalog::FindItem(int64_t id, automation::PlayableItem *item) const {
+  const int64_t* ids = Section<int64_t>(header_->ids);
+  const int64_t* end = ids + header_->item_count;
+  const int64_t* found = std::lower_bound(ids, end, id);
+  if (found == end || *found != id) {
+    return false;
+  }
+  const size_t i = found - ids;
+  const uint32_t* filenames = Section<uint32_t>(header_->filenames);
+  item->set_playableitemid(id);
+  item->set_filename(Section<char>(header_->strings) + filenames[i], filenames[i + 1] - filenames[i]);
+  item->set_duration(Section<int32_t>(header_->durations)[i]);
+  item->set_playcount(Section<int32_t>(header_->playcounts)[i]);
+  return true;
+}
+
+bool Catalog::FindPlaylist(const std::string& name, automation::Playlist *result) const {
+  const PlaylistEntry* playlists = Section<PlaylistEntry>(header_->playlists);
+  const char* strings = Section<char>(header_->strings);
+  for (int64_t i = 0; i < header_->playlist_count; ++i) {
+    const PlaylistEntry& entry = playlists[i];
+    if (entry.name_length != name.size() || name.compare(0, name.size(), strings + entry.name,
+                                                         entry.name_length)) {
+      continue;
+    }
+    if (!entry.member_count) {
+      return false;
+    }
+    result->set_playlistid(entry.id);
+    result->set_name(name);
+    result->set_weight(entry.weight);
+    const int64_t* ids = Section<int64_t>(header_->ids);
+    const int32_t* durations = Section<int32_t>(header_->durations);
+    const int32_t* members = Section<int32_t>(header_->members) + entry.first_member;
+    google::protobuf::RepeatedField<google::protobuf::int64>* songs = result->mutable_playableitemid();
+    songs->Reserve(songs->size() + entry.member_count);
+    for (uint32_t run = 0; run < entry.member_count;) {
+      uint32_t end = run + 1;
+      while (end < entry.member_count && durations[members[end]] == durations[members[run]]) {
+        ++end;
+      }
+      const int first = songs->size();
+      for (uint32_t j = run; j < end; ++j) {
+        songs->AddAlreadyReserved(ids[members[j]]);
+      }
+      std::random_shuffle(songs->begin() + first, songs->end());
+      run = end;
+    }
+    return true;
+  }
+  return false;
+}
+
+std::string Catalog::PickPlaylist() const {
+  const PlaylistEntry* playlists = Section<PlaylistEntry>(header_->playlists);
+  int64_t total = 0;
+  for (int64_t i = 0; i < header_->playlist_count; ++i) {
+    if (playlists[i].member_count && playlists[i].weight > 0) {
+      total += playlists[i].weight;
+    }
+  }
+  if (!total) {
+    return "";
+  }
+  int64_t pick = std::rand() % total;
+  for (int64_t i = 0; i < header_->playlist_count; ++i) {
+    if (!playlists[i].member_count || playlists[i].weight <= 0) {
+      continue;
+    }
+    pick -= playlists[i].weight;
+    if (pick < 0) {
+      return std::string(Section<char>(header_->strings) + playlists[i].name, playlists[i].name_length);
+    }
+  }
+  return "";  // Not reached.
+}
+
+void Catalog::AllItems(int64_t limit, int64_t offset,
+                       google::protobuf::RepeatedField<google::protobuf::int64> *result) const {
+  const int64_t count = header_->item_count;
+  if (offset < 0 || offset >= count || limit <= 0) {
+    return;
+  }
+  const int64_t end = offset + std::min(limit, count - offset);
+  const int64_t* ids = Section<int64_t>(header_->ids);
+  const int32_t* by_duration = Section<int32_t>(header_->by_duration);
+  result->Reserve(result->size() + (end - offset));
+  for (int64_t i = offset; i < end; ++i) {
+    result->AddAlreadyReserved(ids[by_duration[i]]);
+  }
+}
@@ -0,0 +1,122 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include "sqlite3.h"
+#include "base.h"
+#include "playableitem.pb.h"
+#include "playlist.pb.h"
+
+// Catalog is a read-only snapshot of the playlists and the items in them,
+// in a file that is mapped into memory rather than read: fixed-width columns
+// of item IDs, durations and playcounts, a table of strings, and each
+// playlist's members as a range of item indexes, longest first.  Picking a
+// mainshow or loading every item as bumpers from it takes no SQL at all,
+// where the Playlists_with_children view sorts the whole library each time.
+//
+// Every change to what a snapshot holds bumps CatalogVersion in the database
+// (by trigger, so acmd and the web API needn't know), and a snapshot is only
+// used while its version is current.  Playcounts are as of the snapshot, as
+// plays don't bump the version; what is played is always read from SQLite.
+class Catalog {
+ public:
+  ~Catalog();
+
+  // Writes a snapshot of db to path, replacing any that is there.  Returns
+  // false, having logged why, if it can't.
+  static bool Write(sqlite3 *db, const std::string& path);
+  // Maps the snapshot at path, or returns null if there is no usable one.
+  static std::shared_ptr<const Catalog> Open(const std::string& path);
+  // The current value of CatalogVersion in db.
+  static int64_t Version(sqlite3 *db);
+
+  // The process-wide snapshot, if there is one and it is up to date with db;
+  // otherwise null, and callers should go to SQLite.
+  static std::shared_ptr<const Catalog> Get(sqlite3 *db);
+  static void Set(std::shared_ptr<const Catalog> catalog);
+  // Opens the snapshot at path for Get, then keeps it up to date from a
+  // thread of its own, rewriting it within interval_seconds of any change.
+  // Takes ownership of db, which should be a connection of its own.
+  static void Maintain(sqlite3 *db, const std::string& path, int interval_seconds);
+
+  int64_t version() const { return header_->version; }
+  int64_t item_count() const { return header_->item_count; }
+
+  // Fills in item from the snapshot, returning false if it has no such item
+  // (including items that are missing from disk).
+  bool FindItem(int64_t id, automation::PlayableItem *item) const;
+  // Fills in result as Playlists_with_children would: the playlist's items
+  // longest first, those of equal length in random order.  Returns false if
+  // there is no such playlist or it has no items.
+  bool FindPlaylist(const std::string& name, automation::Playlist *result) const;
+  // Picks a playlist with items at random, in proportion to its weight, and
+  // returns its name, or the empty string if there are none.
+  std::string PickPlaylist() const;
+  // Appends the IDs of up to limit items, longest first, after skipping
+  // offset of them, as FetchSuperlist does.
+  void AllItems(int64_t limit, int64_t offset,
+                google::protobuf::RepeatedField<google::protobuf::int64> *result) const;
+
+ private:
+  // The layout of the file: this header, then each of the sections it gives
+  // the offsets of, 8-byte aligned.  Everything is in host byte order; the
+  // file is only ever read by the machine that wrote it.
+  struct Header {
+    char magic[8];
+    int64_t version;         // CatalogVersion when written.
+    int64_t item_count;
+    int64_t playlist_count;
+    int64_t member_count;
+    int64_t string_bytes;
+    uint64_t ids;            // int64_t[item_count], ascending.
+    uint64_t durations;      // int32_t[item_count]
+    uint64_t playcounts;     // int32_t[item_count]
+    uint64_t filenames;      // uint32_t[item_count + 1], offsets into strings.
+    uint64_t by_duration;    // int32_t[item_count], item indexes, longest first.
+    uint64_t playlists;      // PlaylistEntry[playlist_count], by ID.
+    uint64_t members;        // int32_t[member_count], item indexes.
+    uint64_t strings;        // char[string_bytes]
+  };
+  struct PlaylistEntry {
+    int64_t id;
+    int64_t weight;
+    uint32_t name;           // Offset into strings,
+    uint32_t name_length;    // and length.
+    uint32_t first_member;   // Index into members,
+    uint32_t member_count;   // and count.
+  };
+
+  Catalog(const void *base, size_t length);
+  template<class T> const T* Section(uint64_t offset) const {
+    return reinterpret_cast<const T*>(static_cast<const char*>(base_) + offset);
+  }
+  // Checks that the header describes a file of length bytes.
+  bool Valid() const;
+
+  const void *base_;
+  size_t length_;
+  const Header *header_;
+
+  DISALLOW_COPY_AND_ASSIGN(Catalog);
+};
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "clock.h"
+
+#include <chrono>
+#include <thread>
+
+namespace {
+SystemClock system_clock;
+std::atomic<Clock*> current_clock(&system_clock);
+}  // namespace
+
+Clock* Clock::Get() {
+  return current_clock.load(std::memory_order_acquire);
+}
+
+void Clock::Set(Clock* clock) {
+  current_clock.store(clock ? clock : &system_clock, std::memory_order_release);
+}
+
+int64_t SystemClock::NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void Clock::SleepUntil(int64_t micros) {
+  const int64_t remaining = micros - NowMicros();
+  if (remaining > 0) {
+    SleepMicros(remaining);
+  }
+}
+
+void SystemClock::SleepMicros(int64_t micros) {
+  std::this_thread::sleep_for(std::chrono::microseconds(micros));
+}
+
+void VirtualClock::SleepMicros(int64_t micros) {
+  slept_ += micros;
+  Advance(micros);
+}
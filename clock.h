@@ -0,0 +1,74 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+#include "base.h"
+
+// The time source the scheduler runs on.  Normally this is the system clock,
+// but a simulation installs a VirtualClock so a week of programming can be
+// played through as fast as the CPU allows.
+class Clock {
+ public:
+  virtual ~Clock() {}
+
+  virtual int64_t NowMicros() = 0;
+  time_t Now() { return NowMicros() / 1000000; }
+  void Sleep(int64_t seconds) { SleepMicros(seconds * 1000000); }
+  virtual void SleepMicros(int64_t micros) = 0;
+  // Returns once NowMicros() has reached micros.
+  void SleepUntil(int64_t micros);
+
+  // The clock in use by this process; a SystemClock unless Set was called.
+  static Clock* Get();
+  // Installs clock, which must outlive its use, or the system clock again if
+  // clock is null.  Call before constructing the RequirementEngine, which
+  // starts its schedule from the current time.
+  static void Set(Clock* clock);
+};
+
+class SystemClock : public Clock {
+ public:
+  SystemClock() {}
+  int64_t NowMicros() override;
+  void SleepMicros(int64_t micros) override;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(SystemClock);
+};
+
+// Time only moves when somebody sleeps or calls Advance.
+class VirtualClock : public Clock {
+ public:
+  explicit VirtualClock(time_t start) : now_(start * 1000000LL), slept_(0) {}
+  int64_t NowMicros() override { return now_.load(); }
+  // Sleeping counts as silence, see slept().
+  void SleepMicros(int64_t micros) override;
+  void Advance(int64_t micros) { now_ += micros; }
+
+  // Total seconds spent sleeping.
+  int64_t slept() const { return slept_.load() / 1000000; }
+
+ private:
+  std::atomic<int64_t> now_;
+  std::atomic<int64_t> slept_;  // In microseconds.
+  DISALLOW_COPY_AND_ASSIGN(VirtualClock);
+};
+
+#endif
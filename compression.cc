@@ -0,0 +1,171 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "compression.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <memory>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <zlib.h>
+#include <zstd.h>
+
+DEFINE_int32(gzip_level, 6, "zlib compression level (1-9) of gzip-encoded API responses.");
+DEFINE_int32(zstd_level, 3, "Compression level (1-19) of zstd-encoded API responses.");
+
+ContentCoding NegotiateCoding(const std::string& accept_encoding) {
+  // Each element is a coding, or *, with an optional ;q= weight between 0
+  // and 1.  Codings that aren't mentioned get the weight of *, if any.
+  double gzip = -1, zstd = -1, other = 0;
+  std::string::size_type start = 0;
+  while (start < accept_encoding.size()) {
+    std::string::size_type end = accept_encoding.find(',', start);
+    if (end == std::string::npos) {
+      end = accept_encoding.size();
+    }
+    std::string element = accept_encoding.substr(start, end - start);
+    start = end + 1;
+    double q = 1;
+    std::string::size_type params = element.find(';');
+    if (params != std::string::npos) {
+      std::string::size_type weight = element.find("q=", params);
+      if (weight != std::string::npos) {
+        q = strtod(element.c_str() + weight + 2, nullptr);
+      }
+      element.resize(params);
+    }
+    std::string coding;
+    for (char c : element) {
+      if (!isspace(c)) {
+        coding += tolower(c);
+      }
+    }
+    if (coding == "gzip" || coding == "x-gzip") {
+      gzip = q;
+    } else if (coding == "zstd") {
+      zstd = q;
+    } else if (coding == "*") {
+      other = q;
+    }
+  }
+  if (gzip < 0) gzip = other;
+  if (zstd < 0) zstd = other;
+  if (zstd > 0 && zstd >= gzip) {
+    return ContentCoding::ZSTD;
+  }
+  return gzip > 0 ? ContentCoding::GZIP : ContentCoding::IDENTITY;
+}
+
+const char* CodingName(ContentCoding coding) {
+  switch (coding) {
+    case ContentCoding::GZIP: return "gzip";
+    case ContentCoding::ZSTD: return "zstd";
+    default: return "";
+  }
+}
+
+namespace {
+
+class GzipCompressor : public Compressor {
+ public:
+  GzipCompressor() {
+    stream_.zalloc = Z_NULL;
+    stream_.zfree = Z_NULL;
+    stream_.opaque = Z_NULL;
+    // 16 more window bits asks for a gzip header and trailer rather than zlib's.
+    CHECK_EQ(deflateInit2(&stream_, FLAGS_gzip_level, Z_DEFLATED, 15 + 16, 8,
+                          Z_DEFAULT_STRATEGY), Z_OK);
+  }
+  ~GzipCompressor() {
+    deflateEnd(&stream_);
+  }
+
+  void Compress(const char *data, size_t size, bool end, std::string *output) override {
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream_.avail_in = size;
+    int ret;
+    do {
+      const size_t used = output->size();
+      output->resize(used + deflateBound(&stream_, stream_.avail_in) + 16);
+      stream_.next_out = reinterpret_cast<Bytef*>(&(*output)[used]);
+      stream_.avail_out = output->size() - used;
+      ret = deflate(&stream_, end ? Z_FINISH : Z_SYNC_FLUSH);
+      CHECK(ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR) << "deflate failed: " << ret;
+      output->resize(output->size() - stream_.avail_out);
+    } while (end ? ret != Z_STREAM_END : stream_.avail_out == 0);
+    if (end) {
+      Reset();
+    }
+  }
+
+ protected:
+  void Reset() override {
+    deflateReset(&stream_);
+  }
+
+ private:
+  z_stream stream_;
+};
+
+class ZstdCompressor : public Compressor {
+ public:
+  ZstdCompressor() : context_(ZSTD_createCCtx()) {
+    CHECK(context_) << "ZSTD_createCCtx failed";
+    ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, FLAGS_zstd_level);
+    ZSTD_CCtx_setParameter(context_, ZSTD_c_checksumFlag, 1);
+  }
+  ~ZstdCompressor() {
+    ZSTD_freeCCtx(context_);
+  }
+
+  // A body passed whole, with end, gets its size in the frame header.
+  void Compress(const char *data, size_t size, bool end, std::string *output) override {
+    ZSTD_inBuffer in = {data, size, 0};
+    size_t remaining;
+    do {
+      const size_t used = output->size();
+      output->resize(used + ZSTD_compressBound(in.size - in.pos) + ZSTD_CStreamOutSize());
+      ZSTD_outBuffer out = {&(*output)[used], output->size() - used, 0};
+      remaining = ZSTD_compressStream2(context_, &out, &in, end ? ZSTD_e_end : ZSTD_e_flush);
+      CHECK(!ZSTD_isError(remaining)) << "zstd failed: " << ZSTD_getErrorName(remaining);
+      output->resize(used + out.pos);
+    } while (remaining != 0);
+  }
+
+ protected:
+  void Reset() override {
+    ZSTD_CCtx_reset(context_, ZSTD_reset_session_only);
+  }
+
+ private:
+  ZSTD_CCtx *context_;
+};
+
+}  // namespace
+
+Compressor* Compressor::ForThread(ContentCoding coding) {
+  static thread_local std::unique_ptr<Compressor> gzip, zstd;
+  std::unique_ptr<Compressor>& compressor = coding == ContentCoding::ZSTD ? zstd : gzip;
+  CHECK(coding != ContentCoding::IDENTITY);
+  if (!compressor) {
+    compressor.reset(coding == ContentCoding::ZSTD ? static_cast<Compressor*>(new ZstdCompressor)
+                                                   : new GzipCompressor);
+  } else {
+    compressor->Reset();
+  }
+  return compressor.get();
+}
@@ -0,0 +1,57 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h>
+#include <string>
+#include "base.h"
+
+// The content codings the web API can compress response bodies with.
+enum class ContentCoding { IDENTITY, GZIP, ZSTD };
+
+// The coding to answer a request with Accept-Encoding header accept_encoding:
+// whichever of zstd and gzip it prefers (zstd on a tie), or IDENTITY if it
+// accepts neither.
+ContentCoding NegotiateCoding(const std::string& accept_encoding);
+// The name of coding in Content-Encoding, e.g. "gzip"; empty for IDENTITY.
+const char* CodingName(ContentCoding coding);
+
+// Compresses one body at a time, in pieces, so that a streamed response can
+// be sent as it is produced.  Compressors hold large buffers, so each thread
+// keeps one of each kind and reuses it.
+class Compressor {
+ public:
+  // The calling thread's compressor for coding (which mustn't be IDENTITY),
+  // ready to start a new body at --gzip_level or --zstd_level.
+  static Compressor* ForThread(ContentCoding coding);
+  virtual ~Compressor() {}
+
+  // Appends to output the compressed form of the size bytes at data, and of
+  // everything before them, so that the client can decode it all.  With end,
+  // also ends the body; the next call starts a new one.
+  virtual void Compress(const char *data, size_t size, bool end, std::string *output) = 0;
+
+ protected:
+  Compressor() {}
+  virtual void Reset() = 0;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(Compressor);
+};
+
+#endif
@@ -18,22 +18,34 @@
 #include <glog/logging.h>
 #include "playlist.pb.h"
 #include "protostore.h"
+#include "db.h"
+#include "requirementengine.h"
+#include "trace.h"
 #include <gflags/gflags.h>
 
 DEFINE_string(dbname, "/var/automation/music.db", "Name of database to use");
 DEFINE_bool(dbinit, false, "If true, start, create a database, and exit.");
 
-void InitializeSchema(sqlite3 *db);
-
-void TraceCallback( void* udp, const char* sql ) {
-  VLOG(30) << "{SQL} " << sql;
+int TraceCallback(unsigned type, void* udp, void* statement, void* detail) {
+  if (type == SQLITE_TRACE_STMT) {
+    VLOG(30) << "{SQL} " << (const char*)detail;
+  } else if (type == SQLITE_TRACE_PROFILE && trace::Enabled()) {
+    // SQLite reports the statement once it has finished, with its run time.
+    const int64_t duration = *(const sqlite3_int64*)detail / 1000;
+    trace::Record("sql", trace::NowMicros() - duration, duration,
+                  sqlite3_sql((sqlite3_stmt*)statement));
+  }
+  return 0;
 }
 
 sqlite3* DatabaseOpen() {
   CHECK(sqlite3_threadsafe()); 
   sqlite3 *db;
   sqlite3_open_v2(FLAGS_dbname.c_str(), &db, SQLITE_OPEN_READWRITE | (FLAGS_dbinit ? SQLITE_OPEN_CREATE : 0), NULL);
-  sqlite3_trace(db, TraceCallback, NULL);
+  sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, TraceCallback, NULL);
+  // Channels, the web API and the scanner each write through connections of
+  // their own; wait out another's transaction rather than fail.
+  sqlite3_busy_timeout(db, 5000);
   CHECK(sqlite3_exec(db, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
   CHECK(sqlite3_exec(db, "PRAGMA read_uncommitted = ON;", NULL, NULL, NULL) == SQLITE_OK);
   if (FLAGS_dbinit) {
@@ -45,11 +57,75 @@ sqlite3* DatabaseOpen() {
   return db;
 }
 
+std::string CatalogPath() {
+  return FLAGS_dbname + ".catalog";
+}
+
+sqlite3* DatabaseOpenReadOnly() {
+  CHECK(sqlite3_threadsafe()); 
+  sqlite3 *db;
+  sqlite3_open_v2(FLAGS_dbname.c_str(), &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, TraceCallback, NULL);
+  return db;
+}
+
+namespace {
+// Missing files are left out, so they are never picked.
+const char kPlaylistsWithChildren[] =
+"CREATE VIEW Playlists_with_children AS "
+"  SELECT Playlist.*,group_concat(Playlist_PlayableItemID.PlayableItemID) "
+"                      AS PlayableItemID "
+"  FROM Playlist JOIN Playlist_PlayableItemID USING(PlaylistID) "
+"                JOIN (SELECT * From PlayableItem WHERE NOT missing "
+"                      ORDER BY PlayableItem.duration DESC,RANDOM()) USING(PlayableItemID) "
+"  GROUP BY PlaylistID;";
+
+// Bumped by any change to what a catalog snapshot holds (see catalog.h), so
+// that stale snapshots are never used.  Playcounts aren't in it.
+const char kCatalogVersion[] =
+"CREATE TABLE IF NOT EXISTS CatalogVersion(version INTEGER NOT NULL);"
+"INSERT INTO CatalogVersion SELECT 1 WHERE NOT EXISTS (SELECT * FROM CatalogVersion);"
+"CREATE TRIGGER IF NOT EXISTS playlist_inserted AFTER INSERT ON Playlist "
+"  BEGIN UPDATE CatalogVersion SET version = version + 1; END;"
+"CREATE TRIGGER IF NOT EXISTS playlist_deleted AFTER DELETE ON Playlist "
+"  BEGIN UPDATE CatalogVersion SET version = version + 1; END;"
+"CREATE TRIGGER IF NOT EXISTS playlist_updated AFTER UPDATE ON Playlist "
+"  WHEN OLD.PlaylistID IS NOT NEW.PlaylistID OR OLD.name IS NOT NEW.name "
+"    OR OLD.weight IS NOT NEW.weight "
+"  BEGIN UPDATE CatalogVersion SET version = version + 1; END;"
+"CREATE TRIGGER IF NOT EXISTS member_inserted AFTER INSERT ON Playlist_PlayableItemID "
+"  BEGIN UPDATE CatalogVersion SET version = version + 1; END;"
+"CREATE TRIGGER IF NOT EXISTS member_deleted AFTER DELETE ON Playlist_PlayableItemID "
+"  BEGIN UPDATE CatalogVersion SET version = version + 1; END;"
+"CREATE TRIGGER IF NOT EXISTS item_inserted AFTER INSERT ON PlayableItem "
+"  BEGIN UPDATE CatalogVersion SET version = version + 1; END;"
+"CREATE TRIGGER IF NOT EXISTS item_deleted AFTER DELETE ON PlayableItem "
+"  BEGIN UPDATE CatalogVersion SET version = version + 1; END;"
+"CREATE TRIGGER IF NOT EXISTS item_updated AFTER UPDATE ON PlayableItem "
+"  WHEN OLD.PlayableItemID IS NOT NEW.PlayableItemID OR OLD.filename IS NOT NEW.filename "
+"    OR OLD.duration IS NOT NEW.duration OR OLD.missing IS NOT NEW.missing "
+"  BEGIN UPDATE CatalogVersion SET version = version + 1; END;";
+
+// The library scanner looks up missing rows by size and time for every new
+// file, to tell a moved file from a new one.
+const char kMissingIndex[] =
+"CREATE INDEX IF NOT EXISTS missingdex ON PlayableItem(size, mtime) WHERE missing;";
+
+// One row per requirement, so editing one doesn't rewrite the schedule.
+const char kRequirementSchema[] =
+"CREATE TABLE ScheduledRequirement("
+"  RequirementID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+"  channel STRING NOT NULL, version INTEGER NOT NULL, data BLOB);"
+"CREATE INDEX requirementchannel ON ScheduledRequirement(channel);";
+}
+
 void InitializeSchema(sqlite3 *db) {
   std::string schema = 
 "CREATE TABLE Playlist(PlaylistID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,name STRING,weight INTEGER);"
 "CREATE TABLE PlayableItem(PlayableItemID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
-"                          filename STRING,duration INTEGER,description STRING, playcount INTEGER);"
+"                          filename STRING,duration INTEGER,description STRING, playcount INTEGER,"
+"                          size INTEGER NOT NULL DEFAULT 0, mtime INTEGER NOT NULL DEFAULT 0,"
+"                          missing INTEGER NOT NULL DEFAULT 0);"
 "CREATE TABLE Playlist_PlayableItemID (PlaylistID INTEGER NOT NULL REFERENCES Playlist(PlaylistID),"
 "                                      PlayableItemID INTEGER NOT NULL REFERENCES PlayableItem(PlayableItemID));" 
 "CREATE TABLE PlaylistLock(name STRING NOT NULL REFERENCES Playlist(name) DEFERRABLE INITIALLY DEFERRED);"
@@ -61,14 +137,6 @@ void InitializeSchema(sqlite3 *db) {
 "CREATE UNIQUE INDEX labeldex ON ProtoTable(label);"
 "CREATE UNIQUE INDEX lockdex ON PlaylistLock(name);"
 
-"CREATE VIEW Playlists_with_children AS "
-"  SELECT Playlist.*,group_concat(Playlist_PlayableItemID.PlayableItemID) "
-"                      AS PlayableItemID "
-"  FROM Playlist JOIN Playlist_PlayableItemID USING(PlaylistID) "
-"                JOIN (SELECT * From PlayableItem ORDER BY PlayableItem.duration DESC,RANDOM()) USING(PlayableItemID) "
-"  GROUP BY PlaylistID;"
-
-
 "CREATE VIEW Playlists_with_size AS "
 "  SELECT Playlist.*,count(Playlist_PlayableItemID.PlayableItemID) "
 "                      AS length "
@@ -78,8 +146,53 @@ void InitializeSchema(sqlite3 *db) {
 "  SELECT * FROM Playlists_with_children WHERE (select 1+abs(random() % sum(weight)) From Playlist) "
 "    <= (select sum(weight) FROM Playlist p2 WHERE p2.PlaylistID <= Playlists_with_children.PlaylistID) "
 "  ORDER BY weight DESC limit 1;";
-
+  schema += kPlaylistsWithChildren;
+  schema += kCatalogVersion;
+  schema += kMissingIndex;
+  schema += kRequirementSchema;
 
   CHECK(sqlite3_exec(db, schema.c_str(), NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
 }
 
+namespace {
+bool Exists(sqlite3 *db, const char *query) {
+  sqlite3_stmt *ps;
+  CHECK(sqlite3_prepare_v2(db, query, -1, &ps, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+  const bool exists = sqlite3_step(ps) == SQLITE_ROW;
+  sqlite3_finalize(ps);
+  return exists;
+}
+
+void Upgrade(sqlite3 *db, const std::string& statements) {
+  const std::string upgrade = "BEGIN IMMEDIATE;" + statements + "COMMIT;";
+  if (sqlite3_exec(db, upgrade.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+    const std::string error = sqlite3_errmsg(db);
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    LOG(FATAL) << "Unable to upgrade the database schema: " << error;
+  }
+}
+}
+
+void UpgradeSchema(sqlite3 *db) {
+  if (!Exists(db, "SELECT 1 FROM pragma_table_info('PlayableItem') WHERE name = 'missing'")) {
+    LOG(INFO) << "Adding library scanner columns to PlayableItem.";
+    Upgrade(db,
+"ALTER TABLE PlayableItem ADD COLUMN size INTEGER NOT NULL DEFAULT 0;"
+"ALTER TABLE PlayableItem ADD COLUMN mtime INTEGER NOT NULL DEFAULT 0;"
+"ALTER TABLE PlayableItem ADD COLUMN missing INTEGER NOT NULL DEFAULT 0;"
+"DROP VIEW Playlists_with_children;" + std::string(kPlaylistsWithChildren));
+  }
+  if (!Exists(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'CatalogVersion'")) {
+    LOG(INFO) << "Adding CatalogVersion.";
+    Upgrade(db, kCatalogVersion);
+  }
+  if (!Exists(db, "SELECT 1 FROM sqlite_master WHERE type = 'index' AND name = 'missingdex'")) {
+    LOG(INFO) << "Indexing missing PlayableItems.";
+    Upgrade(db, kMissingIndex);
+  }
+  if (!Exists(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'ScheduledRequirement'")) {
+    LOG(INFO) << "Adding ScheduledRequirement.";
+    Upgrade(db, kRequirementSchema);
+  }
+  RequirementEngine::MoveLegacySchedules(db);
+}
@@ -17,6 +17,7 @@
 #define DB_HEADER_H
 
 #include <sqlite3.h>
+#include <string>
 
 class DatabaseHandle {
  public:
@@ -27,7 +28,16 @@ class DatabaseHandle {
   sqlite3 *db_;
 };
 
-void TraceCallback( void* udp, const char* sql );
+int TraceCallback(unsigned type, void* udp, void* statement, void* detail);
 sqlite3 *DatabaseOpen();
+// Opens the database for reading only, for running queries from outside.
+sqlite3 *DatabaseOpenReadOnly();
+// Creates the tables and views automation expects in an empty database.
+void InitializeSchema(sqlite3 *db);
+// Brings a database made by an older version up to date.  Cheap when there
+// is nothing to do; call once at startup.
+void UpgradeSchema(sqlite3 *db);
+// Where the catalog snapshot (see catalog.h) of the database is kept.
+std::string CatalogPath();
 
 #endif
@@ -15,71 +15,498 @@
  */
 
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
 #include "http.h"
+#include "responsecache.h"
+#include <boost/asio/buffer.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/util/json_util.h>
 #include <pion/http/request.hpp>
 
+DEFINE_int32(stream_chunk_size, 65536, "Number of bytes a streamed API response buffers "
+  "before flushing them to the client as one HTTP chunk.");
+DEFINE_bool(compress_responses, true, "If true, API responses are gzip or zstd compressed "
+  "for clients that send Accept-Encoding with either.");
+DEFINE_int32(compression_min_bytes, 1024, "API responses smaller than this many bytes are "
+  "sent uncompressed.  Streamed responses are always compressed if the client accepts it.");
+
 using HTTPRequestPtr = pion::http::request_ptr;
 
 using namespace std;
 
+namespace {
+
+// What PeerIdentity keeps with each TLS connection.  Requests on a connection
+// are handled one at a time, so it needs no lock.
+struct PeerState {
+  std::string identity;
+};
+
+int PeerStateIndex() {
+  static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr,
+      [](void*, void *state, CRYPTO_EX_DATA*, int, long, void*) {
+        delete static_cast<PeerState*>(state);
+      });
+  return index;
+}
+
+}  // namespace
+
+void EnableSessionResumption(SSL_CTX *ctx, int cache_size, int timeout_seconds) {
+  // OpenSSL won't resume a session whose client certificate it verified
+  // unless the context names the sessions it issues as its own.
+  static const unsigned char kSessionContext[] = "automation";
+  SSL_CTX_set_session_id_context(ctx, kSessionContext, sizeof kSessionContext - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, cache_size);
+  SSL_CTX_set_timeout(ctx, timeout_seconds);
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+}
+
+std::string PeerIdentity(SSL *ssl) {
+  if (!ssl) {
+    return "";
+  }
+  PeerState *state = static_cast<PeerState*>(SSL_get_ex_data(ssl, PeerStateIndex()));
+  if (!state) {
+    static metrics::Counter *full = metrics::GetCounter("api_tls_handshakes_total",
+        "TLS connections the Web API has served, by how their session began.",
+        "session=\"full\"");
+    static metrics::Counter *resumed = metrics::GetCounter("api_tls_handshakes_total",
+        "TLS connections the Web API has served, by how their session began.",
+        "session=\"resumed\"");
+    (SSL_session_reused(ssl) ? resumed : full)->Increment();
+    state = new PeerState;
+    X509 *certificate = SSL_get_peer_certificate(ssl);
+    if (certificate) {
+      char buf[512];
+      X509_NAME_oneline(X509_get_subject_name(certificate), buf, sizeof buf);
+      state->identity = buf;
+      X509_free(certificate);
+    }
+    SSL_set_ex_data(ssl, PeerStateIndex(), state);
+  }
+  return state->identity;
+}
+
+WebRequest::WebRequest(WebCommand *command, HTTPRequestPtr http, HTTPResponseWriterPtr writer,
+                       const TCPConnectionPtr& conn) :
+  http(http),
+  writer(writer),
+  conn(conn),
+  params(http->get_queries()),
+  command_(command),
+  coding_(ContentCoding::IDENTITY),
+  response_identity_size_(0),
+  streaming_(false),
+  stream_chunked_(false),
+  stream_failed_(false),
+  stream_records_(0),
+  stream_compressor_(nullptr) {
+}
+
 void WebCommand::handle_command(HTTPRequestPtr http_request, const pion::tcp::connection_ptr& tcp_conn) {
   pion::http::response_writer_ptr
     writer(pion::http::response_writer::create(tcp_conn,
                                       *http_request));
   pion::http::response& r = writer->get_response();
+  std::shared_ptr<WebRequest> request(new WebRequest(this, http_request, writer, tcp_conn));
+  std::call_once(stats_once_, [this]() {
+    const std::string labels = "endpoint=\"" + get_command() + "\"";
+    responses_ = metrics::GetCounter("api_responses_total",
+        "Messages returned by ReturnMessage.", labels);
+    response_bytes_ = metrics::GetCounter("api_response_bytes_total",
+        "Bytes of serialized messages returned by ReturnMessage.", labels);
+    serialization_usec_ = metrics::GetCounter("api_serialization_microseconds_total",
+        "Time spent serializing messages in ReturnMessage.", labels);
+    arena_bytes_ = metrics::GetCounter("api_arena_bytes_total",
+        "Bytes allocated on request arenas.", labels);
+    cache_hits_ = metrics::GetCounter("api_cache_hits_total",
+        "Responses served from the response cache.", labels);
+    cache_misses_ = metrics::GetCounter("api_cache_misses_total",
+        "Cacheable responses that had to be computed.", labels);
+    not_modified_ = metrics::GetCounter("api_not_modified_total",
+        "Requests answered with 304 Not Modified.", labels);
+    bytes_out_ = metrics::GetCounter("api_bytes_out_total",
+        "Response body bytes handed to the connection.", labels);
+    uncompressed_bytes_ = metrics::GetCounter("api_uncompressed_bytes_total",
+        "What api_bytes_out_total would have been without compression.", labels);
+    compression_usec_ = metrics::GetCounter("api_compression_microseconds_total",
+        "Time spent compressing response bodies.", labels);
+    errors_ = metrics::GetCounter("api_errors_total",
+        "Requests answered with a 4xx or 5xx status.", labels);
+    latency_ = metrics::GetHistogram("api_request_duration_seconds",
+        "Time from dispatch until the response was handed to the connection.", labels, 1e-6);
+    if (metrics::kCountAllocations) {
+      heap_allocations_ = metrics::GetCounter("api_heap_allocations_total",
+          "Heap allocations made by request handlers.", labels);
+    }
+  });
+  const int64_t allocations_before = metrics::ThreadAllocations();
+  // Records latency and errors on every way out of this function.
+  struct RequestTimer {
+    ~RequestTimer() {
+      command->latency_->Record(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count());
+      if (response.get_status_code() >= 400) {
+        command->errors_->Increment();
+      }
+    }
+    WebCommand* command;
+    const pion::http::response& response;
+    std::chrono::steady_clock::time_point start;
+  } timer{this, r, std::chrono::steady_clock::now()};
   VLOG(60) << "Resource: " << http_request->get_original_resource();
   VLOG(60) << "Query string: " << http_request->get_query_string();
 
   r.set_status_code(HTTPTypes::RESPONSE_CODE_OK);
   r.set_status_message(HTTPTypes::RESPONSE_MESSAGE_OK);
-  params_ = http_request->get_queries();
-  request_ = http_request;
-  writer_ = writer;
-  SSL *cert = tcp_conn->get_ssl_socket().impl()->ssl;
-
-  if (cert) {
-    X509 *info = SSL_get_peer_certificate(cert);
-    if (info) {
-      char buf[512];
-      X509_NAME_oneline(X509_get_subject_name(info), buf, sizeof buf);
-      remote_user_ = buf;
+  const std::string channel_prefix = WebAPI::ChannelResource("", "");
+  if (http_request->get_resource().compare(0, channel_prefix.size(), channel_prefix) == 0) {
+    const std::string::size_type end = http_request->get_resource().find('/', channel_prefix.size());
+    if (end != std::string::npos) {
+      request->channel = http_request->get_resource().substr(channel_prefix.size(), end - channel_prefix.size());
+      http_request->change_resource(http_request->get_resource().substr(end));
+    }
+  }
+  if (FLAGS_compress_responses) {
+    request->coding_ = NegotiateCoding(http_request->get_header("Accept-Encoding"));
+    r.add_header("Vary", "Accept-Encoding");
+  }
+  if (tcp_conn->get_ssl_flag()) {
+    request->remote_user = PeerIdentity(tcp_conn->get_ssl_socket().impl()->ssl);
+  }
+
+  LOG(INFO) << "API command " << request->resource() << " from " << tcp_conn->get_remote_ip() << " " << request->remote_user << " running now...";
+
+  // Read-only endpoints are tagged with the generation of the data they were
+  // computed from.  Clients that already have it get a 304, and everyone else
+  // may be served from the cache, in both cases without touching the database.
+  std::string cache_key;
+  uint64_t generation = 0;
+  if (IsCacheable(*request)) {
+    cache_key = CacheKey(*request);
+    generation = ResponseCache::CurrentGeneration();
+    char etag[48];
+    snprintf(etag, sizeof etag, "\"%016zx-%016llx\"", std::hash<std::string>()(cache_key),
+             (unsigned long long)generation);
+    r.add_header("ETag", etag);
+    r.add_header("Cache-Control", "no-cache");
+    if (http_request->get_header("If-None-Match").find(etag) != std::string::npos) {
+      r.set_status_code(HTTPTypes::RESPONSE_CODE_NOT_MODIFIED);
+      r.set_status_message(HTTPTypes::RESPONSE_MESSAGE_NOT_MODIFIED);
+      not_modified_->Increment();
+      SendResponse(request, tcp_conn);
+      return;
+    }
+    std::shared_ptr<const CachedResponse> cached = ResponseCache::Get()->Lookup(cache_key, generation);
+    if (cached) {
+      r.set_content_type(cached->content_type);
+      if (!cached->content_encoding.empty()) {
+        r.add_header("Content-Encoding", cached->content_encoding);
+        request->response_content_encoding_ = cached->content_encoding;
+        request->response_identity_size_ = cached->identity_size;
+      }
+      writer->write_no_copy(*cached->body);
+      request->response_bodies_.push_back(cached->body);
+      cache_hits_->Increment();
+      SendResponse(request, tcp_conn);
+      return;
+    }
+    cache_misses_->Increment();
+  }
+
+  try {
+    this->handle_command(*request);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "API command " << request->resource() << " failed: " << e.what();
+    if (request->streaming_) {
+      // Part of the body is already out; all we can do is cut it short.
+      request->stream_failed_ = true;
+      errors_->Increment();
+    } else {
+      writer->clear();
+      request->response_bodies_.clear();
+      r.set_status_code(HTTPTypes::RESPONSE_CODE_SERVER_ERROR);
+      r.set_status_message(HTTPTypes::RESPONSE_MESSAGE_SERVER_ERROR);
     }
   }
+  arena_bytes_->Increment(RequestArena()->Reset());
+  if (heap_allocations_) {
+    heap_allocations_->Increment(metrics::ThreadAllocations() - allocations_before);
+  }
 
-  LOG(INFO) << "API command " << request_->get_resource() << " from " << tcp_conn->get_remote_ip() << " " << remote_user_ << " running now...";
-  this->handle_command(http_request, writer, remote_user_);
+  if (!request->streaming_) {
+    CompressResponse(*request);
+  }
+
+  if (!cache_key.empty() && !request->streaming_ && request->response_bodies_.size() == 1 &&
+      r.get_status_code() == HTTPTypes::RESPONSE_CODE_OK) {
+    std::shared_ptr<CachedResponse> response(new CachedResponse);
+    response->content_type = request->response_content_type_;
+    response->content_encoding = request->response_content_encoding_;
+    response->body = request->response_bodies_.front();
+    response->identity_size = request->response_content_encoding_.empty() ?
+        response->body->size() : request->response_identity_size_;
+    ResponseCache::Get()->Insert(cache_key, generation, response);
+  }
 
-  writer->send();
+  SendResponse(request, tcp_conn);
 }
 
-void WebCommand::ReturnMessage(const ::google::protobuf::Message& value) {
-  std::string format;
-  if (params_.count("format")) {
-    format = params_.equal_range("format").first->second;
+void WebCommand::SendResponse(const std::shared_ptr<WebRequest>& request, const TCPConnectionPtr& tcp_conn) {
+  if (request->streaming_) {
+    // The response has already been written out synchronously; just hand the
+    // connection back to the server.
+    if (request->stream_failed_) {
+      tcp_conn->set_lifecycle(pion::tcp::connection::LIFECYCLE_CLOSE);
+    }
+    tcp_conn->finish();
   } else {
-    format = "pb";
+    // Pion only holds pointers into the bodies ReturnMessage produced, so they
+    // (and the writer) have to outlive the asynchronous write, as the request
+    // does.  Once it is done hand the connection back to the server, as pion's
+    // own handler would.
+    size_t size = 0;
+    for (const auto& body : request->response_bodies_) {
+      size += body->size();
+    }
+    bytes_out_->Increment(size);
+    uncompressed_bytes_->Increment(request->response_content_encoding_.empty() ?
+                                   size : request->response_identity_size_);
+    request->writer->send([request, tcp_conn](const boost::system::error_code& ec, std::size_t) {
+      if (ec) {
+        tcp_conn->set_lifecycle(pion::tcp::connection::LIFECYCLE_CLOSE);
+      }
+      tcp_conn->finish();
+    });
   }
-  // TODO throw up some headers for the json users to know more about what they have
+}
+
+void WebCommand::CompressResponse(WebRequest& request) {
+  // Only what ReturnMessage wrote is known, so a response needs to be exactly
+  // one of those, as for the ResponseCache.
+  pion::http::response& r = request.writer->get_response();
+  if (request.coding_ == ContentCoding::IDENTITY || request.response_bodies_.size() != 1 ||
+      r.get_status_code() != HTTPTypes::RESPONSE_CODE_OK ||
+      request.response_bodies_.front()->size() < (size_t)std::max(FLAGS_compression_min_bytes, 0)) {
+    return;
+  }
+  const std::string& body = *request.response_bodies_.front();
+  auto start = std::chrono::steady_clock::now();
+  std::shared_ptr<std::string> compressed(new std::string);
+  compressed->reserve(body.size() / 4);
+  Compressor::ForThread(request.coding_)->Compress(body.data(), body.size(), true, compressed.get());
+  compression_usec_->Increment(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count());
+  if (compressed->size() >= body.size()) {
+    return;
+  }
+  request.response_content_encoding_ = CodingName(request.coding_);
+  request.response_identity_size_ = body.size();
+  r.add_header("Content-Encoding", request.response_content_encoding_);
+  request.writer->clear();
+  request.writer->write_no_copy(*compressed);
+  request.response_bodies_.front() = compressed;
+}
+
+std::string WebCommand::CacheKey(const WebRequest& request) {
+  std::vector<std::string> params;
+  for (const auto& param : request.params) {
+    params.push_back(param.first + "=" + param.second);
+  }
+  if (!request.params.count("format")) {
+    params.push_back("format=pb");
+  }
+  std::sort(params.begin(), params.end());
+  std::string key = request.http->get_original_resource();
+  for (const std::string& param : params) {
+    key += "&" + param;
+  }
+  if (request.coding_ != ContentCoding::IDENTITY) {
+    key += std::string("&encoding=") + CodingName(request.coding_);
+  }
+  return key;
+}
+
+google::protobuf::Arena* WebCommand::RequestArena() {
+  static thread_local google::protobuf::Arena arena;
+  return &arena;
+}
+
+std::string WebRequest::Format() const {
+  if (params.count("format")) {
+    return params.equal_range("format").first->second;
+  }
+  return "pb";
+}
+
+void WebRequest::BeginStream() {
+  pion::http::response& r = writer->get_response();
+  stream_format_ = Format();
+  if (stream_format_ == "json") {
+    r.set_content_type("application/json");
+  } else if (stream_format_ == "pb") {
+    r.set_content_type("application/x-protobuf; delimited=true");
+  } else {
+    r.set_content_type("text/plain");
+  }
+
+  // HTTP/1.0 clients don't understand chunks; for them the end of the response
+  // is marked by closing the connection instead.
+  stream_chunked_ = http->get_version_major() > 1 ||
+                    (http->get_version_major() == 1 && http->get_version_minor() >= 1);
+  if (stream_chunked_) {
+    r.add_header(HTTPTypes::HEADER_TRANSFER_ENCODING, "chunked");
+  } else {
+    conn->set_lifecycle(pion::tcp::connection::LIFECYCLE_CLOSE);
+  }
+  r.set_do_not_send_content_length();
+  stream_compressor_ = nullptr;
+  if (coding_ != ContentCoding::IDENTITY) {
+    r.add_header("Content-Encoding", CodingName(coding_));
+    stream_compressor_ = Compressor::ForThread(coding_);
+  }
+
+  boost::system::error_code ec;
+  r.send(*conn, ec, true);
+  streaming_ = true;
+  stream_failed_ = bool(ec);
+  stream_records_ = 0;
+  stream_buffer_.clear();
+  if (stream_format_ == "json") {
+    stream_buffer_ = "[";
+  }
+}
+
+bool WebRequest::StreamMessage(const ::google::protobuf::Message& value) {
+  CHECK(streaming_) << "StreamMessage called before BeginStream";
+  if (stream_failed_) {
+    return false;
+  }
+  if (stream_format_ == "json") {
+    std::string output;
+    google::protobuf::util::MessageToJsonString(value, &output);
+    stream_buffer_ += (stream_records_ ? ",\n" : "\n");
+    stream_buffer_ += output;
+  } else if (stream_format_ == "debugpb") {
+    stream_buffer_ += value.DebugString();
+  } else {
+    google::protobuf::io::StringOutputStream raw(&stream_buffer_);
+    google::protobuf::io::CodedOutputStream coded(&raw);
+    coded.WriteVarint32(value.ByteSizeLong());
+    value.SerializeWithCachedSizes(&coded);
+  }
+  ++stream_records_;
+  if (stream_buffer_.size() >= (size_t)FLAGS_stream_chunk_size) {
+    FlushStream();
+  }
+  return !stream_failed_;
+}
+
+void WebRequest::EndStream() {
+  if (stream_format_ == "json") {
+    stream_buffer_ += "\n]\n";
+  }
+  FlushStream(true);
+  if (stream_chunked_ && !stream_failed_) {
+    boost::system::error_code ec;
+    conn->write(boost::asio::buffer("0\r\n\r\n", 5), ec);
+    stream_failed_ = bool(ec);
+  }
+  VLOG(5) << "Streamed " << stream_records_ << " records";
+}
+
+void WebRequest::FlushStream(bool end) {
+  if ((stream_buffer_.empty() && !(end && stream_compressor_)) || stream_failed_) {
+    return;
+  }
+  command_->uncompressed_bytes_->Increment(stream_buffer_.size());
+  // Each flush is compressed so that the client can decode everything sent
+  // so far, at some cost in ratio for small chunks.
+  const std::string* out = &stream_buffer_;
+  if (stream_compressor_) {
+    auto start = std::chrono::steady_clock::now();
+    stream_compressed_.clear();
+    stream_compressor_->Compress(stream_buffer_.data(), stream_buffer_.size(), end,
+                                 &stream_compressed_);
+    command_->compression_usec_->Increment(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    out = &stream_compressed_;
+    stream_buffer_.clear();
+    if (out->empty()) {
+      return;
+    }
+  }
+  boost::system::error_code ec;
+  if (stream_chunked_) {
+    char header[32];
+    snprintf(header, sizeof header, "%zx\r\n", out->size());
+    std::vector<boost::asio::const_buffer> chunk;
+    chunk.push_back(boost::asio::buffer(header, strlen(header)));
+    chunk.push_back(boost::asio::buffer(*out));
+    chunk.push_back(boost::asio::buffer("\r\n", 2));
+    conn->write(chunk, ec);
+  } else {
+    conn->write(boost::asio::buffer(*out), ec);
+  }
+  command_->bytes_out_->Increment(out->size());
+  if (ec) {
+    LOG(WARNING) << "Abandoning streamed response: " << ec.message();
+    stream_failed_ = true;
+  }
+  stream_buffer_.clear();
+}
+
+void SerializeMessage(const ::google::protobuf::Message& value, const std::string& format,
+                      std::string* output, bool pretty) {
   if (format == "debugpb") {
-    writer_ << value.DebugString();  
+    *output = value.DebugString();
   } else if (format == "json") {
-    writer_->get_response().set_content_type("application/json");
-    std::string output;
     google::protobuf::util::JsonPrintOptions options;
-    options.add_whitespace = true;
-    google::protobuf::util::MessageToJsonString(value, &output, options);
-    writer_ << output;
-    return;
+    options.add_whitespace = pretty;
+    google::protobuf::util::MessageToJsonString(value, output, options);
   } else {
-    writer_->get_response().set_content_type("application/x-protobuf; desc=\"/pb/"+value.GetTypeName()+".desc\"; messageType=\""+value.GetTypeName()+"\";);");
-    writer_ << value.SerializeAsString();
-    VLOG(5) << "Sent proto of size " << value.SerializeAsString().size() << " on wire";
+    // Size the buffer exactly once, then serialize straight into it.
+    output->resize(value.ByteSizeLong());
+    value.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(&(*output)[0]));
   }
+}
+
+void WebRequest::ReturnMessage(const ::google::protobuf::Message& value) {
+  const std::string format = Format();
+  // TODO throw up some headers for the json users to know more about what they have
+  if (format == "json") {
+    response_content_type_ = "application/json";
+  } else if (format == "debugpb") {
+    response_content_type_ = "text/plain";
+  } else {
+    response_content_type_ = "application/x-protobuf; desc=\"/pb/"+value.GetTypeName()+".desc\"; messageType=\""+value.GetTypeName()+"\";);";
+  }
+  writer->get_response().set_content_type(response_content_type_);
+
+  auto start = std::chrono::steady_clock::now();
+  std::shared_ptr<std::string> body(new std::string);
+  SerializeMessage(value, format, body.get(),
+                   ArgumentOrDefault<int64_t>("pretty", 1) != 0);
+  command_->serialization_usec_->Increment(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count());
+  command_->responses_->Increment();
+  command_->response_bytes_->Increment(body->size());
+  VLOG(5) << "Sent " << format << " of size " << body->size() << " on wire";
+
+  writer->write_no_copy(*body);
+  response_bodies_.push_back(body);
 } 
 
 template <>
@@ -21,10 +21,18 @@
 #include <stdexcept>
 #include <iostream>
 #include <glog/logging.h>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <vector>
+#include "base.h"
+#include "compression.h"
+#include "metrics.h"
 #include "registerable-inl.h"
 #include "sqlite3.h"
+#include <google/protobuf/arena.h>
 #include <google/protobuf/util/json_util.h>
+#include <openssl/ssl.h>
 #include <pion/http/request.hpp>
 #include <pion/http/response_writer.hpp>
 #include <pion/tcp/connection.hpp>
@@ -38,11 +46,34 @@ namespace google { namespace protobuf { class Message; } }
 
 template<class Type> Type ParseString(const std::string &arg);
 
+// Lets clients that reconnect resume their TLS session, from the server's
+// cache or from a ticket, rather than repeat the full handshake.  Sessions
+// last timeout_seconds, and at most cache_size are cached.
+void EnableSessionResumption(SSL_CTX *ctx, int cache_size, int timeout_seconds);
+
+// The subject of the certificate the client presented on the TLS connection
+// ssl, or the empty string if it presented none.  It is worked out by the
+// first request on a connection and kept with it, so later requests on a
+// kept-alive connection only look it up.
+std::string PeerIdentity(SSL *ssl);
+
+// Serializes value in the given API format ('pb', 'json' or 'debugpb') into
+// output.  Protobufs are written straight into a buffer of their exact size;
+// JSON is indented unless pretty is false.
+void SerializeMessage(const google::protobuf::Message& value, const std::string& format,
+                      std::string* output, bool pretty = true);
+
 class WebAPI {
  public:
   static std::string apikey;
   static std::set<std::string> superusers;
   static bool is_superuser(std::string username);
+  // Every resource is also served for each channel other than the default
+  // one, under /channel/<name>; WebCommand strips the prefix into the
+  // WebRequest's channel.
+  static std::string ChannelResource(const std::string& channel, const std::string& resource) {
+    return "/channel/" + channel + resource;
+  }
   WebAPI() {
   }
   virtual ~WebAPI();
@@ -52,21 +83,40 @@ class WebAPI {
  private:
 };
 
-class WebCommand : public WebAPI::Registrar {
-  virtual void handle_command(HTTPRequestPtr&, HTTPResponseWriterPtr, const std::string&) = 0;
-  void handle_command(HTTPRequestPtr, const TCPConnectionPtr& tcp_conn); 
-  WebAPI::web_callback get_callback() {
-    return [this](HTTPRequestPtr request, const TCPConnectionPtr& conn) {
-      handle_command(request, conn);
-    };
-  }
- protected:
+class WebCommand;
+
+// One API request and the response being built for it.  There is only one of
+// each WebCommand, called from all of pion's threads at once, so handle_command
+// makes one of these per request and everything particular to the request
+// lives here.  The send callback keeps it until pion is done with the response.
+class WebRequest {
+ public:
+  WebRequest(WebCommand *command, HTTPRequestPtr http, HTTPResponseWriterPtr writer,
+             const TCPConnectionPtr& conn);
+
+  const std::string& resource() const { return http->get_resource(); }
+
+  // Serializes the message into the response.  The serialized body is handed
+  // to pion without being copied again and is freed once it has been sent.
   void ReturnMessage(const google::protobuf::Message&);
 
+  // Streaming responses, for result sets too large to build in memory.  Between
+  // BeginStream and EndStream each StreamMessage call appends one record: a
+  // varint length-delimited protobuf in pb format, or an element of a JSON
+  // array in json format.  Records are flushed to the client as HTTP chunks of
+  // roughly FLAGS_stream_chunk_size bytes.  StreamMessage returns false once
+  // the client has gone away, so producers can stop early.
+  void BeginStream();
+  bool StreamMessage(const google::protobuf::Message&);
+  void EndStream();
+
+  // The value of the 'format' parameter, defaulting to pb.
+  std::string Format() const;
+
   template<class Type>
-  Type ArgumentOrDefault(const std::string &arg, Type default_retval) { 
-    if (params_.count(arg)) {
-      return ParseString<Type>(params_.equal_range(arg).first->second);
+  Type ArgumentOrDefault(const std::string &arg, Type default_retval) const {
+    if (params.count(arg)) {
+      return ParseString<Type>(params.equal_range(arg).first->second);
     } else {
       return default_retval;
     }
@@ -74,30 +124,113 @@ class WebCommand : public WebAPI::Registrar {
   
   template <class Type>
   Type LoadMessage() {
-    const std::string req(request_->get_content(), request_->get_content_length());
-    std::string format;
-    if (params_.count("format")) {
-      format = params_.equal_range("format").first->second;
-    } else {
-      format = "pb";
-    }
     Type input;
+    LoadMessage(&input);
+    return input;
+  }
+
+  // Parses the request body into input, which may live on an arena.
+  template <class Type>
+  void LoadMessage(Type* input) {
+    const std::string req(http->get_content(), http->get_content_length());
+    const std::string format = Format();
     if (format == "json") {
-      google::protobuf::util::JsonStringToMessage(req, &input);
+      google::protobuf::util::JsonStringToMessage(req, input);
     } else if(format == "pb") {
       VLOG(5) << "Loading protobuf of size " << req.size();
-      input.ParseFromString(req);
+      input->ParseFromString(req);
     } else {
       throw std::invalid_argument("Request body is not of valid type.");
     }
-    input.DiscardUnknownFields();
-    return input;
+    input->DiscardUnknownFields();
   }
 
-  pion::ihash_multimap params_;
-  HTTPRequestPtr request_;
-  HTTPResponseWriterPtr writer_;
-  std::string remote_user_; 
+  const HTTPRequestPtr http;
+  const HTTPResponseWriterPtr writer;
+  const TCPConnectionPtr conn;
+  const pion::ihash_multimap params;
+  // The subject of the client's certificate, if it presented one.
+  std::string remote_user;
+  // The channel the request was addressed to; empty for the default channel.
+  std::string channel;
+
+ private:
+  friend class WebCommand;
+
+  // Writes out what StreamMessage has buffered, compressed if the client
+  // asked for that.  With end, also ends the compressed body.
+  void FlushStream(bool end = false);
+
+  WebCommand *const command_;
+  // Bodies passed to pion by ReturnMessage, to be kept alive until sent.
+  std::vector<std::shared_ptr<const std::string> > response_bodies_;
+  std::string response_content_type_;
+  // The coding the client would like the body in, and the one it is in, with
+  // what its size was before.
+  ContentCoding coding_;
+  std::string response_content_encoding_;
+  size_t response_identity_size_;
+
+  bool streaming_;
+  bool stream_chunked_;
+  bool stream_failed_;
+  int64_t stream_records_;
+  std::string stream_format_;
+  std::string stream_buffer_;
+  Compressor* stream_compressor_;
+  std::string stream_compressed_;
+
+  DISALLOW_COPY_AND_ASSIGN(WebRequest);
+};
+
+class WebCommand : public WebAPI::Registrar {
+  virtual void handle_command(WebRequest& request) = 0;
+  void handle_command(HTTPRequestPtr, const TCPConnectionPtr& tcp_conn); 
+  WebAPI::web_callback get_callback() {
+    return [this](HTTPRequestPtr request, const TCPConnectionPtr& conn) {
+      handle_command(request, conn);
+    };
+  }
+ protected:
+  // An arena for transient messages built while handling a request on this
+  // thread.  It is reset once the handler returns, so nothing allocated on it
+  // may be kept past the end of the request.
+  static google::protobuf::Arena* RequestArena();
+
+  // Endpoints whose responses depend only on the request and on data in the
+  // database return true for those requests.  They then get an ETag, honor
+  // If-None-Match, and may be served from the ResponseCache.  Anything the
+  // handler keeps outside the database must bump MessageStore's generation
+  // when it changes.
+  virtual bool IsCacheable(const WebRequest& request) { return false; }
+
+ private:
+  friend class WebRequest;
+
+  // Compresses the response ReturnMessage made, if the client accepts a
+  // coding we have and it is worth it.
+  void CompressResponse(WebRequest& request);
+  // Hands the response to pion, and the connection back to it once it is sent.
+  void SendResponse(const std::shared_ptr<WebRequest>& request, const TCPConnectionPtr& tcp_conn);
+  // The resource, including any channel prefix, plus its sorted parameters
+  // and the effective format.
+  std::string CacheKey(const WebRequest& request);
+
+  // Per-endpoint counters, looked up once by the first request.
+  std::once_flag stats_once_;
+  metrics::Counter* responses_ = nullptr;
+  metrics::Counter* response_bytes_ = nullptr;
+  metrics::Counter* serialization_usec_ = nullptr;
+  metrics::Counter* arena_bytes_ = nullptr;
+  metrics::Counter* heap_allocations_ = nullptr;
+  metrics::Counter* cache_hits_ = nullptr;
+  metrics::Counter* cache_misses_ = nullptr;
+  metrics::Counter* not_modified_ = nullptr;
+  metrics::Counter* bytes_out_ = nullptr;
+  metrics::Counter* uncompressed_bytes_ = nullptr;
+  metrics::Counter* compression_usec_ = nullptr;
+  metrics::Counter* errors_ = nullptr;
+  metrics::Histogram* latency_ = nullptr;
 };
 
 #endif
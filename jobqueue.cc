@@ -0,0 +1,118 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "jobqueue.h"
+
+#include <algorithm>
+#include <exception>
+#include <time.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int32(job_threads, 2, "Number of threads executing long-running API commands, such as "
+  "/requirements/runonce.  Jobs beyond this many wait in a queue.");
+DEFINE_int32(job_history, 100, "Number of finished jobs whose status is kept for /jobs.");
+DEFINE_int32(job_queue_size, 32, "Most jobs that may wait for a job thread; more are refused.");
+
+JobQueue* JobQueue::Get() {
+  static JobQueue* queue = new JobQueue(std::max(1, FLAGS_job_threads));
+  return queue;
+}
+
+JobQueue::JobQueue(int threads) :
+  next_id_(1) {
+  for (int i = 0; i < threads; ++i) {
+    threads_.create_thread([this]() { Worker(); });
+  }
+}
+
+bool JobQueue::Submit(const std::string& description, const std::string& submitted_by,
+                      std::function<void()> work, automation::Job* status) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (pending_.size() >= (size_t)std::max(0, FLAGS_job_queue_size)) {
+    LOG(WARNING) << "Job queue full; refusing " << description << " from " << submitted_by;
+    return false;
+  }
+  const int64_t id = next_id_++;
+  automation::Job& job = jobs_[id];
+  job.set_jobid(id);
+  job.set_state(automation::Job::QUEUED);
+  job.set_description(description);
+  job.set_submitted_by(submitted_by);
+  job.set_submitted(time(NULL));
+  pending_.push_back(std::make_pair(id, std::move(work)));
+  work_available_.notify_one();
+  LOG(INFO) << "Queued job " << id << ": " << description;
+  status->CopyFrom(job);
+  return true;
+}
+
+bool JobQueue::Status(int64_t id, automation::Job* status) {
+  boost::mutex::scoped_lock lock(mutex_);
+  auto it = jobs_.find(id);
+  if (it == jobs_.end()) {
+    return false;
+  }
+  status->CopyFrom(it->second);
+  return true;
+}
+
+void JobQueue::List(automation::Jobs* jobs) {
+  boost::mutex::scoped_lock lock(mutex_);
+  for (const auto& job : jobs_) {
+    jobs->add_job()->CopyFrom(job.second);
+  }
+}
+
+void JobQueue::Worker() {
+  while (true) {
+    int64_t id;
+    std::function<void()> work;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (pending_.empty()) {
+        work_available_.wait(lock);
+      }
+      id = pending_.front().first;
+      work = std::move(pending_.front().second);
+      pending_.pop_front();
+      jobs_[id].set_state(automation::Job::RUNNING);
+      jobs_[id].set_started(time(NULL));
+    }
+
+    automation::Job::State state = automation::Job::DONE;
+    std::string error;
+    try {
+      work();
+    } catch (std::exception& e) {
+      state = automation::Job::FAILED;
+      error = e.what();
+      LOG(ERROR) << "Job " << id << " failed: " << error;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    automation::Job& job = jobs_[id];
+    job.set_state(state);
+    job.set_finished(time(NULL));
+    if (!error.empty()) {
+      job.set_error(error);
+    }
+    finished_.push_back(id);
+    while (finished_.size() > (size_t)std::max(0, FLAGS_job_history)) {
+      jobs_.erase(finished_.front());
+      finished_.pop_front();
+    }
+  }
+}
@@ -0,0 +1,67 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "base.h"
+#include "job.pb.h"
+
+// JobQueue runs commands that may take minutes (e.g. playing a requirement via
+// /requirements/runonce) on its own pool of FLAGS_job_threads threads, so that
+// they can never tie up the threads serving the Web API.  Jobs are identified
+// by a JobID, and the status of the last FLAGS_job_history finished jobs is
+// kept around for clients to poll.
+class JobQueue {
+ public:
+  // The process-wide queue.  Its threads are started on first use.
+  static JobQueue* Get();
+
+  // Queues work and fills in its status (including the new JobID) as of now.
+  // Returns false, queueing nothing, if FLAGS_job_queue_size jobs are already
+  // waiting.  If work throws, the job is marked FAILED with the exception's
+  // message.
+  bool Submit(const std::string& description, const std::string& submitted_by,
+              std::function<void()> work, automation::Job* status);
+
+  // Fills in the status of the given job, returning false if it is unknown.
+  bool Status(int64_t id, automation::Job* status);
+  // Fills in the status of every job we still know about, oldest first.
+  void List(automation::Jobs* jobs);
+
+ private:
+  explicit JobQueue(int threads);
+  void Worker();
+
+  boost::mutex mutex_;  // Guards everything below.
+  boost::condition_variable work_available_;
+  int64_t next_id_;
+  std::deque<std::pair<int64_t, std::function<void()> > > pending_;
+  std::map<int64_t, automation::Job> jobs_;
+  std::deque<int64_t> finished_;  // In order of completion, for expiry.
+
+  boost::thread_group threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(JobQueue);
+};
+
+#endif
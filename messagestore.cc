@@ -22,10 +22,12 @@
 #include "boost/algorithm/string/split.hpp"
 #include "boost/algorithm/string/classification.hpp"
 #include <boost/thread/mutex.hpp>
+#include <atomic>
 #include <string>
 #include <vector>
 #include <google/protobuf/dynamic_message.h>
 #include "messagestore.h"
+#include "trace.h"
 #include <exception>
 
 using std::vector;
@@ -41,6 +43,17 @@ class constraintexception_decl : public std::exception {
 } ConstraintException;
  
 
+namespace {
+std::atomic<uint64_t> write_generation(0);
+}
+
+uint64_t MessageStore::generation() {
+  return write_generation.load(std::memory_order_acquire);
+}
+void MessageStore::BumpGeneration() {
+  write_generation.fetch_add(1, std::memory_order_acq_rel);
+}
+
 MessageStore::MessageStore(sqlite3 *db, const Descriptor *desc, const std::string& table) : db_(db), desc_(desc), lookup_by_id_(NULL), table_(table), never_save_(false) {
 }
 void MessageStore::NeverSave() {
@@ -73,6 +86,7 @@ bool MessageStore::LoadById(Message* lookup, int64_t id) {
 }
 
 bool MessageStore::Load(Message* lookup) {
+  TRACE_SCOPE("MessageStore::Load");
   std::string query = "SELECT * from " + table_ + " WHERE ";
 
   const Reflection* reflection = lookup->GetReflection();
@@ -222,6 +236,7 @@ int MessageStore::InsertOrReplace(Message* value, std::string cmd) {
     CHECK(SQLITE_OK == sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL));
     throw ConstraintException;
   }
+  BumpGeneration();
   return result;
 }
 int MessageStore::BindFromFields(const Message& object, sqlite3_stmt *ps) { 
@@ -242,6 +257,9 @@ int MessageStore::BindFromFields(const Message& object, sqlite3_stmt *ps) {
       case FieldDescriptor::TYPE_INT64:
         sqlite3_bind_int64(ps, i, reflection->GetInt64(object, fd));
         break;
+      case FieldDescriptor::TYPE_BOOL:
+        sqlite3_bind_int(ps, i, reflection->GetBool(object, fd));
+        break;
       case FieldDescriptor::TYPE_BYTES:
       case FieldDescriptor::TYPE_STRING:
         fieldval = reflection->GetString(object, fd);
@@ -268,9 +286,12 @@ bool MessageStore::ProtoFromRows(sqlite3_stmt *ps, Message *result) {
       case FieldDescriptor::TYPE_INT32:
         reflection->SetInt32(result, fd, sqlite3_column_int(ps, i));
         break;
+      case FieldDescriptor::TYPE_BOOL:
+        reflection->SetBool(result, fd, sqlite3_column_int(ps, i));
+        break;
       case FieldDescriptor::TYPE_INT64:
         if (!fd->is_repeated()) {
-          reflection->SetInt64(result, fd, sqlite3_column_int(ps, i));
+          reflection->SetInt64(result, fd, sqlite3_column_int64(ps, i));
           break;
         }
         // We can do joins by getting a group_concat of IDs via a view, so special case that
@@ -284,8 +305,8 @@ bool MessageStore::ProtoFromRows(sqlite3_stmt *ps, Message *result) {
       case FieldDescriptor::TYPE_STRING:
       case FieldDescriptor::TYPE_BYTES:
         blob = (char *) sqlite3_column_blob(ps, i);
-        stringblob = string(blob, sqlite3_column_bytes(ps, i));
-        reflection->SetString(result, fd, stringblob);
+        // Moved into the field, so each column is copied (and allocated) once.
+        reflection->SetString(result, fd, string(blob, sqlite3_column_bytes(ps, i)));
         break;
       default:
         CHECK(false) << "Unknown type " << fd->type();
@@ -36,6 +36,11 @@ class MessageStore {
   void NeverSave();
   ~MessageStore();
 
+  // Bumped every time any MessageStore in this process commits a write, so that
+  // caches of data derived from the database can tell when they are stale.
+  static uint64_t generation();
+  static void BumpGeneration();
+
  protected:
   void SetTable(const std::string& tablename);
   int InsertOrReplace(Message* value, std::string cmd);
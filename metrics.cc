@@ -0,0 +1,219 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "metrics.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <stdlib.h>
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+
+#ifdef COUNT_ALLOCATIONS
+namespace {
+thread_local int64_t thread_allocations = 0;
+}
+
+void* operator new(size_t size) {
+  ++thread_allocations;
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void *p) noexcept {
+  free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+#endif
+
+namespace metrics {
+
+namespace {
+
+struct Family {
+  std::string help;
+  double scale = 1.0;
+  // Keyed by labels.  A family holds either counters or histograms.
+  std::map<std::string, std::unique_ptr<Counter> > counters;
+  std::map<std::string, std::unique_ptr<Histogram> > histograms;
+};
+
+// Guards families().  Only taken on registration and export.
+boost::mutex& registry_mutex() {
+  static boost::mutex mutex;
+  return mutex;
+}
+std::map<std::string, Family>& families() {
+  static std::map<std::string, Family> families;
+  return families;
+}
+
+// Histograms are exported with one Prometheus bucket per power of two, from
+// 2^kFirstExported up to 2^kLastExported; anything larger only shows in +Inf.
+// Bucket boundaries fall on powers of two, so each exported bucket counts the
+// samples strictly below its bound.
+const int kFirstExported = 4;
+const int kLastExported = 36;
+
+}  // namespace
+
+Histogram::Shard::Shard() :
+  count(0),
+  sum(0),
+  next(nullptr) {
+  for (std::atomic<int64_t>& bucket : counts) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+Histogram::Histogram() :
+  shards_(nullptr) {
+}
+
+int Histogram::Bucket(int64_t value) {
+  if (value < 4) {
+    return value < 0 ? 0 : value;
+  }
+  const int power = 63 - __builtin_clzll(value);
+  const int bucket = 4 + (power - 2) * 4 + ((value >> (power - 2)) & 3);
+  return std::min(bucket, kBuckets - 1);
+}
+
+int64_t Histogram::BucketLowerBound(int bucket) {
+  if (bucket < 4) {
+    return bucket;
+  }
+  const int power = (bucket - 4) / 4 + 2;
+  return (1LL << power) + ((bucket - 4) % 4) * (1LL << (power - 2));
+}
+
+Histogram::Shard* Histogram::LocalShard() {
+  // Only the first sample a thread records into a histogram gets here with an
+  // empty slot; that one allocation is the only non-trivial work Record does.
+  thread_local std::unordered_map<const Histogram*, Shard*> local;
+  Shard*& shard = local[this];
+  if (!shard) {
+    shard = new Shard();
+    shard->next = shards_.load(std::memory_order_relaxed);
+    while (!shards_.compare_exchange_weak(shard->next, shard, std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+    }
+  }
+  return shard;
+}
+
+void Histogram::Record(int64_t value) {
+  Shard* shard = LocalShard();
+  shard->counts[Bucket(value)].fetch_add(1, std::memory_order_relaxed);
+  shard->count.fetch_add(1, std::memory_order_relaxed);
+  shard->sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::Merge() const {
+  Snapshot snapshot;
+  snapshot.counts.assign(kBuckets, 0);
+  snapshot.count = 0;
+  snapshot.sum = 0;
+  for (Shard* shard = shards_.load(std::memory_order_acquire); shard; shard = shard->next) {
+    for (int i = 0; i < kBuckets; ++i) {
+      snapshot.counts[i] += shard->counts[i].load(std::memory_order_relaxed);
+    }
+    snapshot.count += shard->count.load(std::memory_order_relaxed);
+    snapshot.sum += shard->sum.load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+Counter* GetCounter(const std::string& name, const std::string& help, const std::string& labels) {
+  boost::mutex::scoped_lock lock(registry_mutex());
+  Family& family = families()[name];
+  family.help = help;
+  std::unique_ptr<Counter>& counter = family.counters[labels];
+  if (!counter) {
+    counter.reset(new Counter());
+  }
+  return counter.get();
+}
+
+Histogram* GetHistogram(const std::string& name, const std::string& help,
+                        const std::string& labels, double scale) {
+  boost::mutex::scoped_lock lock(registry_mutex());
+  Family& family = families()[name];
+  family.help = help;
+  family.scale = scale;
+  std::unique_ptr<Histogram>& histogram = family.histograms[labels];
+  if (!histogram) {
+    histogram.reset(new Histogram());
+  }
+  return histogram.get();
+}
+
+int64_t ThreadAllocations() {
+#ifdef COUNT_ALLOCATIONS
+  return thread_allocations;
+#else
+  return 0;
+#endif
+}
+
+std::string ExportPrometheus() {
+  boost::mutex::scoped_lock lock(registry_mutex());
+  std::ostringstream out;
+  for (const auto& family : families()) {
+    const std::string& name = family.first;
+    out << "# HELP " << name << " " << family.second.help << "\n";
+    if (family.second.histograms.empty()) {
+      out << "# TYPE " << name << " counter\n";
+    } else {
+      out << "# TYPE " << name << " histogram\n";
+    }
+    for (const auto& counter : family.second.counters) {
+      out << name;
+      if (!counter.first.empty()) {
+        out << "{" << counter.first << "}";
+      }
+      out << " " << counter.second->value() << "\n";
+    }
+    for (const auto& histogram : family.second.histograms) {
+      const std::string separator = histogram.first.empty() ? "" : ",";
+      const Histogram::Snapshot snapshot = histogram.second->Merge();
+      int64_t cumulative = 0;
+      int bucket = 0;
+      for (int power = kFirstExported; power <= kLastExported; ++power) {
+        const int64_t bound = 1LL << power;
+        for (; bucket < Histogram::kBuckets && Histogram::BucketLowerBound(bucket) < bound; ++bucket) {
+          cumulative += snapshot.counts[bucket];
+        }
+        out << name << "_bucket{" << histogram.first << separator << "le=\""
+            << bound * family.second.scale << "\"} " << cumulative << "\n";
+      }
+      out << name << "_bucket{" << histogram.first << separator << "le=\"+Inf\"} "
+          << snapshot.count << "\n";
+      const std::string labels = histogram.first.empty() ? "" : "{" + histogram.first + "}";
+      out << name << "_sum" << labels << " " << snapshot.sum * family.second.scale << "\n";
+      out << name << "_count" << labels << " " << snapshot.count << "\n";
+    }
+  }
+  return out.str();
+}
+
+}  // namespace metrics
@@ -0,0 +1,107 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "base.h"
+
+namespace metrics {
+
+// A monotonically increasing count.  Increments are a single relaxed atomic
+// add, so counters are cheap enough to bump on every request.
+class Counter {
+ public:
+  Counter() : value_(0) {}
+  void Increment(int64_t delta = 1) { value_.fetch_add(delta, std::memory_order_relaxed); }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_;
+  DISALLOW_COPY_AND_ASSIGN(Counter);
+};
+
+// A distribution of non-negative integer samples (typically microseconds) in
+// log-linear buckets: exact below 4, then four buckets per power of two, so any
+// sample is known to within 25%.  Every recording thread gets a shard of its
+// own, so Record() is a handful of relaxed atomic adds to memory no other
+// thread writes, with no locks.  Readers merge the shards.
+class Histogram {
+ public:
+  static const int kBuckets = 4 + 4 * 44;
+
+  Histogram();
+
+  void Record(int64_t value);
+
+  // Sums every thread's shard.  counts has kBuckets entries.
+  struct Snapshot {
+    std::vector<int64_t> counts;
+    int64_t count;
+    int64_t sum;
+  };
+  Snapshot Merge() const;
+
+  static int Bucket(int64_t value);
+  // The smallest value that falls in the given bucket.
+  static int64_t BucketLowerBound(int bucket);
+
+ private:
+  struct Shard {
+    Shard();
+    std::atomic<int64_t> counts[kBuckets];
+    std::atomic<int64_t> count;
+    std::atomic<int64_t> sum;
+    Shard* next;
+  };
+  Shard* LocalShard();
+
+  // Shards are pushed onto this list by their threads and never removed.
+  std::atomic<Shard*> shards_;
+
+  DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+// Returns the counter called name with the given Prometheus label set (e.g.
+// 'endpoint="/playlist"'), creating it on first use.  Lookups take a lock, so
+// callers on hot paths should hold on to the pointer; counters live forever.
+Counter* GetCounter(const std::string& name, const std::string& help,
+                    const std::string& labels = "");
+
+// As GetCounter, for histograms.  Samples are multiplied by scale when exported
+// (e.g. 1e-6 to record microseconds and export seconds, as Prometheus prefers).
+Histogram* GetHistogram(const std::string& name, const std::string& help,
+                        const std::string& labels = "", double scale = 1.0);
+
+// The number of times the calling thread has called operator new.  This is only
+// tracked in builds with -DCOUNT_ALLOCATIONS, which replaces the global
+// allocator with a counting one; otherwise it is always zero.
+#ifdef COUNT_ALLOCATIONS
+const bool kCountAllocations = true;
+#else
+const bool kCountAllocations = false;
+#endif
+int64_t ThreadAllocations();
+
+// Renders every registered metric in the Prometheus text exposition format.
+std::string ExportPrometheus();
+
+}  // namespace metrics
+
+#endif
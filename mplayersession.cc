@@ -22,8 +22,11 @@
 #include <sys/select.h>
 #include "dirent.h"
 #include <stdlib.h>
+#include "clock.h"
 #include "playableitem.h"
 #include "mplayersession.h"
+#include "prefetcher.h"
+#include "trace.h"
 #include "stdio.h"
 #include <string>
 #include <iostream>
@@ -36,54 +39,174 @@
 #include <mpv/client.h>
 #include <gflags/gflags.h>
 
-MplayerSession::MplayerSession() :
-  mpv_(mpv_create()) {
+namespace {
+// Near enough when the process started, for timing how long it takes to get
+// to the first track.
+const std::chrono::steady_clock::time_point kProcessStart = std::chrono::steady_clock::now();
+std::atomic<bool> first_start(true);
+}
+
+MplayerSession::MplayerSession(mpv_handle* mpv) :
+  mpv_(mpv),
+  transition_gap_(metrics::GetHistogram("player_transition_gap_seconds",
+      "Silence between the end of one file and the start of audio from the next.", "", 1e-6)) {
+}
+
+MplayerSession::MplayerSession(const std::string& audio_device) :
+  MplayerSession(CreateHandle(audio_device)) {
+  audio_device_ = audio_device;
+}
 
-  CHECK(mpv_observe_property(mpv_, 0, "pause", MPV_FORMAT_FLAG) == 0);
-  CHECK(mpv_observe_property(mpv_, 0, "time-pos", MPV_FORMAT_DOUBLE) == 0);
-  CHECK(mpv_observe_property(mpv_, 0, "length", MPV_FORMAT_DOUBLE) == 0);
-  CHECK(mpv_observe_property(mpv_, 0, "metadata", MPV_FORMAT_STRING) == 0);
-  CHECK(mpv_initialize(mpv_) == 0);
+mpv_handle* MplayerSession::CreateHandle(const std::string& audio_device) {
+  mpv_handle* mpv = mpv_create();
+  if (!audio_device.empty()) {
+    CHECK(mpv_set_option_string(mpv, "audio-device", audio_device.c_str()) == 0)
+        << "Unable to select audio device " << audio_device;
+  }
+  CHECK(mpv_observe_property(mpv, 0, "pause", MPV_FORMAT_FLAG) == 0);
+  CHECK(mpv_observe_property(mpv, 0, "time-pos", MPV_FORMAT_DOUBLE) == 0);
+  CHECK(mpv_observe_property(mpv, 0, "length", MPV_FORMAT_DOUBLE) == 0);
+  CHECK(mpv_observe_property(mpv, 0, "metadata", MPV_FORMAT_STRING) == 0);
+  CHECK(mpv_initialize(mpv) == 0);
+  return mpv;
+}
+
+void MplayerSession::DrainEvents(mpv_handle* mpv) {
+  while (mpv_wait_event(mpv, 0)->event_id != MPV_EVENT_NONE) {
+  }
+}
+
+bool MplayerSession::Preload(const automation::PlayableItem& item) {
+  TRACE_SCOPE("MplayerSession::Preload");
+  boost::mutex::scoped_lock play_lock(play_mutex_);
+  if (item.type() == automation::PlayableItem::WEBSTREAM) {
+    return false;
+  }
+  const std::string path = Prefetcher::Get()->Resolve(item.filename());
+  if (path.empty()) {
+    return false;
+  }
+  if (!standby_) {
+    standby_ = CreateHandle(audio_device_);
+  }
+  // Until the last preloaded Play this may have been the main instance; what
+  // it reported then mustn't be taken for the outcome of this load.
+  DrainEvents(standby_);
+  preloaded_.clear();
+  mpv_set_property_string(standby_, "pause", "yes");
+  mpv_set_property_string(standby_, "cache", "0");
+  const char *args[] = {
+    "loadfile", path.c_str(), nullptr
+  };
+  if (mpv_command(standby_, args) != 0) {
+    return false;
+  }
+  // Wait until it's decoded up to the first audio and holding there.
+  const auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (std::chrono::steady_clock::now() < give_up) {
+    mpv_event *event = mpv_wait_event(standby_, 0.25);
+    if (event->event_id == MPV_EVENT_END_FILE &&
+        ((mpv_event_end_file*)event->data)->reason == MPV_END_FILE_REASON_ERROR) {
+      LOG(WARNING) << "Unable to preload " << item.filename();
+      return false;
+    }
+    if (event->event_id == MPV_EVENT_PLAYBACK_RESTART) {
+      VLOG(5) << "Preloaded " << item.filename();
+      preloaded_ = item.filename();
+      return true;
+    }
+  }
+  LOG(WARNING) << "Timed out preloading " << item.filename();
+  return false;
+}
+
+void MplayerSession::Started() {
+  last_start_micros_ = Clock::Get()->NowMicros();
+  if (first_start.exchange(false)) {
+    const int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - kProcessStart).count();
+    LOG(INFO) << "First track started " << micros / 1000 << "ms after startup.";
+    metrics::GetHistogram("player_startup_seconds", "From startup to the first track starting.",
+                          "", 1e-6)->Record(micros);
+  }
+  if (previous_ended_) {
+    transition_gap_->Record(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - previous_end_).count());
+    previous_ended_ = false;
+  }
 }
 
 bool MplayerSession::Play(PlayableItem& item) {
-  if  (item.data().has_playableitemid()) {
+  if  (item.snapshot()->has_playableitemid()) {
     item.IncrementPlaycount();
-    item.Update();
   }
-  return Play(item.data());
+  return Play(*item.snapshot());
 }
 bool MplayerSession::Play(const automation::PlayableItem& item) {
+  TRACE_SCOPE("MplayerSession::Play");
+  boost::mutex::scoped_lock play_lock(play_mutex_);
+  const bool preloaded = standby_ && !preloaded_.empty() && item.filename() == preloaded_;
+  std::string path;
+  if (!preloaded) {
+    // Webstreams are passed through as they are.
+    path = Prefetcher::Get()->Resolve(item.filename());
+    if (path.empty()) {
+      // Fail now rather than have mpv give up on it after the track boundary.
+      return false;
+    }
+  }
+  Prefetcher::Get()->RecordPlay(item.filename());
+
   boost::mutex::scoped_lock state_lock(state_mutex_);
   state_.mutable_now_playing()->MergeFrom(item);
   state_lock.unlock();
 
 
   LOG(INFO) << "requesting playing of " << item.filename();
-  CHECK_NOTNULL(mpv_);
-
-  if (item.type() == automation::PlayableItem::WEBSTREAM) {
-    char endpos[16];
-    char cache[16];
-    snprintf(endpos, sizeof endpos, "%ld", item.duration());
-    snprintf(cache, sizeof cache, "%d", item.cache());
-    mpv_set_property_string(mpv_, "cache", cache);
-    mpv_set_property_string(mpv_, "length", endpos);
+  bool started = false;
+  if (preloaded) {
+    // It's ready and waiting in the standby instance; swap that in and let it go.
+    standby_ = mpv_.exchange(standby_);
+    preloaded_.clear();
+    mpv_set_property_string(mpv_, "pause", "no");
+    started = true;
+    Started();
   } else {
-    mpv_set_property_string(mpv_, "cache", "0");
-  }
+    if (item.type() == automation::PlayableItem::WEBSTREAM) {
+      char endpos[16];
+      char cache[16];
+      snprintf(endpos, sizeof endpos, "%ld", item.duration());
+      snprintf(cache, sizeof cache, "%d", item.cache());
+      mpv_set_property_string(mpv_, "cache", cache);
+      mpv_set_property_string(mpv_, "length", endpos);
+    } else {
+      mpv_set_property_string(mpv_, "cache", "0");
+    }
 
-  const char *args[] = {
-    "loadfile", item.filename().c_str(), nullptr
-  };
+    const char *args[] = {
+      "loadfile", path.c_str(), nullptr
+    };
 
- 
-  CHECK(mpv_command(mpv_, args) == 0);
-  while (mpv_) {
-    mpv_event *event = mpv_wait_event(mpv_, 0.25);
+    CHECK(mpv_command(mpv_, args) == 0);
+  }
+  mpv_handle* const mpv = mpv_;
+  while (mpv) {
+    mpv_event *event = mpv_wait_event(mpv, 0.25);
     if (event->event_id == MPV_EVENT_END_FILE) {
+      if (!started && ((mpv_event_end_file*)event->data)->reason == MPV_END_FILE_REASON_ERROR) {
+        LOG(WARNING) << "Unable to play " << item.filename();
+        return false;
+      }
+      previous_ended_ = true;
+      previous_end_ = std::chrono::steady_clock::now();
       return true;
     }
+    // mpv restarts playback after every seek too; only the first one after
+    // loadfile is the start of audio.
+    if (event->event_id == MPV_EVENT_PLAYBACK_RESTART && !started) {
+      started = true;
+      Started();
+    }
     if (event->event_id == MPV_EVENT_PROPERTY_CHANGE) {
       mpv_event_property *prop = (mpv_event_property*)event->data;
       if (prop->data == nullptr) {
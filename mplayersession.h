@@ -17,9 +17,12 @@
 #ifndef MPLAYER_SESSION_H
 #define MPLAYER_SESSION_H
 
+#include <chrono>
 #include <vector>
 #include <string>
 #include "base.h"
+#include "metrics.h"
+#include <atomic>
 #include <boost/thread/mutex.hpp>
 #include <mpv/client.h>
 #include "playerstate.pb.h"
@@ -27,13 +30,25 @@
 
 class MplayerSession {
  public:
-  MplayerSession();
+  // Plays to mpv's default audio device unless given another, in mpv's
+  // --audio-device syntax.
+  explicit MplayerSession(const std::string& audio_device = "");
+  virtual ~MplayerSession() {}
 
   // Two versions of play - the one that takes the PlayableItem reference, and
   // another that takes the raw proto.  The raw proto version doesn't increment
-  // playcount (or otherwise touch the database)
-  bool Play(PlayableItem &item);
-  bool Play(const automation::PlayableItem &item);
+  // playcount (or otherwise touch the database).  Both return false if the file
+  // couldn't be played.
+  virtual bool Play(PlayableItem &item);
+  virtual bool Play(const automation::PlayableItem &item);
+
+  // Loads item, paused, into a second mpv instance, so that when it is next
+  // played it starts as soon as it is unpaused.  Returns false if it can't be
+  // loaded.  Waits for any Play in progress to finish.
+  virtual bool Preload(const automation::PlayableItem &item);
+
+  // When audio last started playing, in Clock microseconds.
+  int64_t last_start_micros() const { return last_start_micros_; }
 
   void Pause();
   void Unpause();
@@ -44,17 +59,46 @@ class MplayerSession {
   
   void MergeState(automation::PlayerState *dest);
 
- private:
-  bool is_timedout();
+ protected:
+  // For players that don't drive mpv, such as SimulatedPlayer.  Only Play and
+  // MergeState may be used on them.
+  explicit MplayerSession(mpv_handle* mpv);
 
-  DISALLOW_COPY_AND_ASSIGN(MplayerSession);
-
-  mpv_handle* mpv_;
- 
   // state_mutex_ guards the automation::PlayerState that contains information
   // about our current state.
   boost::mutex state_mutex_;
   automation::PlayerState state_;
+
+  std::atomic<int64_t> last_start_micros_{0};
+
+ private:
+  bool is_timedout();
+  // Creates an mpv instance, observing the properties we keep in state_.
+  static mpv_handle* CreateHandle(const std::string& audio_device);
+  // Discards the events waiting on mpv.
+  static void DrainEvents(mpv_handle* mpv);
+  // Called as the audio of a file starts.
+  void Started();
+
+  DISALLOW_COPY_AND_ASSIGN(MplayerSession);
+
+  // Play and Preload are called from the channel's thread and from
+  // /requirements/runonce jobs; play_mutex_ makes them take turns, and guards
+  // everything below but mpv_ and audio_device_.
+  boost::mutex play_mutex_;
+  // Swapped with standby_ by Play, so read once where that matters.
+  std::atomic<mpv_handle*> mpv_;
+  std::string audio_device_;
+  // The instance Preload loads into, created on first use, and the file it
+  // holds ready.
+  mpv_handle* standby_ = nullptr;
+  std::string preloaded_;
+
+  // When the previous file ended, so the silence before the next one starts
+  // playing can be measured.
+  bool previous_ended_ = false;
+  std::chrono::steady_clock::time_point previous_end_;
+  metrics::Histogram* transition_gap_;
 };
 
 #endif
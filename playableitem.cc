@@ -38,6 +38,7 @@
 #endif
 #include "playableitem.pb.h"
 #include "protostore.h"
+#include "responsecache.h"
 
 bool PlayableItem::fetch(const std::string& filename) {
   boost::mutex::scoped_lock lock(mutex_);
@@ -47,9 +48,10 @@ bool PlayableItem::fetch(const std::string& filename) {
   LOG(INFO) << canonical_.DebugString();
 
   if (canonical_.has_filename() && !canonical_.has_duration()) {
-    canonical_.set_duration(CalculateDuration());
+    canonical_.set_duration(CalculateDuration(canonical_.filename()));
   }
-  
+  Publish();
+
   return result;
 }
 
@@ -58,40 +60,65 @@ PlayableItem::PlayableItem(sqlite3 *db) :
 }
 
 void PlayableItem::IncrementPlaycount() {
-  // There is a slight race here, because if we are being incremented in two
-  // threads then it's possible we were both created with original state,
-  // and we'll only count this once.  But triggering this would require, say,
-  // playback through the API at the same time as through the main thread,
-  // which would maybe result in a neat double-tracking effect but probably only
-  // really be one logical playback as far as anyone is concerned, so this doesn't
-  // really bother me.  If it bothers you, however, we could just do a SQL UPDATE
-  // here instead.
   boost::mutex::scoped_lock lock(mutex_);
   canonical_.set_playcount(canonical_.playcount() + 1);
+  Publish();
+  if (!canonical_.has_playableitemid()) {
+    return;
+  }
+  // A SQL UPDATE rather than writing back the whole item, so that plays in
+  // two threads at once are both counted, and so that it doesn't invalidate
+  // every cached response.
+  const int64_t id = canonical_.playableitemid();
+  ResponseCache::WriteUnseen([this, id]() {
+    sqlite3_stmt *ps;
+    CHECK(sqlite3_prepare_v2(db_, "UPDATE PlayableItem SET playcount = playcount + 1 "
+                             "WHERE PlayableItemID = ?", -1, &ps, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
+    sqlite3_bind_int64(ps, 1, id);
+    const int status = sqlite3_step(ps);
+    sqlite3_finalize(ps);
+    if (status != SQLITE_DONE) {
+      LOG(ERROR) << "Unable to count a play of " << id << ": " << sqlite3_errmsg(db_);
+    }
+  });
 }
 
 #ifdef USE_RE2
-bool PlayableItem::matches(const RE2& re) {
-  CHECK(re.ok());
-  boost::mutex::scoped_lock lock(mutex_);
-  return RE2::PartialMatch(canonical_.description(), re) || RE2::PartialMatch(canonical_.filename(), re);
+ItemMatcher::ItemMatcher(const std::string& regexp) :
+  re_("(?i)"+regexp),
+  ok_(re_.ok()) {
+}
+ItemMatcher::~ItemMatcher() {
+}
+bool ItemMatcher::Matches(const automation::PlayableItem& item) const {
+  CHECK(ok_);
+  return RE2::PartialMatch(item.description(), re_) || RE2::PartialMatch(item.filename(), re_);
 }
 #else
-bool PlayableItem::matches(const regex_t& re) {
-  boost::mutex::scoped_lock lock(mutex_);
-  return !regexec(&re, canonical_.description().c_str(), 0, NULL, 0) ||
-         !regexec(&re, canonical_.filename().c_str(), 0, NULL, 0);
+ItemMatcher::ItemMatcher(const std::string& regexp) :
+  ok_(!regcomp(&re_, regexp.c_str(), REG_ICASE | REG_EXTENDED | REG_NOSUB)) {
+}
+ItemMatcher::~ItemMatcher() {
+  if (ok_) {
+    regfree(&re_);
+  }
+}
+bool ItemMatcher::Matches(const automation::PlayableItem& item) const {
+  CHECK(ok_);
+  return !regexec(&re_, item.description().c_str(), 0, NULL, 0) ||
+         !regexec(&re_, item.filename().c_str(), 0, NULL, 0);
 }
 #endif
 
-int PlayableItem::CalculateDuration() {
-  std::string filename;
-  
-  if (!canonical_.has_filename()) {
+bool PlayableItem::matches(const ItemMatcher& pattern) {
+  return pattern.Matches(*snapshot());
+}
+
+int PlayableItem::CalculateDuration(const std::string& filename) {
+  if (filename.empty()) {
     LOG(INFO) << "Asked about duration but provided no filename";
     return -1;
   }
-  filename = canonical_.filename();
 
   struct stat statobj;
   if (stat(filename.c_str(), &statobj) || !statobj.st_size || !S_ISREG(statobj.st_mode)) {
@@ -31,19 +31,39 @@
 class PlayableItem;
 typedef std::shared_ptr<PlayableItem> PlayableItemPtr;
 
-class PlayableItem : public automation::ThreadSafeProto<automation::PlayableItem> {
+// A case-insensitive regular expression, partially matched against the filename
+// and description of PlayableItems.  Matching is safe from several threads at once.
+class ItemMatcher {
  public:
-  bool fetch(const std::string& filename);
+  explicit ItemMatcher(const std::string& regexp);
+  ~ItemMatcher();
+
+  bool ok() const { return ok_; }
+  bool Matches(const automation::PlayableItem& item) const;
 
+ private:
 #ifdef USE_RE2
-  bool matches(const RE2& pattern);
+  RE2 re_;
 #else
-  bool matches(const regex_t& pattern);
+  regex_t re_;
 #endif
+  bool ok_;
+  DISALLOW_COPY_AND_ASSIGN(ItemMatcher);
+};
+
+class PlayableItem : public automation::ThreadSafeProto<automation::PlayableItem> {
+ public:
+  bool fetch(const std::string& filename);
+
+  bool matches(const ItemMatcher& pattern);
+  // Counts a play, in the database too if the item is stored there.
   void IncrementPlaycount();
   PlayableItem(sqlite3 *db);
+
+  // Plays filename into a null output to find its length in seconds, or
+  // returns -1 if it isn't a playable file.  Safe from several threads at once.
+  static int CalculateDuration(const std::string& filename);
  private:
-  int CalculateDuration();
   DISALLOW_COPY_AND_ASSIGN(PlayableItem);
 };
 
@@ -14,45 +14,61 @@
  *   limitations under the License.
  */
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <algorithm>
 #include <set>
 #include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+#include <boost/thread/thread.hpp>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
 #include <vector>
 
+#include "catalog.h"
 #include "playableitem.h"
 #include "playlist.h"
 #include "playlist.pb.h"
 #include "protostore.h"
+#include "trace.h"
 
 using automation::ProtoStore;
 
-automation::Playlists Playlist::FetchAllLists(sqlite3 *db) {
-  automation::ProtoStore<automation::Playlist> pstore(db, "Playlists_with_size");
+DEFINE_int32(filter_threads, 4, "Number of threads Playlist::Filter fans regular expression "
+  "matching out to.  1 matches on the calling thread only.");
+DEFINE_int32(filter_chunk_size, 1024, "Number of PlayableItemIDs each Playlist::Filter worker "
+  "claims at a time.");
 
-  std::vector<automation::Playlist> playlists;
-  pstore.LoadAll(&playlists, INT64_MAX, 0);
+namespace {
+// Playlists are compacted once holes outnumber live items, but not while
+// they're small enough that walking the holes costs nothing.
+const int kMinCompactSize = 64;
+}
 
+automation::Playlists Playlist::FetchAllLists(sqlite3 *db) {
   automation::Playlists list;
-
-  for (const auto& playlist : playlists) {
-    automation::Playlist *next = list.add_item();
-    *next = std::move(playlist);
-  }
+  FetchAllLists(db, &list);
   return list; 
 }
 
+void Playlist::FetchAllLists(sqlite3 *db, automation::Playlists *result) {
+  automation::ProtoStore<automation::Playlist> pstore(db, "Playlists_with_size");
+  pstore.LoadAll(result->mutable_item(), INT64_MAX, 0);
+}
+
 Playlist::Playlist(sqlite3 *db) :
   automation::ThreadSafeProto<automation::Playlist>(db) {
 }
 void Playlist::LockByName(sqlite3 *db, const std::string &name) {
   LOG(INFO) << "Locking playlist " << name;
   automation::ThreadSafeProto<automation::PlaylistLock> lock(db);
-  lock.mutable_data().set_name(name);
+  lock.Mutate([&name](automation::PlaylistLock* canonical) { canonical->set_name(name); });
   try {
     lock.Replace();
   } catch (std::exception& e) {
@@ -61,122 +77,394 @@ void Playlist::LockByName(sqlite3 *db, const std::string &name) {
 }
 
 void Playlist::PopWithTimelimit(int seconds, PlayableItem *result) {
+  TRACE_SCOPE("Playlist::PopWithTimelimit");
   boost::mutex::scoped_lock lock(mutex_);
-  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
+  const int choices = size_locked();
   LOG(INFO) << "In playlist " << canonical_.name() << " for " << seconds << " of time with up to "
-            << size_locked() << " choices";
+            << choices << " choices";
   // Advance through songlist, loading each into result. If it satisfies our
   // duration constraint, zero it out (so it won't be reused) and return.
-  for (int64& song : *songlist) {
-    if (song == 0) { continue; }
-    result->Fetch(song);
-    if (result->data().playableitemid() && result->data().duration() <= seconds) {
-      song = 0;
+  const RepeatedField<int64>& songlist = canonical_.playableitemid();
+  const int live = live_;
+  // Items the snapshot knows to be too long are passed over without a query.
+  std::shared_ptr<const Catalog> catalog = Catalog::Get(db_);
+  automation::PlayableItem known;
+  for (int i = cursor_; i < songlist.size(); ++i) {
+    if (songlist.Get(i) == 0) { continue; }
+    if (catalog && catalog->FindItem(songlist.Get(i), &known) && known.duration() > seconds) {
+      continue;
+    }
+    result->Fetch(songlist.Get(i));
+    std::shared_ptr<const automation::PlayableItem> candidate = result->snapshot();
+    if (candidate->missing()) {
+      // Removed from the library since the list was loaded; drop it.
+      Consume(i);
+      continue;
+    }
+    if (candidate->playableitemid() && candidate->duration() <= seconds) {
+      Consume(i);
+      Compact();
+      Publish();
       return;
     }
   }
   result->Clear();
+  if (live_ != live) {
+    Compact();
+    Publish();
+  }
   LOG(WARNING) << "No acceptable item found.";
   return;
 }
 void Playlist::PopFront(PlayableItem *result) {
   boost::mutex::scoped_lock lock(mutex_);
-  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
-  PlayableItem item(db_);
-
-  for (int64& song : *songlist) {
-    if (song == 0) { continue; }
-    result->Fetch(song);
-    song = 0;
-    return;
+  const int live = live_;
+  while (size_locked()) {
+    result->Fetch(canonical_.playableitemid(cursor_));
+    Consume(cursor_);
+    if (!result->snapshot()->missing()) {
+      Compact();
+      Publish();
+      return;
+    }
   }
   result->Clear();
+  if (live_ != live) {
+    Compact();
+    Publish();
+  }
   return;
 }
+std::vector<int64> Playlist::Peek(int count) const {
+  boost::mutex::scoped_lock lock(mutex_);
+  std::vector<int64> ids;
+  if (!size_locked()) {
+    return ids;
+  }
+  const RepeatedField<int64>& songlist = canonical_.playableitemid();
+  for (int i = cursor_; i < songlist.size() && (int)ids.size() < count; ++i) {
+    if (songlist.Get(i)) {
+      ids.push_back(songlist.Get(i));
+    }
+  }
+  return ids;
+}
+
+void Playlist::Count() const {
+  const RepeatedField<int64>& songlist = canonical_.playableitemid();
+  live_ = std::count_if(songlist.begin(), songlist.end(), [](int64 song) { return song != 0; });
+  cursor_ = 0;
+  while (cursor_ < songlist.size() && songlist.Get(cursor_) == 0) {
+    ++cursor_;
+  }
+  counted_ = true;
+}
+
+void Playlist::Consume(int index) {
+  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
+  songlist->Set(index, 0);
+  --live_;
+  while (cursor_ < songlist->size() && songlist->Get(cursor_) == 0) {
+    ++cursor_;
+  }
+}
+
+void Playlist::Compact() {
+  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
+  if (songlist->size() >= kMinCompactSize && songlist->size() - live_ > live_) {
+    songlist->erase(std::remove(songlist->begin(), songlist->end(), 0), songlist->end());
+    cursor_ = 0;
+  }
+}
 
 void Playlist::ApplyMergeRequest(const automation::PlaylistMergeRequest& request, bool replace) {
-  // This is presumably not the most elegant way of getting the protobuf code to ignore 
-  // types, but it does work.
-  automation::Playlist merger;
-  merger.ParseFromString(request.SerializeAsString()); 
+  boost::mutex::scoped_lock lock(mutex_);
+  OnChange();
   if (replace) {
     canonical_.clear_items();
     canonical_.clear_playableitemid();
   }
-  canonical_.MergeFrom(merger);
+  if (request.has_playlistid()) {
+    canonical_.set_playlistid(request.playlistid());
+  }
+  if (request.has_name()) {
+    canonical_.set_name(request.name());
+  }
+  if (request.has_weight()) {
+    canonical_.set_weight(request.weight());
+  }
+  canonical_.mutable_playableitemid()->MergeFrom(request.playableitemid());
+  Publish();
+}
+
+void Playlist::ApplyDelta(const automation::PlaylistDelta& delta) {
+  TRACE_SCOPE("Playlist::ApplyDelta");
+  boost::mutex::scoped_lock lock(mutex_);
+  // Write first, so that a refused change leaves the list as it was.
+  if (!never_save_ && canonical_.has_playlistid()) {
+    SaveDelta(delta);
+  }
+  OnChange();
+
+  // Popped items (zeroes) are dropped along with the removals.
+  std::unordered_set<int64> removed(delta.remove().begin(), delta.remove().end());
+  removed.insert(0);
+  std::vector<int64> songs;
+  std::unordered_set<int64> present;
+  songs.reserve(canonical_.playableitemid_size() + delta.add_size());
+  for (int64 song : canonical_.playableitemid()) {
+    if (!removed.count(song)) {
+      songs.push_back(song);
+      present.insert(song);
+    }
+  }
+  for (int64 song : delta.add()) {
+    if (song && present.insert(song).second) {
+      songs.push_back(song);
+    }
+  }
+  for (const automation::PlaylistDelta::Move& move : delta.move()) {
+    auto it = std::find(songs.begin(), songs.end(), move.playableitemid());
+    if (it == songs.end()) {
+      continue;
+    }
+    songs.erase(it);
+    const size_t position = std::min<size_t>(std::max(0, move.position()), songs.size());
+    songs.insert(songs.begin() + position, move.playableitemid());
+  }
+
+  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
+  songlist->Clear();
+  songlist->Reserve(songs.size());
+  for (int64 song : songs) {
+    songlist->AddAlreadyReserved(song);
+  }
+  if (!removed.empty() && canonical_.items_size()) {
+    RepeatedPtrField<automation::PlayableItem>* items = canonical_.mutable_items();
+    for (int i = items->size() - 1; i >= 0; --i) {
+      if (removed.count(items->Get(i).playableitemid())) {
+        items->DeleteSubrange(i, 1);
+      }
+    }
+  }
+  Publish();
+}
+
+void Playlist::SaveDelta(const automation::PlaylistDelta& delta) {
+  const sqlite3_int64 id = canonical_.playlistid();
+  sqlite3_stmt *remove, *add;
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "DELETE FROM Playlist_PlayableItemID WHERE PlaylistID = ? AND PlayableItemID = ?",
+      -1, &remove, NULL)) << sqlite3_errmsg(db_);
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "INSERT OR IGNORE INTO Playlist_PlayableItemID (PlaylistID, PlayableItemID) VALUES (?, ?)",
+      -1, &add, NULL)) << sqlite3_errmsg(db_);
+  CHECK(SQLITE_OK == sqlite3_exec(db_, "BEGIN TRANSACTION", NULL, NULL, NULL)) << sqlite3_errmsg(db_);
+
+  std::string error;
+  auto run = [&](sqlite3_stmt *ps, int64 song) {
+    sqlite3_bind_int64(ps, 1, id);
+    sqlite3_bind_int64(ps, 2, song);
+    if (sqlite3_step(ps) != SQLITE_DONE) {
+      error = sqlite3_errmsg(db_);
+    }
+    sqlite3_reset(ps);
+    return error.empty();
+  };
+  for (int i = 0; i < delta.remove_size() && run(remove, delta.remove(i)); ++i) {
+  }
+  for (int i = 0; error.empty() && i < delta.add_size() && run(add, delta.add(i)); ++i) {
+  }
+  sqlite3_finalize(remove);
+  sqlite3_finalize(add);
+
+  if (error.empty() && sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+    error = sqlite3_errmsg(db_);
+  }
+  if (!error.empty()) {
+    sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+    throw std::runtime_error("Unable to update playlist " + canonical_.name() + ": " + error);
+  }
+  BumpGeneration();
 }
 
 automation::Playlist Playlist::Filter(const std::string& regexp) const {
-  automation::Playlist result;
+  return Filter(regexp, FLAGS_filter_threads);
+}
 
-#ifdef USE_RE2
-  RE2 re("(?i)"+regexp);
+automation::Playlist Playlist::Filter(const std::string& regexp, int threads) const {
+  automation::Playlist result;
+  Filter(regexp, threads, &result);
+  return result;
+}
 
+void Playlist::Filter(const std::string& regexp, int threads, automation::Playlist *result) const {
+  ItemMatcher re(regexp);
   if (!re.ok()) {
-    return result;
+    return;
   }
-#else
-  regex_t re;
-  if (regcomp(&re, regexp.c_str(), REG_ICASE | REG_EXTENDED | REG_NOSUB)) {
-    return result;
+
+  // Search the current version; pops on the on-air thread publish new ones
+  // without waiting for us.
+  std::shared_ptr<const automation::Playlist> snapshot = this->snapshot();
+  const RepeatedField<int64>& songlist = snapshot->playableitemid();
+
+  // Workers claim fixed-size chunks and record their matches per chunk, so the
+  // merge below can restore the original order without sorting.  ItemMatcher is
+  // safe to share between threads.  Arenas are thread safe, so items are
+  // loaded straight onto the result's arena and matches handed over as they are.
+  google::protobuf::Arena *arena = result->GetArena();
+  const size_t chunk_size = std::max(1, FLAGS_filter_chunk_size);
+  const size_t chunk_count = (songlist.size() + chunk_size - 1) / chunk_size;
+  std::vector<std::vector<automation::PlayableItem*> > matches(chunk_count);
+  std::atomic<size_t> next_chunk(0);
+
+  // Loading the rows costs far more than matching them, and SQLite runs only
+  // one statement at a time on a connection, so the other workers each read
+  // through a connection of their own.  An in-memory database can't be opened
+  // twice; there they share db_, and only the matching runs in parallel.
+  const char *filename = sqlite3_db_filename(db_, "main");
+  const bool own_connections = filename && *filename;
+
+  auto worker = [&](bool first) {
+    sqlite3 *db = db_;
+    if (!first && own_connections) {
+      if (sqlite3_open_v2(filename, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                          NULL) == SQLITE_OK) {
+        // Wait out a writer's commit rather than miss its rows.
+        sqlite3_busy_timeout(db, 1000);
+      } else {
+        LOG(WARNING) << "Filter worker sharing the connection: " << sqlite3_errmsg(db);
+        sqlite3_close(db);
+        db = db_;
+      }
+    }
+    std::unique_ptr<sqlite3, int(*)(sqlite3*)> close(db != db_ ? db : nullptr, &sqlite3_close);
+    automation::ProtoStore<automation::PlayableItem> store(db);
+    automation::PlayableItem *item = nullptr;
+    for (size_t chunk = next_chunk++; chunk < chunk_count; chunk = next_chunk++) {
+      const size_t end = std::min<size_t>(songlist.size(), (chunk + 1) * chunk_size);
+      for (size_t i = chunk * chunk_size; i < end; ++i) {
+        // Popped items are zeroed out; there's nothing to fetch for them.
+        if (songlist.Get(i) == 0) {
+          continue;
+        }
+        if (!item) {
+          item = google::protobuf::Arena::CreateMessage<automation::PlayableItem>(arena);
+        }
+        item->Clear();
+        if (store.LoadById(item, songlist.Get(i)) && re.Matches(*item)) {
+          matches[chunk].push_back(item);
+          item = nullptr;
+        }
+      }
+    }
+    if (!arena) {
+      delete item;
+    }
+  };
+
+  const size_t thread_count = std::min<size_t>(std::max(1, threads), chunk_count);
+  boost::thread_group workers;
+  for (size_t i = 1; i < thread_count; ++i) {
+    workers.create_thread(std::bind(worker, false));
   }
-#endif
+  worker(true);
+  workers.join_all();
 
-  boost::mutex::scoped_lock lock(mutex_);
-  const RepeatedField<int64>& songlist = canonical_.playableitemid();
-  PlayableItem item(db_);
-
-  for (const int64& song : songlist) {
-    item.Fetch(song);
-    if (item.matches(re)) {
-      automation::PlayableItem *newitem = result.add_items();
-      newitem->CopyFrom(item.data());
-      result.add_playableitemid(newitem->playableitemid());
+  for (const std::vector<automation::PlayableItem*>& chunk : matches) {
+    for (automation::PlayableItem *match : chunk) {
+      result->add_playableitemid(match->playableitemid());
+      result->mutable_items()->AddAllocated(match);
     }
   }
-  return result;
 }
 
 bool Playlist::Fetch() {
-  SetTable("Playlists_random_weight");
   std::string target;
+  if (std::shared_ptr<const Catalog> catalog = Catalog::Get(db_)) {
+    return FetchShuffled(catalog->PickPlaylist());
+  }
 
+  SetTable("Playlists_random_weight");
   {
+    // Only the name is needed; nothing is published until FetchShuffled.
+    automation::Playlist choice;
     boost::mutex::scoped_lock lock(mutex_);
-
-    canonical_.Clear();
-    Load(&canonical_);
-    target = canonical_.name();
+    Load(&choice);
+    target = choice.name();
   }
 
   return FetchShuffled(target);
 }
 
-bool Playlist::Fetch(const std::string& playlistname) {
+bool Playlist::FetchLocked(const std::string& playlistname) {
+  OnChange();
+  canonical_.Clear();
+  if (std::shared_ptr<const Catalog> catalog = Catalog::Get(db_)) {
+    const bool result = catalog->FindPlaylist(playlistname, &canonical_);
+    canonical_.set_name(playlistname);
+    return result;
+  }
   SetTable("Playlists_with_children");
+  canonical_.set_name(playlistname);
+  bool result = Load(&canonical_);
+  SetTable("Playlists");
+  return result;
+}
+bool Playlist::Fetch(const std::string& playlistname) {
+  boost::mutex::scoped_lock lock(mutex_);
+  bool result = FetchLocked(playlistname);
+  Publish();
+  return result;
+}
+bool Playlist::FetchUnordered(const std::string& playlistname) {
+  CHECK(sqlite3_exec(db_, "CREATE TEMPORARY VIEW IF NOT EXISTS Playlists_with_members AS "
+" SELECT Playlist.*, group_concat(PlayableItemID) AS PlayableItemID "
+"   FROM Playlist JOIN Playlist_PlayableItemID USING(PlaylistID) GROUP BY PlaylistID;",
+      NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
 
   boost::mutex::scoped_lock lock(mutex_);
+  SetTable("Playlists_with_members");
+  OnChange();
   canonical_.Clear();
   canonical_.set_name(playlistname);
   bool result = Load(&canonical_);
   SetTable("Playlists");
+  Publish();
   return result;
 }
 bool Playlist::FetchShuffled(const std::string& playlistname) {
-  bool result = Fetch(playlistname);
+  boost::mutex::scoped_lock lock(mutex_);
+  bool result = FetchLocked(playlistname);
   std::random_shuffle(canonical_.mutable_playableitemid()->begin(),
                       canonical_.mutable_playableitemid()->end());
-
+  Publish();
   return result;
 }
 
 bool Playlist::FetchSuperlist(long long limit, long long offset) {
+  if (std::shared_ptr<const Catalog> catalog = Catalog::Get(db_)) {
+    boost::mutex::scoped_lock lock(mutex_);
+    OnChange();
+    canonical_.Clear();
+    catalog->AllItems(limit, offset, canonical_.mutable_playableitemid());
+    const bool result = canonical_.playableitemid_size();
+    if (result) {
+      canonical_.set_playlistid(0);
+      canonical_.set_name("ALL TRACKS");
+      canonical_.set_weight(0);
+    }
+    Publish();
+    return result;
+  }
   char buf[1024];
 
   snprintf(buf, sizeof buf, "CREATE TEMPORARY VIEW Playlists_with_everything AS "
 " SELECT 0 AS PlaylistID, 'ALL TRACKS' AS name, 0 as weight, "
 "        group_concat(PlayableItemID) AS PlayableItemID "
-"        FROM (SELECT PlayableItemID FROM PlayableItem ORDER BY duration DESC LIMIT %lld OFFSET %lld) group by 1;", limit, offset);
+"        FROM (SELECT PlayableItemID FROM PlayableItem WHERE NOT missing "
+"              ORDER BY duration DESC LIMIT %lld OFFSET %lld) group by 1;", limit, offset);
 
   
   CHECK(sqlite3_exec(db_, buf, NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
@@ -184,39 +472,41 @@ bool Playlist::FetchSuperlist(long long limit, long long offset) {
   SetTable("Playlists_with_everything");
 
   boost::mutex::scoped_lock lock(mutex_);
+  OnChange();
   canonical_.Clear();
   bool result = LoadById(&canonical_, 0);
   CHECK(sqlite3_exec(db_, "DROP VIEW Playlists_with_everything", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
 
   SetTable("Playlists");
+  Publish();
   return result;
 }
 
 bool Playlist::Fetch(int playlistID) {
   boost::mutex::scoped_lock lock(mutex_);
+  OnChange();
   canonical_.Clear();
   SetTable("Playlists_with_children");
 
   bool result = LoadById(&canonical_, playlistID);
   SetTable("Playlists");
+  Publish();
   return result;
 }
 
 int Playlist::Size() const {
-  boost::mutex::scoped_lock lock(mutex_);
-  return size_locked();
+  return published_size_;
 }
 std::string Playlist::Name() const {
-  boost::mutex::scoped_lock lock(mutex_);
-  return canonical_.name();
+  return snapshot()->name();
+}
+void Playlist::OnPublish() {
+  published_size_ = size_locked();
 }
 int Playlist::size_locked() const {
-  int size = 0;
-  for (const int64& song : canonical_.playableitemid()) {
-    if (song) {
-      size++;
-    } 
-  } 
-  return size;
+  if (!counted_) {
+    Count();
+  }
+  return live_;
 }
 
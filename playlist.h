@@ -16,7 +16,9 @@
 #ifndef PLAYLIST_H
 #define PLAYLIST_H
 
+#include <atomic>
 #include <string>
+#include <vector>
 #include "sqlite3.h"
 #include "base.h"
 #include "playableitem.h"
@@ -32,28 +34,66 @@ class Playlist : public automation::ThreadSafeProto<automation::Playlist> {
  public:
   static void LockByName(sqlite3 *db, const std::string &target);
   static automation::Playlists FetchAllLists(sqlite3 *db);
+  static void FetchAllLists(sqlite3 *db, automation::Playlists *result);
   void PopWithTimelimit(int seconds, PlayableItem *target); 
   void PopFront(PlayableItem *target);
+  // The IDs of up to count items at the front of the list, without popping them.
+  std::vector<int64> Peek(int count) const;
 
   int Size() const;
   std::string Name() const;
   void ApplyMergeRequest(const automation::PlaylistMergeRequest& request, bool replace);
+  // Applies delta to the list and, unless it is never saved, to its stored
+  // membership, in one transaction.  Throws std::runtime_error if the
+  // database refuses the change, in which case nothing is changed.
+  void ApplyDelta(const automation::PlaylistDelta& delta);
 
   int get_weight() const;
 
+  // Returns the items of this playlist whose filename or description match
+  // pattern, in playlist order.  Matching is spread over FLAGS_filter_threads
+  // threads unless a thread count is given.
   automation::Playlist Filter(const std::string& pattern) const;
+  automation::Playlist Filter(const std::string& pattern, int threads) const;
+  // As above, but appends the matches to result, allocating them on its arena.
+  void Filter(const std::string& pattern, int threads, automation::Playlist *result) const;
   bool Fetch();
   bool FetchShuffled(const std::string& playlistname);
   bool Fetch(const std::string& playlistname);
+  // Fetch(playlistname), but with the items in no particular order, which
+  // spares sorting the whole library; for when only membership matters.
+  bool FetchUnordered(const std::string& playlistname);
   bool FetchSuperlist(long long limit, long long offset);
   bool Fetch(int playlistID);
 
   Playlist(sqlite3 *db);
+ protected:
+  void OnChange() override { counted_ = false; }
+  void OnPublish() override;
  private:
+  // Fetch(playlistname) without taking the lock or publishing.
+  bool FetchLocked(const std::string& playlistname);
+  // Writes the membership changes in delta.  Needs mutex_.
+  void SaveDelta(const automation::PlaylistDelta& delta);
   bool CompareDurations(sqlite3_int64 item1, sqlite3_int64 item2, PlayableItem* fetcher);
   typedef google::protobuf::RepeatedField< ::google::protobuf::int64> list_type;
   int size_locked() const;
 
+  // Popped items are zeroed in place.  live_ counts the IDs that are left and
+  // cursor_ is the index of the first of them, so sizing is O(1) and pops
+  // don't walk the consumed prefix.  Both are recounted lazily after anything
+  // else changes the list.  Guarded by mutex_.
+  void Count() const;
+  // Zeroes the ID at index, after it has been handed out.  Indexes stay
+  // valid until Compact, which drops the zeroes once they outnumber the rest.
+  void Consume(int index);
+  void Compact();
+  mutable bool counted_ = false;
+  mutable int live_ = 0;
+  mutable int cursor_ = 0;
+  // live_ as of the last version published, for readers.
+  std::atomic<int> published_size_{0};
+
   DISALLOW_COPY_AND_ASSIGN(Playlist);
 };
 
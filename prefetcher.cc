@@ -0,0 +1,254 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "prefetcher.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <functional>
+#include <set>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "trace.h"
+
+DEFINE_int32(prefetch_items, 3, "Number of upcoming mainshow items to prepare ahead of time, "
+  "besides requirements and the next bumper.  0 disables prefetching.");
+DEFINE_string(prefetch_cache_dir, "", "If set, upcoming files are copied to this (local) "
+  "directory and played from there.  Otherwise they are only read into the page cache.");
+DEFINE_int64(prefetch_cache_bytes, 2LL << 30, "Most bytes of copies kept in --prefetch_cache_dir.");
+
+namespace {
+// Copies in the cache directory are named this, so leftovers from a previous
+// run can be told from anything else there.
+const char kCopyPrefix[] = "prefetch-";
+}
+
+Prefetcher* Prefetcher::Get() {
+  static Prefetcher* prefetcher = new Prefetcher();
+  return prefetcher;
+}
+
+Prefetcher::Prefetcher() :
+  local_bytes_(0),
+  hits_(metrics::GetCounter("prefetch_hits_total",
+      "Files played that had been prepared ahead of time.", "")),
+  misses_(metrics::GetCounter("prefetch_misses_total",
+      "Files played that had not been prepared ahead of time.", "")),
+  missing_(metrics::GetCounter("prefetch_missing_files_total",
+      "Upcoming or requested files that were missing or unreadable.", "")),
+  prepared_bytes_(metrics::GetCounter("prefetch_bytes_total",
+      "Bytes read ahead or copied locally.", "")),
+  lead_time_(metrics::GetHistogram("prefetch_lead_seconds",
+      "How long before being played files were ready.", "", 1e-6)) {
+  if (!FLAGS_prefetch_cache_dir.empty()) {
+    // We don't know what the copies of a previous run were of.
+    DIR *dir = opendir(FLAGS_prefetch_cache_dir.c_str());
+    CHECK(dir) << "Unable to open " << FLAGS_prefetch_cache_dir << ": " << strerror(errno);
+    while (struct dirent *file = readdir(dir)) {
+      if (!strncmp(file->d_name, kCopyPrefix, strlen(kCopyPrefix))) {
+        unlink((FLAGS_prefetch_cache_dir + "/" + file->d_name).c_str());
+      }
+    }
+    closedir(dir);
+  }
+  thread_ = boost::thread([this]() { Worker(); });
+}
+
+void Prefetcher::SetUpcoming(const std::string& channel, const std::vector<std::string>& filenames) {
+  boost::mutex::scoped_lock lock(mutex_);
+  upcoming_[channel] = filenames;
+
+  std::set<std::string> wanted;
+  pending_.clear();
+  for (const auto& upcoming : upcoming_) {
+    for (const std::string& filename : upcoming.second) {
+      // Webstreams have nothing to prepare.
+      if (filename.find("://") != std::string::npos || !wanted.insert(filename).second) {
+        continue;
+      }
+      if (!entries_.count(filename) && filename != preparing_) {
+        pending_.push_back(filename);
+      }
+    }
+  }
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->second.local.empty() && !wanted.count(it->first)) {
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (!pending_.empty()) {
+    work_available_.notify_one();
+  }
+}
+
+std::string Prefetcher::Resolve(const std::string& filename) {
+  if (filename.find("://") != std::string::npos) {
+    return filename;
+  }
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    auto it = entries_.find(filename);
+    if (it != entries_.end() && !it->second.missing) {
+      Entry& entry = it->second;
+      if (!entry.local.empty()) {
+        lru_.splice(lru_.begin(), lru_, entry.lru);
+        return entry.local;
+      }
+      return filename;
+    }
+    if (it != entries_.end()) {
+      // It was missing when we looked; it may have been put back since.
+      entries_.erase(it);
+    }
+  }
+  struct stat info;
+  if (stat(filename.c_str(), &info) || !S_ISREG(info.st_mode)) {
+    missing_->Increment();
+    LOG(ERROR) << "File " << filename << " is missing.";
+    return "";
+  }
+  return filename;
+}
+
+void Prefetcher::RecordPlay(const std::string& filename) {
+  if (filename.find("://") != std::string::npos) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  auto it = entries_.find(filename);
+  if (it == entries_.end() || it->second.missing) {
+    misses_->Increment();
+    return;
+  }
+  hits_->Increment();
+  lead_time_->Record(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - it->second.ready).count());
+}
+
+void Prefetcher::Worker() {
+  while (true) {
+    std::string filename;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (pending_.empty()) {
+        work_available_.wait(lock);
+      }
+      filename = pending_.front();
+      pending_.pop_front();
+      preparing_ = filename;
+    }
+
+    Entry entry;
+    Prepare(filename, &entry);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    preparing_.clear();
+    Entry& slot = entries_[filename];
+    slot = entry;
+    if (!slot.local.empty()) {
+      lru_.push_front(filename);
+      slot.lru = lru_.begin();
+      local_bytes_ += slot.bytes;
+      Evict();
+    }
+  }
+}
+
+void Prefetcher::Prepare(const std::string& filename, Entry* entry) {
+  TRACE_SCOPE("Prefetcher::Prepare");
+  const int fd = open(filename.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) || !S_ISREG(info.st_mode)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    entry->missing = true;
+    missing_->Increment();
+    LOG(WARNING) << "Upcoming file " << filename << " is missing or unreadable.";
+    return;
+  }
+  entry->bytes = info.st_size;
+  if (!FLAGS_prefetch_cache_dir.empty() && info.st_size <= FLAGS_prefetch_cache_bytes) {
+    entry->local = CopyLocally(fd, filename);
+  }
+  if (entry->local.empty()) {
+    // Read it through rather than only advising the kernel, which may not
+    // read ahead much on a network filesystem, so it is all cached when
+    // we're done.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char buf[1 << 16];
+    while (read(fd, buf, sizeof buf) > 0) {
+    }
+  }
+  close(fd);
+  prepared_bytes_->Increment(entry->bytes);
+  entry->ready = std::chrono::steady_clock::now();
+  VLOG(5) << "Prepared " << filename << (entry->local.empty() ? "" : " as " + entry->local);
+}
+
+std::string Prefetcher::CopyLocally(int fd, const std::string& filename) {
+  char name[32];
+  snprintf(name, sizeof name, "%016zx", std::hash<std::string>()(filename));
+  const std::string::size_type slash = filename.rfind('/');
+  // Keep the basename, so mpv can still guess the format from the extension.
+  const std::string local = FLAGS_prefetch_cache_dir + "/" + kCopyPrefix + name + "-" +
+      filename.substr(slash == std::string::npos ? 0 : slash + 1);
+  const std::string temporary = local + ".tmp";
+
+  const int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    LOG(WARNING) << "Unable to create " << temporary << ": " << strerror(errno);
+    return "";
+  }
+  bool ok = true;
+  char buf[1 << 16];
+  ssize_t bytes;
+  while (ok && (bytes = read(fd, buf, sizeof buf)) > 0) {
+    for (ssize_t written = 0; ok && written < bytes;) {
+      const ssize_t result = write(out, buf + written, bytes - written);
+      ok = result > 0;
+      written += result;
+    }
+  }
+  ok = ok && bytes == 0;
+  ok = !close(out) && ok;
+  if (!ok || rename(temporary.c_str(), local.c_str())) {
+    LOG(WARNING) << "Unable to copy " << filename << " to " << local << ": " << strerror(errno);
+    unlink(temporary.c_str());
+    return "";
+  }
+  return local;
+}
+
+void Prefetcher::Evict() {
+  // The newest copy is never evicted, even if it alone is over budget; it is
+  // about to be played.
+  while (local_bytes_ > FLAGS_prefetch_cache_bytes && lru_.size() > 1) {
+    auto it = entries_.find(lru_.back());
+    VLOG(5) << "Evicting " << it->second.local;
+    unlink(it->second.local.c_str());
+    local_bytes_ -= it->second.bytes;
+    lru_.pop_back();
+    entries_.erase(it);
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <stdint.h>
+#include <chrono>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "base.h"
+#include "metrics.h"
+
+// Prefetcher gets the files automation is about to play ready ahead of time,
+// so that a cold or slow network share doesn't cost dead air at the track
+// boundary.  Each channel's RunOnce tells it what is coming up; its thread
+// checks that each file is there and reads it into the page cache, or with
+// --prefetch_cache_dir copies it to local storage, keeping at most
+// --prefetch_cache_bytes of copies there (least recently played first out).
+class Prefetcher {
+ public:
+  // The process-wide prefetcher.  Its thread is started on first use.
+  static Prefetcher* Get();
+
+  // Replaces the files coming up on the given channel, soonest first.  Files
+  // no channel has coming up any more are forgotten, unless copied locally.
+  void SetUpcoming(const std::string& channel, const std::vector<std::string>& filenames);
+
+  // Returns the path to play (or preload) filename from: the local copy if
+  // there is one, otherwise filename itself, or the empty string if the file
+  // is missing.  Files that weren't prepared are checked now.  What was
+  // prepared is kept until the file is no longer coming up.
+  std::string Resolve(const std::string& filename);
+  // Records whether filename, now starting to play, had been prepared.
+  void RecordPlay(const std::string& filename);
+
+ private:
+  // Files are only entered once they have been prepared.
+  struct Entry {
+    bool missing = false;
+    std::chrono::steady_clock::time_point ready;
+    // The local copy, if any, and its place in lru_.
+    std::string local;
+    int64_t bytes = 0;
+    std::list<std::string>::iterator lru;
+  };
+
+  Prefetcher();
+  void Worker();
+  // Checks filename and reads it ahead or copies it.  Called without mutex_.
+  void Prepare(const std::string& filename, Entry* entry);
+  // Copies the open file into the cache directory, returning the copy's path,
+  // or the empty string if that failed.
+  std::string CopyLocally(int fd, const std::string& filename);
+  // Deletes local copies until they fit in the budget.  Needs mutex_.
+  void Evict();
+
+  boost::mutex mutex_;  // Guards everything below.
+  boost::condition_variable work_available_;
+  std::map<std::string, std::vector<std::string> > upcoming_;
+  std::list<std::string> pending_;
+  std::string preparing_;
+  std::unordered_map<std::string, Entry> entries_;
+  // Files with local copies, most recently used first.
+  std::list<std::string> lru_;
+  int64_t local_bytes_;
+
+  metrics::Counter* hits_;
+  metrics::Counter* misses_;
+  metrics::Counter* missing_;
+  metrics::Counter* prepared_bytes_;
+  metrics::Histogram* lead_time_;
+
+  boost::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(Prefetcher);
+};
+
+#endif
@@ -18,6 +18,9 @@
 #define _PROTOSTORE_H
 
 #include <stdio.h>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <glog/logging.h>
 #include "sqlite3.h"
 #include <boost/thread/mutex.hpp>
@@ -45,7 +48,9 @@ template<class TypeName> class ProtoStore : public automation::MessageStore {
     MessageStore(db, TypeName().GetDescriptor(), tablename) {
   }
 
-  bool LoadAll(std::vector<TypeName> *result, int64_t limit, int64_t offset) {
+  // Appends up to limit rows to result.  Each row is parsed in place into an
+  // element allocated on result's arena (if any), so nothing is copied.
+  int LoadAll(RepeatedPtrField<TypeName> *result, int64_t limit, int64_t offset) {
     std::string query = "SELECT * from " + table_ + " LIMIT ? OFFSET ?";
 
     sqlite3_stmt *ps;
@@ -53,65 +58,134 @@ template<class TypeName> class ProtoStore : public automation::MessageStore {
     sqlite3_bind_int64(ps, 1, limit);
     sqlite3_bind_int64(ps, 2, offset);
 
+    while (ProtoFromRows(ps, result->Add())) {
+      VLOG(90) << "Adding " << result->rbegin()->DebugString();
+    }
+    // The last element was added for a row that didn't exist.
+    result->RemoveLast();
+    CHECK(SQLITE_OK == sqlite3_finalize(ps));
+    return result->size();
+  }
+
+  // Keyset pagination: hands each row whose ID (the first field) is greater than
+  // cursor to callback in ID order, as it is stepped out of SQLite, stopping
+  // after limit rows or as soon as callback returns false.  Nothing is retained
+  // between rows, so this is safe to use on tables of any size.  Returns the ID
+  // of the last row visited, or cursor if there were none.
+  int64_t LoadAfter(int64_t cursor, int64_t limit, const std::function<bool(const TypeName&)>& callback) {
+    const std::string& id = TypeName::descriptor()->field(0)->name();
+    std::string query = "SELECT * from " + table_ + " WHERE " + id + " > ? ORDER BY " + id + " LIMIT ?";
+
+    sqlite3_stmt *ps;
+    CHECK(SQLITE_OK == sqlite3_prepare_v2(db_, query.c_str(), -1, &ps, NULL)) << sqlite3_errmsg(db_);
+    sqlite3_bind_int64(ps, 1, cursor);
+    sqlite3_bind_int64(ps, 2, limit);
+
     TypeName temp;
     while (ProtoFromRows(ps, &temp)) {
-      result->push_back(temp);
-      VLOG(90) << "Adding " << temp.DebugString();
+      cursor = temp.GetReflection()->GetInt64(temp, TypeName::descriptor()->field(0));
+      if (!callback(temp)) {
+        break;
+      }
       temp.Clear();
     }
-    CHECK(SQLITE_OK == sqlite3_reset(ps));
-    return result->size();
+    CHECK(SQLITE_OK == sqlite3_finalize(ps));
+    return cursor;
   }
 };
 
+// A proto shared between threads.  Writers serialize on mutex_ and work on
+// canonical_, publishing each change once it is complete; readers only ever see
+// published versions, and a snapshot stays valid and unchanged for as long as
+// it is held.  The immutable copy a reader gets is only made when a reader
+// asks after a change, so a writer making many small changes (popping through
+// a long list, say) doesn't copy the whole proto for each one.  Reads since
+// the last change are an atomic load of a shared_ptr and never wait.
 template<class TypeName> class ThreadSafeProto : public ProtoStore<TypeName> {
  public:
   ThreadSafeProto(sqlite3 *db) :
-    ProtoStore<TypeName>(db) {
+    ProtoStore<TypeName>(db),
+    snapshot_(std::make_shared<const TypeName>()) {
+  }
+
+  // The latest published version.  Must not be called with mutex_ held.
+  std::shared_ptr<const TypeName> snapshot() const {
+    if (stale_.load(std::memory_order_acquire)) {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (stale_.load(std::memory_order_relaxed)) {
+        std::atomic_store(&snapshot_, std::shared_ptr<const TypeName>(new TypeName(canonical_)));
+        stale_.store(false, std::memory_order_release);
+      }
+    }
+    return std::atomic_load(&snapshot_);
   }
 
   bool Fetch(sqlite3_int64 id) {
     boost::mutex::scoped_lock lock(mutex_);
-    return ProtoStore<TypeName>::LoadById(&canonical_, id);
+    OnChange();
+    bool result = ProtoStore<TypeName>::LoadById(&canonical_, id);
+    Publish();
+    return result;
   }
 
-  void CopyTo(TypeName *result) {
-    boost::mutex::scoped_lock lock(mutex_);
-    result->CopyFrom(canonical_);
+  void CopyTo(TypeName *result) const {
+    result->CopyFrom(*snapshot());
   }
   void CopyFrom(const TypeName& candidate) {
-    boost::mutex::scoped_lock lock(mutex_);
-    canonical_.CopyFrom(candidate);
+    Mutate([&candidate](TypeName* canonical) { canonical->CopyFrom(candidate); });
   }
   void MergeFrom(const TypeName& candidate) {
+    Mutate([&candidate](TypeName* canonical) { canonical->MergeFrom(candidate); });
+  }
+  void Clear() {
+    Mutate([](TypeName* canonical) { canonical->Clear(); });
+  }
+  // Applies any number of changes and publishes them as one new version.
+  void Mutate(const std::function<void(TypeName*)>& mutation) {
     boost::mutex::scoped_lock lock(mutex_);
-    canonical_.MergeFrom(candidate);
+    OnChange();
+    mutation(&canonical_);
+    Publish();
   }
+
+  // Replace and Insert may assign an ID, which is published with the rest.
   int Replace() {
     boost::mutex::scoped_lock lock(mutex_);
-    return ProtoStore<TypeName>::Replace(&canonical_);
+    int result = ProtoStore<TypeName>::Replace(&canonical_);
+    Publish();
+    return result;
   }
   int Update() {
     boost::mutex::scoped_lock lock(mutex_);
     return ProtoStore<TypeName>::Update(&canonical_);
   }
-  void Clear() {
-    boost::mutex::scoped_lock lock(mutex_);
-    return canonical_.Clear();
-  }
   int Insert() {
     boost::mutex::scoped_lock lock(mutex_);
-    return ProtoStore<TypeName>::Insert(&canonical_);
-  }
-  const TypeName& data() {
-    return canonical_;
-  }
-  TypeName& mutable_data() {
-    return canonical_;
+    int result = ProtoStore<TypeName>::Insert(&canonical_);
+    Publish();
+    return result;
   }
  protected:
-  mutable boost::mutex mutex_; // Guards canonical_
+  // Called with mutex_ held whenever canonical_ may be about to change, for
+  // subclasses that keep state derived from it.
+  virtual void OnChange() {}
+  // Called with mutex_ held once a new version has been published.
+  virtual void OnPublish() {}
+
+  // Makes canonical_ the version readers see, copied for them the next time
+  // one asks.  Call with mutex_ held after changing canonical_.
+  void Publish() {
+    stale_.store(true, std::memory_order_release);
+    OnPublish();
+  }
+
+  mutable boost::mutex mutex_; // Guards canonical_ and serializes writers.
   TypeName canonical_;
+
+ private:
+  // Copied from canonical_ by snapshot() while stale_ is set.
+  mutable std::shared_ptr<const TypeName> snapshot_;
+  mutable std::atomic<bool> stale_{false};
 };
 
 class BasicProtoStore  {
@@ -125,22 +199,28 @@ class BasicProtoStore  {
     pstore_(db) {
 
   }
-  template<class TypeName> bool Load(TypeName* lookup) {
+  // Each type is stored once per key; the empty key is the type's own label.
+  template<class TypeName> bool Load(TypeName* lookup, const std::string& key = "") {
     automation::ProtoTable request;
-    request.set_label(lookup->GetTypeName()); 
+    request.set_label(Label(*lookup, key));
     pstore_.Load(&request);
     if (request.has_data()) {
       lookup->ParseFromString(request.data());
     }
     return true;
   }
-  template<class TypeName> bool Save(TypeName* save) {
+  template<class TypeName> bool Save(TypeName* save, const std::string& key = "") {
     automation::ProtoTable request;
-    request.set_label(save->GetTypeName());
+    request.set_label(Label(*save, key));
     request.set_data(save->SerializeAsString());
     pstore_.Replace(&request);
     return true;
   }
+
+ private:
+  static std::string Label(const google::protobuf::Message& message, const std::string& key) {
+    return key.empty() ? message.GetTypeName() : message.GetTypeName() + ":" + key;
+  }
 };
 
 }
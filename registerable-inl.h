@@ -41,8 +41,9 @@ class Registrar { \
     add_callback(get_command(),get_callback()); \
     return true; \
   } \
- private: \
+ protected: \
   virtual const std::string get_command() = 0; \
+ private: \
   virtual callbacktype get_callback() = 0; \
 }
 
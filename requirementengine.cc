@@ -15,23 +15,196 @@
  */
 
 #include "requirementengine.h"
+#include <ctype.h>
+#include <time.h>
 #include <algorithm>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <boost/tokenizer.hpp>
 #include <glog/logging.h>
 #include <gflags/gflags.h>
 
 #include "requirement.pb.h"
+#include "clock.h"
+#include "metrics.h"
 #include "protostore.h"
+#include "trace.h"
 
 DEFINE_bool(implicit_legalid, false, "If true, implicitly run a legal ID at the top of the hour.");
 DEFINE_int32(implicit_legalid_gap, 180, "Gap for implicit legal ID requirement.");
 
-RequirementEngine::RequirementEngine(sqlite3 *db) :
+namespace {
+// Databases made before requirements were stored one per row lack these.
+void Exec(sqlite3 *db, const char *sql) {
+  if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    throw std::runtime_error(std::string(sql) + ": " + sqlite3_errmsg(db));
+  }
+}
+
+// Rolls back unless committed.
+class Transaction {
+ public:
+  explicit Transaction(sqlite3 *db) : db_(db) { Exec(db_, "BEGIN IMMEDIATE"); }
+  ~Transaction() {
+    if (!committed_) {
+      sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+    }
+  }
+  void Commit() {
+    Exec(db_, "COMMIT");
+    committed_ = true;
+    automation::MessageStore::BumpGeneration();
+  }
+
+ private:
+  sqlite3 *db_;
+  bool committed_ = false;
+};
+
+// Writes one channel's rows of ScheduledRequirement.  The ID and version are
+// kept in columns of their own rather than in data.
+class RowWriter {
+ public:
+  RowWriter(sqlite3 *db, const std::string& channel) : db_(db), channel_(channel) {
+    Prepare("INSERT INTO ScheduledRequirement (RequirementID, channel, version, data) "
+            "VALUES (?, ?, ?, ?)", &insert_);
+    Prepare("UPDATE ScheduledRequirement SET version = ?, data = ? "
+            "WHERE RequirementID = ? AND channel = ? AND version = ?", &update_);
+    Prepare("DELETE FROM ScheduledRequirement WHERE RequirementID = ? AND channel = ?", &delete_);
+  }
+  ~RowWriter() {
+    sqlite3_finalize(insert_);
+    sqlite3_finalize(update_);
+    sqlite3_finalize(delete_);
+  }
+
+  void DeleteAll() {
+    sqlite3_stmt *ps;
+    Prepare("DELETE FROM ScheduledRequirement WHERE channel = ?", &ps);
+    sqlite3_bind_text(ps, 1, channel_.data(), channel_.size(), SQLITE_TRANSIENT);
+    const int result = sqlite3_step(ps);
+    sqlite3_finalize(ps);
+    Check(result);
+  }
+  // Keeps req's RequirementID if it has one; sets it otherwise, and the version.
+  void Insert(automation::Requirement* req) {
+    if (req->has_requirementid()) {
+      sqlite3_bind_int64(insert_, 1, req->requirementid());
+    } else {
+      sqlite3_bind_null(insert_, 1);
+    }
+    sqlite3_bind_text(insert_, 2, channel_.data(), channel_.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(insert_, 3, req->version() + 1);
+    const std::string data = Data(*req);
+    sqlite3_bind_blob(insert_, 4, data.data(), data.size(), SQLITE_TRANSIENT);
+    Check(Step(insert_));
+    req->set_requirementid(sqlite3_last_insert_rowid(db_));
+    req->set_version(req->version() + 1);
+  }
+  // False if the row isn't at req's version any more.
+  bool Update(automation::Requirement* req) {
+    const std::string data = Data(*req);
+    sqlite3_bind_int64(update_, 1, req->version() + 1);
+    sqlite3_bind_blob(update_, 2, data.data(), data.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(update_, 3, req->requirementid());
+    sqlite3_bind_text(update_, 4, channel_.data(), channel_.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(update_, 5, req->version());
+    Check(Step(update_));
+    if (!sqlite3_changes(db_)) {
+      return false;
+    }
+    req->set_version(req->version() + 1);
+    return true;
+  }
+  bool Delete(int64_t id) {
+    sqlite3_bind_int64(delete_, 1, id);
+    sqlite3_bind_text(delete_, 2, channel_.data(), channel_.size(), SQLITE_TRANSIENT);
+    Check(Step(delete_));
+    return sqlite3_changes(db_) > 0;
+  }
+
+ private:
+  static std::string Data(const automation::Requirement& req) {
+    automation::Requirement stored(req);
+    stored.clear_requirementid();
+    stored.clear_version();
+    return stored.SerializeAsString();
+  }
+  void Prepare(const char *sql, sqlite3_stmt **ps) {
+    CHECK(sqlite3_prepare_v2(db_, sql, -1, ps, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
+  }
+  static int Step(sqlite3_stmt *ps) {
+    const int result = sqlite3_step(ps);
+    sqlite3_reset(ps);
+    return result;
+  }
+  void Check(int result) {
+    if (result != SQLITE_DONE) {
+      throw std::runtime_error(std::string("Unable to store requirement: ") + sqlite3_errmsg(db_));
+    }
+  }
+
+  sqlite3 *db_;
+  const std::string channel_;
+  sqlite3_stmt *insert_, *update_, *delete_;
+};
+}  // namespace
+
+RequirementEngine::RequirementEngine(sqlite3 *db, const std::string& channel) :
   db_(db), 
-  internal_time_(time(NULL)) {
+  channel_(channel),
+  internal_time_(Clock::Get()->Now()) {
+  Load();
+}
+void RequirementEngine::Load() {
+  sqlite3_stmt *ps;
+  CHECK(sqlite3_prepare_v2(db_, "SELECT RequirementID, version, data FROM ScheduledRequirement "
+                           "WHERE channel = ? ORDER BY RequirementID", -1, &ps, NULL) == SQLITE_OK)
+      << sqlite3_errmsg(db_);
+  sqlite3_bind_text(ps, 1, channel_.data(), channel_.size(), SQLITE_TRANSIENT);
+  while (sqlite3_step(ps) == SQLITE_ROW) {
+    automation::Requirement *req = schedule_.add_schedule();
+    CHECK(req->ParseFromArray(sqlite3_column_blob(ps, 2), sqlite3_column_bytes(ps, 2)))
+        << "Corrupt requirement " << sqlite3_column_int64(ps, 0);
+    req->set_requirementid(sqlite3_column_int64(ps, 0));
+    req->set_version(sqlite3_column_int64(ps, 1));
+  }
+  sqlite3_finalize(ps);
+}
+void RequirementEngine::MoveLegacySchedules(sqlite3 *db) {
+  // Each channel's was saved in ProtoTable, the default channel's under the
+  // type's own label.  Moved ones are left empty.
+  sqlite3_stmt *ps;
+  CHECK(sqlite3_prepare_v2(db, "SELECT label, data FROM ProtoTable WHERE length(data) > 0 AND "
+                           "(label = 'automation.Schedule' OR label LIKE 'automation.Schedule:%')",
+                           -1, &ps, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+  std::map<std::string, automation::Schedule> legacy;
+  while (sqlite3_step(ps) == SQLITE_ROW) {
+    const std::string label = reinterpret_cast<const char*>(sqlite3_column_text(ps, 0));
+    CHECK(legacy[label].ParseFromArray(sqlite3_column_blob(ps, 1), sqlite3_column_bytes(ps, 1)))
+        << "Corrupt schedule " << label;
+  }
+  sqlite3_finalize(ps);
 
-  automation::BasicProtoStore pstore(db);
-  pstore.Load<automation::Schedule>(&schedule_);
+  for (auto& saved : legacy) {
+    const std::string::size_type colon = saved.first.find(':');
+    const std::string channel = colon == std::string::npos ? "" : saved.first.substr(colon + 1);
+    LOG(INFO) << "Moving " << saved.second.schedule_size() << " requirements of channel \""
+              << channel << "\" to rows of their own.";
+    Transaction transaction(db);
+    RowWriter writer(db, channel);
+    writer.DeleteAll();
+    for (automation::Requirement& req : *saved.second.mutable_schedule()) {
+      writer.Insert(&req);
+    }
+    CHECK(sqlite3_prepare_v2(db, "UPDATE ProtoTable SET data = '' WHERE label = ?",
+                             -1, &ps, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+    sqlite3_bind_text(ps, 1, saved.first.c_str(), -1, SQLITE_TRANSIENT);
+    CHECK(sqlite3_step(ps) == SQLITE_DONE) << sqlite3_errmsg(db);
+    sqlite3_finalize(ps);
+    transaction.Commit();
+  }
 }
 automation::Schedule RequirementEngine::EffectiveSchedule() {
   if (FLAGS_implicit_legalid) {
@@ -49,12 +222,171 @@ automation::Schedule RequirementEngine::EffectiveSchedule() {
     return schedule_;
   }
 }
+void RequirementEngine::Replace(sqlite3 *db, const automation::Schedule& schedule) {
+  TRACE_SCOPE("RequirementEngine::Replace");
+  boost::mutex::scoped_lock write_lock(write_mutex_);
+  automation::Schedule stored(schedule);
+  {
+    Transaction transaction(db);
+    RowWriter writer(db, channel_);
+    writer.DeleteAll();
+    for (automation::Requirement& req : *stored.mutable_schedule()) {
+      writer.Insert(&req);
+    }
+    transaction.Commit();
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  schedule_.Swap(&stored);
+}
+void RequirementEngine::Import(sqlite3 *db, automation::Schedule* schedule) {
+  TRACE_SCOPE("RequirementEngine::Import");
+  boost::mutex::scoped_lock write_lock(write_mutex_);
+  {
+    Transaction transaction(db);
+    RowWriter writer(db, channel_);
+    for (automation::Requirement& req : *schedule->mutable_schedule()) {
+      req.clear_requirementid();
+      req.clear_version();
+      writer.Insert(&req);
+    }
+    transaction.Commit();
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  schedule_.MergeFrom(*schedule);
+}
+bool RequirementEngine::Remove(sqlite3 *db, int64_t id) {
+  boost::mutex::scoped_lock write_lock(write_mutex_);
+  if (!RowWriter(db, channel_).Delete(id)) {
+    return false;
+  }
+  automation::MessageStore::BumpGeneration();
+  boost::mutex::scoped_lock lock(mutex_);
+  RepeatedPtrField<automation::Requirement>* reqs = schedule_.mutable_schedule();
+  for (int i = 0; i < reqs->size(); ++i) {
+    if (reqs->Get(i).requirementid() == id) {
+      reqs->DeleteSubrange(i, 1);
+      break;
+    }
+  }
+  return true;
+}
+RequirementEngine::PatchResult RequirementEngine::Patch(
+    sqlite3 *db, int64_t id, const automation::Requirement& patch, automation::Requirement* patched) {
+  boost::mutex::scoped_lock write_lock(write_mutex_);
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    automation::Requirement *current = FindLocked(id);
+    if (!current) {
+      return NOT_FOUND;
+    }
+    patched->CopyFrom(*current);
+  }
+  if (patch.has_version() && patch.version() != patched->version()) {
+    return CONFLICT;
+  }
+  // Each field given replaces the stored one, rather than being merged in.
+  automation::Requirement fields(patch);
+  fields.clear_requirementid();
+  fields.clear_version();
+  std::vector<const FieldDescriptor*> given;
+  fields.GetReflection()->ListFields(fields, &given);
+  for (const FieldDescriptor* field : given) {
+    patched->GetReflection()->ClearField(patched, field);
+  }
+  patched->MergeFrom(fields);
 
-void RequirementEngine::Save() {
-  automation::BasicProtoStore pstore(db_);
-
+  if (!RowWriter(db, channel_).Update(patched)) {
+    // Changed since we read it; only possible if another process wrote it.
+    return CONFLICT;
+  }
+  automation::MessageStore::BumpGeneration();
   boost::mutex::scoped_lock lock(mutex_);
-  pstore.Save<automation::Schedule>(&schedule_);
+  FindLocked(id)->CopyFrom(*patched);
+  return PATCHED;
+}
+automation::Requirement* RequirementEngine::FindLocked(int64_t id) {
+  for (automation::Requirement& req : *schedule_.mutable_schedule()) {
+    if (req.requirementid() == id) {
+      return &req;
+    }
+  }
+  return NULL;
+}
+bool RequirementEngine::ParseSpotLog(const std::string& log, automation::Schedule* schedule,
+                                     std::string* error) {
+  typedef boost::tokenizer<boost::escaped_list_separator<char> > fields_tokenizer;
+  std::istringstream lines(log);
+  std::string line;
+  for (int number = 1; std::getline(lines, line); ++number) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::vector<std::string> fields;
+    try {
+      fields_tokenizer tokens(line);
+      fields.assign(tokens.begin(), tokens.end());
+    } catch (const boost::escaped_list_error& e) {
+      *error = "line " + std::to_string(number) + ": " + e.what();
+      return false;
+    }
+    auto fail = [&](const std::string& why) {
+      *error = "line " + std::to_string(number) + ": " + why;
+      return false;
+    };
+    if (fields.size() < 2 || fields.size() > 4) {
+      return fail("expected time,command[,argument[,gap]]");
+    }
+
+    automation::Requirement *req = schedule->add_schedule();
+    time_t when;
+    if (!fields[0].empty() && std::all_of(fields[0].begin(), fields[0].end(), ::isdigit)) {
+      when = std::stoll(fields[0]);
+    } else {
+      struct tm local = {};
+      const char *end = strptime(fields[0].c_str(), "%Y-%m-%d %H:%M:%S", &local);
+      if (!end || *end) {
+        return fail("bad time " + fields[0]);
+      }
+      local.tm_isdst = -1;
+      when = mktime(&local);
+    }
+    req->mutable_when()->add_only_at_times(when);
+
+    automation::Requirement::Command type;
+    if (!automation::Requirement::Command_Parse(fields[1], &type)) {
+      return fail("unknown command " + fields[1]);
+    }
+    req->set_type(type);
+
+    const std::string argument = fields.size() > 2 ? fields[2] : "";
+    if (type == automation::Requirement::PLAY_FILES) {
+      boost::tokenizer<boost::char_separator<char> > files(argument, boost::char_separator<char>("|"));
+      for (const std::string& file : files) {
+        automation::PlayableItem *item = req->mutable_playlist()->add_items();
+        if (std::all_of(file.begin(), file.end(), ::isdigit)) {
+          item->set_playableitemid(std::stoll(file));
+        } else {
+          item->set_filename(file);
+        }
+      }
+      if (!req->playlist().items_size()) {
+        return fail("PLAY_FILES needs files");
+      }
+    } else if (type == automation::Requirement::SET_MAINSHOW && !argument.empty()) {
+      req->set_target_playlistname(argument);
+    }
+
+    if (fields.size() > 3) {
+      if (fields[3].empty() || !std::all_of(fields[3].begin(), fields[3].end(), ::isdigit)) {
+        return fail("bad gap " + fields[3]);
+      }
+      req->mutable_when()->set_gap(std::stoll(fields[3]));
+    }
+  }
+  return true;
 }
 void RequirementEngine::CheckValidity() {
   automation::Requirement req;
@@ -89,12 +421,15 @@ void RequirementEngine::CopyTo(automation::Schedule *output) {
 void RequirementEngine::CopyFrom(const automation::Schedule &input) {
   boost::mutex::scoped_lock lock(mutex_);
   schedule_.CopyFrom(input);
+  // Cached /requirements/fetch responses are stale from here, not from Save().
+  automation::MessageStore::BumpGeneration();
 }
 void RequirementEngine::FillNext(automation::Schedule* next, time_t* deadline, time_t* gap) {
+  TRACE_SCOPE("RequirementEngine::FillNext");
   boost::mutex::scoped_lock lock(mutex_);
 
   // We set a default deadline of an hour from now, just in case nothing is scheduled.
-  *deadline = time(NULL)+3600;
+  *deadline = Clock::Get()->Now()+3600;
   // We will end up getting a gap from a requirement here, but let's start with an
   // impossibly large gap here, so we can safely do *gap = min(*gap, item-gap) later.
   *gap = 86400 * 365 * 20;
@@ -115,8 +450,13 @@ void RequirementEngine::FillNext(automation::Schedule* next, time_t* deadline, t
   return;
 }
 void RequirementEngine::RunBlock(time_t deadline, const automation::Schedule* next) {
-    RequirementEngine::Registrar::CallbackMap &cm = RequirementEngine::Registrar::get_callbackmap();
+    TRACE_SCOPE("RequirementEngine::RunBlock");
     int internal_time_advance = 1;
+    if (deadline && next->schedule_size()) {
+      // Once for the whole block: each command runs only after those before it
+      // finish, so timing them one by one would count their play time as lateness.
+      RecordStart(deadline, *next);
+    }
  
     for (const automation::Requirement& req : next->schedule()) {
       if (req.internal_time_advance() < 0 && internal_time_advance > 0) {
@@ -124,28 +464,82 @@ void RequirementEngine::RunBlock(time_t deadline, const automation::Schedule* ne
       } else {
         internal_time_advance = std::max<int64>(internal_time_advance, req.internal_time_advance());
       }
-      std::string command_identifier = automation::Requirement::Command_descriptor()->FindValueByNumber(req.type())->name();
-      if (cm.count(command_identifier)) {
-        cm[command_identifier](deadline, req);
-      } else {
-        LOG(ERROR) << "Unknown comand " << command_identifier;
-      }
+      Dispatch(deadline, req);
     }
     if (internal_time_advance < 0) {
       VLOG(5) << "Setting internal time to now";
-      internal_time_ = time(NULL);
+      internal_time_ = Clock::Get()->Now();
     } else {
       VLOG(5) << "Incrementing internal time by " << internal_time_advance << " seconds";
       internal_time_ += internal_time_advance;
     }
 }
+void RequirementEngine::RunNow(const automation::Schedule& requirements) {
+  TRACE_SCOPE("RequirementEngine::RunNow");
+  for (const automation::Requirement& req : requirements.schedule()) {
+    Dispatch(0, req);
+  }
+}
+void RequirementEngine::Dispatch(time_t deadline, const automation::Requirement& req) {
+  RequirementEngine::Registrar::CallbackMap &cm = RequirementEngine::Registrar::get_callbackmap();
+  std::string command_identifier = automation::Requirement::Command_descriptor()->FindValueByNumber(req.type())->name();
+  if (cm.count(command_identifier)) {
+    cm[command_identifier](deadline, req);
+  } else {
+    LOG(ERROR) << "Unknown comand " << command_identifier;
+  }
+}
+void RequirementEngine::Prepare(time_t deadline, const automation::Schedule* next) {
+  if (deadline == prepared_deadline_) {
+    return;
+  }
+  TRACE_SCOPE("RequirementEngine::Prepare");
+  prepared_deadline_ = deadline;
+  std::map<std::string, radio_callback>& preparers = get_preparers();
+  for (const automation::Requirement& req : next->schedule()) {
+    std::string command_identifier = automation::Requirement::Command_descriptor()->FindValueByNumber(req.type())->name();
+    auto it = preparers.find(command_identifier);
+    if (it != preparers.end()) {
+      VLOG(5) << "Preparing " << command_identifier << " for " << deadline;
+      it->second(deadline, req);
+    }
+  }
+}
+void RequirementEngine::AddPreparer(const std::string& command, radio_callback prepare) {
+  get_preparers()[command] = prepare;
+}
+std::map<std::string, radio_callback>& RequirementEngine::get_preparers() {
+  static std::map<std::string, radio_callback> preparers;
+  return preparers;
+}
+void RequirementEngine::RecordStart(time_t deadline, const automation::Schedule& block) {
+  const int64_t offset = Clock::Get()->NowMicros() - deadline * 1000000LL;
+  const std::string command = automation::Requirement::Command_descriptor()->FindValueByNumber(
+      block.schedule(0).type())->name();
+  // The block is as late as its least tolerant requirement allows.
+  int64_t gap = block.schedule(0).when().gap();
+  for (const automation::Requirement& req : block.schedule()) {
+    gap = std::min<int64_t>(gap, req.when().gap());
+  }
+  const std::string labels = "command=\"" + command + "\"";
+  if (offset >= 0) {
+    metrics::GetHistogram("requirement_start_late_seconds",
+        "How long after its scheduled time each requirement started.", labels, 1e-6)->Record(offset);
+  } else {
+    metrics::GetHistogram("requirement_start_early_seconds",
+        "How long before its scheduled time each requirement started.", labels, 1e-6)->Record(-offset);
+  }
+  if (offset > gap * 1000000) {
+    metrics::GetCounter("requirement_missed_gap_total",
+        "Requirements that started later than their gap allows.", labels)->Increment();
+    LOG(WARNING) << command << " due at " << deadline << " started " << offset / 1000 << "ms late, "
+                 << "allowed " << gap << "s";
+  }
+}
 bool RequirementEngine::IsDue(const automation::Requirement& item, time_t candidate_time) {
-  struct tm time_spec;
-  localtime_r(&candidate_time, &time_spec); 
-
   // Helper lambda - checks a repeated field of constraints and returns
   // true if it's required. Empty constraints will always return true.
-  auto check_constraint = [](const RepeatedField<int64>& constraints, int value) {
+  auto check_constraint = [](const RepeatedField<int64>& constraints, int64 value) {
     if (constraints.empty()) return true;
 
     return std::any_of(constraints.begin(), constraints.end(), [value](int64 cmp) {
@@ -153,15 +547,18 @@ bool RequirementEngine::IsDue(const automation::Requirement& item, time_t candid
     });
   };
 
-  const automation::TimeSpecification time = item.when();
+  const automation::TimeSpecification& time = item.when();
 
-  // This case is different; if only_at_times is present and it
-  // satisfies the constraint, we return early instead of checking
-  // other contraints.
+  // This case is different; if only_at_times is present, it alone
+  // decides, and the other constraints aren't checked.  (Spot logs
+  // are thousands of these, so this is also checked first.)
   if (!time.only_at_times().empty()) {
-    if (check_constraint(time.only_at_times(), candidate_time)) return true;
+    return check_constraint(time.only_at_times(), candidate_time);
   }
 
+  struct tm time_spec;
+  localtime_r(&candidate_time, &time_spec); 
+
   if (!check_constraint(time.constrained_dom(), time_spec.tm_mday)) return false;
   if (!check_constraint(time.constrained_dow(), time_spec.tm_wday)) return false;
   if (!check_constraint(time.constrained_hours(), time_spec.tm_hour)) return false;
@@ -17,6 +17,9 @@
 #define REQUIREMENT_ENGINE_HEADER_H
 
 #include <sqlite3.h>
+#include <stdint.h>
+#include <map>
+#include <string>
 #include <boost/thread/mutex.hpp>
 #include <boost/function.hpp>
 #include "requirement.pb.h"
@@ -32,14 +35,69 @@ class RequirementEngine {
   void HandleReboot();
   void CopyTo(automation::Schedule *output);
   void CopyFrom(const automation::Schedule& input);
-  void Save();
+
+  // Requirements are stored one per row, each with a RequirementID and a
+  // version that goes up every time it is written.  The methods below write
+  // on db, which should be the caller's own connection rather than the one
+  // the engine was made with (that one belongs to the on-air thread), and
+  // only take the lock FillNext needs once the rows are written.  They throw
+  // std::runtime_error if the database refuses a change, leaving the schedule
+  // as it was.
+
+  // Replaces the whole schedule.  Requirements keep their RequirementIDs if
+  // they have them.
+  void Replace(sqlite3 *db, const automation::Schedule& schedule);
+  // Adds every requirement in schedule, as new requirements, in one
+  // transaction, filling in their RequirementIDs and versions.
+  void Import(sqlite3 *db, automation::Schedule* schedule);
+  // False if there is no such requirement.
+  bool Remove(sqlite3 *db, int64_t id);
+  enum PatchResult { PATCHED, NOT_FOUND, CONFLICT };
+  // Replaces the fields set in patch of requirement id, storing the result in
+  // *patched.  If patch has a version, it has to be the stored one.
+  PatchResult Patch(sqlite3 *db, int64_t id, const automation::Requirement& patch,
+                    automation::Requirement* patched);
+
+  // Parses a spot log: one requirement per line, as comma separated
+  // time (unix time or local "YYYY-MM-DD HH:MM:SS"), command (e.g. LEGAL_ID),
+  // and optionally an argument and a gap in seconds.  PLAY_FILES takes
+  // PlayableItemIDs or filenames separated by '|'; SET_MAINSHOW a playlist
+  // name.  Blank lines and lines starting with '#' are skipped.  Returns false
+  // and describes the first bad line in *error if there is one.
+  static bool ParseSpotLog(const std::string& log, automation::Schedule* schedule,
+                           std::string* error);
   static void CheckValidity();
   void RunBlock(time_t deadline, const automation::Schedule*);
+  // Runs each of requirements now, on the calling thread's channel, without
+  // a stored schedule or internal time.
+  static void RunNow(const automation::Schedule& requirements);
+  // Moves schedules saved by older versions as a single Schedule per channel
+  // into rows of their own.  Called by UpgradeSchema.
+  static void MoveLegacySchedules(sqlite3 *db);
+  // Lets each requirement in next get ready ahead of deadline, on the thread
+  // that will run it.  Does nothing if already done for this deadline.
+  void Prepare(time_t deadline, const automation::Schedule* next);
+  // Commands that can get ready ahead of time register a callback for Prepare.
+  static void AddPreparer(const std::string& command, radio_callback prepare);
+  // True if item is scheduled to run at candidate_time.
+  static bool IsDue(const automation::Requirement& item, time_t candidate_time);
 
-  RequirementEngine(sqlite3 *db);
+  // channel selects which channel's stored schedule this engine runs.
+  RequirementEngine(sqlite3 *db, const std::string& channel = "");
   REGISTER_REGISTRAR(RequirementEngine, radio_callback);
  private:
-  bool IsDue(const automation::Requirement& item, time_t candidate_time);
+  // Records how far from deadline the block of requirements is starting, for
+  // /metrics, labelled with its first requirement's command.
+  static void RecordStart(time_t deadline, const automation::Schedule& block);
+
+  static std::map<std::string, radio_callback>& get_preparers();
+
+  static void Dispatch(time_t deadline, const automation::Requirement& req);
+
+  // Loads the stored requirements.
+  void Load();
+  // The requirement with RequirementID id, or null.  Needs mutex_.
+  automation::Requirement* FindLocked(int64_t id);
 
   // Compute the effective schedule off of the stored and implicit
   automation::Schedule EffectiveSchedule();
@@ -47,10 +105,14 @@ class RequirementEngine {
   RequirementEngine(const RequirementEngine&) = delete;
   RequirementEngine& operator=(const RequirementEngine&) = delete;
   sqlite3 *db_;
+  const std::string channel_;
 
+  // Serializes writers, so rows and schedule_ change in the same order.
+  boost::mutex write_mutex_;
   boost::mutex mutex_;
   automation::Schedule schedule_;
   time_t internal_time_;
+  time_t prepared_deadline_ = 0;
 };
 
 #endif
@@ -0,0 +1,123 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "responsecache.h"
+
+#include <sys/stat.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "messagestore.h"
+
+DEFINE_int64(response_cache_bytes, 64 << 20, "Maximum size of serialized responses kept "
+  "for the read-only web API endpoints.  0 disables the cache (ETags are still sent).");
+
+DECLARE_string(dbname);
+
+ResponseCache::ResponseCache(size_t max_bytes) :
+  max_bytes_(max_bytes),
+  bytes_(0) {
+}
+
+ResponseCache* ResponseCache::Get() {
+  static ResponseCache cache(FLAGS_response_cache_bytes > 0 ? FLAGS_response_cache_bytes : 0);
+  return &cache;
+}
+
+namespace {
+// The database file's modification time as last seen, and how many times it
+// has changed other than by WriteUnseen.
+boost::mutex file_mutex;
+uint64_t file_mtime = 0;
+uint64_t file_changes = 0;
+
+uint64_t FileMtime() {
+  struct stat statobj;
+  if (stat(FLAGS_dbname.c_str(), &statobj) != 0) {
+    return 0;
+  }
+  return statobj.st_mtim.tv_sec * 1000000000ULL + statobj.st_mtim.tv_nsec;
+}
+
+// Counts any change to the file since it was last seen.  Needs file_mutex.
+void ObserveFileLocked() {
+  const uint64_t mtime = FileMtime();
+  if (mtime != file_mtime) {
+    file_mtime = mtime;
+    ++file_changes;
+  }
+}
+}
+
+uint64_t ResponseCache::CurrentGeneration() {
+  uint64_t changes;
+  {
+    boost::mutex::scoped_lock lock(file_mutex);
+    ObserveFileLocked();
+    changes = file_changes;
+  }
+  return automation::MessageStore::generation() * 0x9E3779B97F4A7C15ULL ^ changes;
+}
+
+void ResponseCache::WriteUnseen(const std::function<void()>& write) {
+  // Held throughout, so that a change by anyone else before or during the
+  // write is still counted.
+  boost::mutex::scoped_lock lock(file_mutex);
+  ObserveFileLocked();
+  write();
+  file_mtime = FileMtime();
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::Lookup(const std::string& key, uint64_t generation) {
+  boost::mutex::scoped_lock lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  if (it->second.generation != generation) {
+    EraseLocked(it);
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  return it->second.response;
+}
+
+void ResponseCache::Insert(const std::string& key, uint64_t generation,
+                           std::shared_ptr<const CachedResponse> response) {
+  const size_t size = response->body->size();
+  if (size > max_bytes_) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    EraseLocked(it);
+  }
+  while (bytes_ + size > max_bytes_ && !lru_.empty()) {
+    EraseLocked(entries_.find(lru_.back()));
+  }
+  lru_.push_front(key);
+  Entry& entry = entries_[key];
+  entry.generation = generation;
+  entry.response = response;
+  entry.lru = lru_.begin();
+  bytes_ += size;
+  VLOG(10) << "Cached " << size << " byte response for " << key << "; " << bytes_ << " bytes in cache";
+}
+
+void ResponseCache::EraseLocked(std::map<std::string, Entry>::iterator it) {
+  bytes_ -= it->second.response->body->size();
+  lru_.erase(it->second.lru);
+  entries_.erase(it);
+}
@@ -0,0 +1,78 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include "base.h"
+
+// A serialized API response, as stored in the ResponseCache.
+struct CachedResponse {
+  std::string content_type;
+  std::string content_encoding;  // Empty if the body isn't compressed.
+  std::shared_ptr<const std::string> body;
+  size_t identity_size;          // The size of the body uncompressed.
+};
+
+// An LRU cache of serialized responses for read-only endpoints, bounded by the
+// total size of the bodies it holds.  Entries are tagged with the data
+// generation they were computed at and are only returned for that generation,
+// so nothing ever needs to be explicitly evicted on writes.
+class ResponseCache {
+ public:
+  explicit ResponseCache(size_t max_bytes);
+
+  // The process-wide cache, sized by FLAGS_response_cache_bytes.
+  static ResponseCache* Get();
+
+  // The current generation of everything served from the database.  This moves
+  // whenever this process commits a write (see MessageStore::generation) and
+  // whenever the database file is modified by anyone else, e.g. acmd.  It costs
+  // a stat() and touches no SQLite state.
+  static uint64_t CurrentGeneration();
+  // Runs write, a write to the database that isn't worth invalidating every
+  // cached response over (counting a play), without moving the generation.
+  // Responses may show what it changed as it was until something else moves it.
+  static void WriteUnseen(const std::function<void()>& write);
+
+  std::shared_ptr<const CachedResponse> Lookup(const std::string& key, uint64_t generation);
+  void Insert(const std::string& key, uint64_t generation,
+              std::shared_ptr<const CachedResponse> response);
+
+ private:
+  struct Entry {
+    uint64_t generation;
+    std::shared_ptr<const CachedResponse> response;
+    std::list<std::string>::iterator lru;
+  };
+  void EraseLocked(std::map<std::string, Entry>::iterator it);
+
+  const size_t max_bytes_;
+  boost::mutex mutex_;  // Guards everything below.
+  size_t bytes_;
+  std::map<std::string, Entry> entries_;
+  std::list<std::string> lru_;  // Most recently used at the front.
+
+  DISALLOW_COPY_AND_ASSIGN(ResponseCache);
+};
+
+#endif
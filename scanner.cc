@@ -0,0 +1,597 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "scanner.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <boost/thread/mutex.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "messagestore.h"
+#include "metrics.h"
+#include "playableitem.h"
+#include "trace.h"
+
+DEFINE_string(scan_extensions, "mp3,flac,ogg,oga,opus,m4a,aac,wav", "Comma-separated "
+  "extensions of the files the library scanner adds.  Others are ignored.");
+DEFINE_int32(scan_batch_size, 500, "The library scanner commits its changes this many at a "
+  "time, so that other writers aren't held up for a whole scan.");
+DEFINE_int32(watch_batch_seconds, 5, "How long the library watcher collects changes for "
+  "before scanning them, from the first change.  Files being copied in often change many "
+  "times over.");
+
+namespace {
+// A walker's directories still to be read.  Its owner takes from the back, so
+// that it goes depth first and the queue stays short; idle walkers steal from
+// the front, taking the shallowest directories, which tend to hold the most.
+struct WorkQueue {
+  boost::mutex mutex;
+  std::deque<std::string> dirs;
+};
+
+bool Take(std::vector<std::unique_ptr<WorkQueue> >& queues, int self, std::string* dir) {
+  for (size_t i = 0; i < queues.size(); ++i) {
+    WorkQueue& queue = *queues[(self + i) % queues.size()];
+    boost::mutex::scoped_lock lock(queue.mutex);
+    if (queue.dirs.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      *dir = std::move(queue.dirs.back());
+      queue.dirs.pop_back();
+    } else {
+      *dir = std::move(queue.dirs.front());
+      queue.dirs.pop_front();
+    }
+    return true;
+  }
+  return false;
+}
+
+void Exec(sqlite3 *db, const char *sql) {
+  if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    throw std::runtime_error(std::string(sql) + ": " + sqlite3_errmsg(db));
+  }
+}
+
+std::string StripSlashes(std::string path) {
+  while (!path.empty() && path.back() == '/') {
+    path.pop_back();
+  }
+  return path;
+}
+
+bool Under(const std::string& filename, const std::string& dir) {
+  return filename.size() > dir.size() && filename[dir.size()] == '/' &&
+         filename.compare(0, dir.size(), dir) == 0;
+}
+
+// What a scan does to one PlayableItem row.
+struct Change {
+  enum Kind { ADD, UPDATE, MARK_MISSING } kind;
+  int64_t id;
+  const void* file;  // A LibraryScanner::File, for ADD and UPDATE.
+  bool measure;      // Whether the duration needs finding (again).
+  int duration;
+};
+}
+
+LibraryScanner::LibraryScanner(sqlite3 *db) : db_(db) {
+  std::stringstream extensions(FLAGS_scan_extensions);
+  std::string extension;
+  while (std::getline(extensions, extension, ',')) {
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    extensions_.insert(extension);
+  }
+  // The daemon and the web API write too; wait for them rather than failing.
+  sqlite3_busy_timeout(db_, 10000);
+}
+
+bool LibraryScanner::IsAudio(const char *name) const {
+  const char *dot = strrchr(name, '.');
+  if (!dot) {
+    return false;
+  }
+  std::string extension(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  return extensions_.count(extension);
+}
+
+std::vector<LibraryScanner::File> LibraryScanner::Walk(const std::vector<std::string>& paths,
+                                                       int threads,
+                                                       std::vector<std::string>* unreadable) {
+  std::vector<std::unique_ptr<WorkQueue> > queues;
+  for (int i = 0; i < threads; ++i) {
+    queues.emplace_back(new WorkQueue);
+  }
+  std::vector<std::vector<File> > found(threads);
+  std::vector<std::vector<std::string> > failed(threads);
+  // Directories queued and not yet finished with.  A directory's children are
+  // queued before it is counted off, so this only reaches 0 at the end.
+  std::atomic<int> pending(0);
+
+  for (const std::string& path : paths) {
+    struct stat st;
+    if (stat(path.empty() ? "/" : path.c_str(), &st)) {
+      if (errno != ENOENT && errno != ENOTDIR) {
+        LOG(WARNING) << "Unable to scan " << path << ": " << strerror(errno);
+        unreadable->push_back(path);
+      }
+      continue;  // Otherwise it's gone, and everything under it is missing.
+    }
+    if (S_ISDIR(st.st_mode)) {
+      ++pending;
+      queues[pending % threads]->dirs.push_back(path);
+    } else if (S_ISREG(st.st_mode) && IsAudio(path.c_str())) {
+      found[0].push_back({path, st.st_size, st.st_mtime});
+    }
+  }
+
+  auto walker = [&](int self) {
+    std::string dir;
+    while (pending > 0) {
+      if (!Take(queues, self, &dir)) {
+        boost::this_thread::yield();
+        continue;
+      }
+      DIR *handle = opendir(dir.empty() ? "/" : dir.c_str());
+      if (!handle) {
+        LOG(WARNING) << "Unable to read " << dir << ": " << strerror(errno);
+        failed[self].push_back(dir);
+        --pending;
+        continue;
+      }
+      const int fd = dirfd(handle);
+      while (struct dirent *entry = readdir(handle)) {
+        const char *name = entry->d_name;
+        // Skips . and .., and hidden files such as ._foo.mp3 (Mac metadata).
+        if (name[0] == '.') {
+          continue;
+        }
+        struct stat st;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+          if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+            continue;
+          }
+          type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK :
+                 S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+          ++pending;
+          boost::mutex::scoped_lock lock(queues[self]->mutex);
+          queues[self]->dirs.push_back(dir + "/" + name);
+        } else if ((type == DT_REG || type == DT_LNK) && IsAudio(name) &&
+                   !fstatat(fd, name, &st, 0) && S_ISREG(st.st_mode)) {
+          // Links to files are followed; links to directories aren't, as they
+          // can make loops.
+          found[self].push_back({dir + "/" + name, st.st_size, st.st_mtime});
+        }
+      }
+      closedir(handle);
+      --pending;
+    }
+  };
+  boost::thread_group walkers;
+  for (int i = 1; i < threads; ++i) {
+    walkers.create_thread([&walker, i]() { walker(i); });
+  }
+  walker(0);
+  walkers.join_all();
+
+  std::vector<File> files;
+  for (int i = 0; i < threads; ++i) {
+    files.insert(files.end(), std::make_move_iterator(found[i].begin()),
+                 std::make_move_iterator(found[i].end()));
+    unreadable->insert(unreadable->end(), failed[i].begin(), failed[i].end());
+  }
+  return files;
+}
+
+LibraryScanner::Stats LibraryScanner::Scan(const std::vector<std::string>& paths, int threads) {
+  TRACE_SCOPE("LibraryScanner::Scan");
+  if (threads <= 0) {
+    threads = std::max(1u, boost::thread::hardware_concurrency());
+  }
+  // Paths under others given are scanned along with them, and only then.
+  std::set<std::string> sorted;
+  for (const std::string& path : paths) {
+    sorted.insert(StripSlashes(path));
+  }
+  std::vector<std::string> scope;
+  for (const std::string& path : sorted) {
+    if (std::none_of(scope.begin(), scope.end(),
+        [&path](const std::string& dir) { return Under(path, dir); })) {
+      scope.push_back(path);
+    }
+  }
+  Stats stats;
+  std::vector<std::string> unreadable;
+  const std::vector<File> files = Walk(scope, threads, &unreadable);
+  stats.files = files.size();
+
+  // What the database has under the same paths.  filename is indexed, so
+  // "under dir" is the range from "dir/" up to "dir0" ('0' follows '/').
+  struct Row {
+    int64_t id;
+    int64_t size;
+    int64_t mtime;
+    bool missing;
+    bool seen;
+  };
+  std::unordered_map<std::string, Row> rows;
+  sqlite3_stmt *select;
+  CHECK(sqlite3_prepare_v2(db_, "SELECT PlayableItemID, filename, size, mtime, missing "
+                                "FROM PlayableItem WHERE (filename >= ?1 AND filename < ?2) "
+                                "OR filename = ?3", -1, &select, NULL) == SQLITE_OK)
+      << sqlite3_errmsg(db_);
+  for (const std::string& path : scope) {
+    const std::string from = path + "/", to = path + "0";
+    sqlite3_bind_text(select, 1, from.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(select, 2, to.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(select, 3, path.c_str(), -1, SQLITE_TRANSIENT);
+    while (sqlite3_step(select) == SQLITE_ROW) {
+      rows[reinterpret_cast<const char*>(sqlite3_column_text(select, 1))] = {
+          sqlite3_column_int64(select, 0), sqlite3_column_int64(select, 2),
+          sqlite3_column_int64(select, 3), sqlite3_column_int(select, 4) != 0, false};
+    }
+    sqlite3_reset(select);
+  }
+  sqlite3_finalize(select);
+
+  std::vector<Change> changes;
+  std::vector<const File*> added;
+  for (const File& file : files) {
+    auto row = rows.find(file.filename);
+    if (row == rows.end()) {
+      added.push_back(&file);
+      continue;
+    }
+    Row& r = row->second;
+    r.seen = true;
+    // Rows from before the scanner existed have no size or time; take the
+    // file as it is rather than measuring the whole library again.
+    const bool unknown = !r.size && !r.mtime;
+    const bool changed = !unknown && (r.size != file.size || r.mtime != file.mtime);
+    if (changed || unknown) {
+      ++stats.changed;
+    } else if (r.missing) {
+      ++stats.restored;
+    } else {
+      ++stats.unchanged;
+      continue;
+    }
+    changes.push_back({Change::UPDATE, r.id, &file, changed, 0});
+  }
+
+  // Rows whose file is gone, unless it may just be in a directory that
+  // couldn't be read this time.  Those with the size and time of a file that
+  // is new to the database have likely been moved or renamed.
+  std::multimap<std::pair<int64_t, int64_t>, const std::pair<const std::string, Row>*> gone;
+  for (const auto& row : rows) {
+    if (row.second.seen || std::any_of(unreadable.begin(), unreadable.end(),
+        [&row](const std::string& dir) { return row.first == dir || Under(row.first, dir); })) {
+      continue;
+    }
+    gone.insert({{row.second.size, row.second.mtime}, &row});
+  }
+  // The file may also have gone from outside the paths scanned, such as in an
+  // earlier batch of the watcher's, in which case its row is already missing.
+  sqlite3_stmt *find_missing;
+  CHECK(sqlite3_prepare_v2(db_, "SELECT PlayableItemID, filename FROM PlayableItem "
+                                "WHERE missing AND size = ? AND mtime = ?",
+                           -1, &find_missing, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
+  std::set<int64_t> claimed;
+  for (const File* file : added) {
+    std::map<int64_t, std::string> candidates;
+    if (file->size > 0) {
+      auto range = gone.equal_range({file->size, file->mtime});
+      for (auto it = range.first; it != range.second; ++it) {
+        candidates[it->second->second.id] = it->second->first;
+      }
+      sqlite3_bind_int64(find_missing, 1, file->size);
+      sqlite3_bind_int64(find_missing, 2, file->mtime);
+      while (sqlite3_step(find_missing) == SQLITE_ROW) {
+        candidates[sqlite3_column_int64(find_missing, 0)] =
+            reinterpret_cast<const char*>(sqlite3_column_text(find_missing, 1));
+      }
+      sqlite3_reset(find_missing);
+    }
+    // Files copied in together often share a size and time.  Rather than guess
+    // (and swap their IDs, and so their playlists), only the one candidate, or
+    // the one with the same name, is taken to be the same file.
+    const std::string name = file->filename.substr(file->filename.rfind('/') + 1);
+    int64_t moved_from = 0, same_name = 0, unclaimed = 0;
+    for (const auto& candidate : candidates) {
+      if (claimed.count(candidate.first)) {
+        continue;
+      }
+      ++unclaimed;
+      moved_from = candidate.first;
+      if (candidate.second.substr(candidate.second.rfind('/') + 1) == name) {
+        same_name = same_name ? -1 : candidate.first;
+      }
+    }
+    if (unclaimed > 1) {
+      moved_from = std::max<int64_t>(same_name, 0);
+    }
+    if (moved_from) {
+      claimed.insert(moved_from);
+      ++stats.moved;
+      changes.push_back({Change::UPDATE, moved_from, file, false, 0});
+    } else {
+      changes.push_back({Change::ADD, 0, file, true, 0});
+    }
+  }
+  sqlite3_finalize(find_missing);
+  for (const auto& row : gone) {
+    if (!row.second->second.missing && !claimed.count(row.second->second.id)) {
+      ++stats.missing;
+      changes.push_back({Change::MARK_MISSING, row.second->second.id, nullptr, false, 0});
+    }
+  }
+
+  // Measuring means having mpv open each file, which is by far the slowest
+  // part of a scan that finds anything new.
+  std::atomic<size_t> next(0);
+  auto measure = [&]() {
+    for (size_t i = next++; i < changes.size(); i = next++) {
+      if (changes[i].measure) {
+        changes[i].duration = PlayableItem::CalculateDuration(
+            static_cast<const File*>(changes[i].file)->filename);
+      }
+    }
+  };
+  boost::thread_group measurers;
+  for (int i = 1; i < threads; ++i) {
+    measurers.create_thread(measure);
+  }
+  measure();
+  measurers.join_all();
+
+  sqlite3_stmt *insert, *update, *mark_missing;
+  CHECK(sqlite3_prepare_v2(db_, "INSERT INTO PlayableItem (filename, duration, size, mtime, playcount) "
+                                "VALUES (?, ?, ?, ?, 0)", -1, &insert, NULL) == SQLITE_OK)
+      << sqlite3_errmsg(db_);
+  CHECK(sqlite3_prepare_v2(db_, "UPDATE PlayableItem SET filename = ?, size = ?, mtime = ?, "
+                                "missing = 0, duration = COALESCE(?, duration) "
+                                "WHERE PlayableItemID = ?", -1, &update, NULL) == SQLITE_OK)
+      << sqlite3_errmsg(db_);
+  CHECK(sqlite3_prepare_v2(db_, "UPDATE PlayableItem SET missing = 1 WHERE PlayableItemID = ?",
+                           -1, &mark_missing, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
+  int batched = 0;
+  try {
+    for (const Change& change : changes) {
+      const File* file = static_cast<const File*>(change.file);
+      sqlite3_stmt *ps;
+      if (change.measure && change.duration <= 0) {
+        // Unplayable, or still being written.  Changed files keep their old
+        // size and time, so that the next scan tries again.
+        LOG(WARNING) << "Unable to find the duration of " << file->filename;
+        ++stats.failed;
+        if (change.kind == Change::UPDATE) {
+          --stats.changed;
+        }
+        continue;
+      } else if (change.kind == Change::ADD) {
+        ps = insert;
+        sqlite3_bind_text(ps, 1, file->filename.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(ps, 2, change.duration);
+        sqlite3_bind_int64(ps, 3, file->size);
+        sqlite3_bind_int64(ps, 4, file->mtime);
+      } else if (change.kind == Change::UPDATE) {
+        ps = update;
+        sqlite3_bind_text(ps, 1, file->filename.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(ps, 2, file->size);
+        sqlite3_bind_int64(ps, 3, file->mtime);
+        if (change.measure) {
+          sqlite3_bind_int(ps, 4, change.duration);
+        } else {
+          sqlite3_bind_null(ps, 4);
+        }
+        sqlite3_bind_int64(ps, 5, change.id);
+      } else {
+        ps = mark_missing;
+        sqlite3_bind_int64(ps, 1, change.id);
+      }
+      if (!batched) {
+        Exec(db_, "BEGIN IMMEDIATE");
+      }
+      const int result = sqlite3_step(ps);
+      sqlite3_reset(ps);
+      if (result != SQLITE_DONE) {
+        throw std::runtime_error(std::string("Unable to update the library: ") + sqlite3_errmsg(db_));
+      }
+      if (change.kind == Change::ADD) {
+        ++stats.added;
+      }
+      if (++batched >= FLAGS_scan_batch_size) {
+        Exec(db_, "COMMIT");
+        automation::MessageStore::BumpGeneration();
+        batched = 0;
+      }
+    }
+    if (batched) {
+      Exec(db_, "COMMIT");
+      automation::MessageStore::BumpGeneration();
+    }
+  } catch (const std::exception&) {
+    if (batched) {
+      sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+    }
+    sqlite3_finalize(insert);
+    sqlite3_finalize(update);
+    sqlite3_finalize(mark_missing);
+    throw;
+  }
+  sqlite3_finalize(insert);
+  sqlite3_finalize(update);
+  sqlite3_finalize(mark_missing);
+
+  const char kHelp[] = "Files the library scanner found, by what had changed about them.";
+  metrics::GetCounter("library_scan_files_total", kHelp, "change=\"none\"")->Increment(stats.unchanged);
+  metrics::GetCounter("library_scan_files_total", kHelp, "change=\"added\"")->Increment(stats.added);
+  metrics::GetCounter("library_scan_files_total", kHelp, "change=\"changed\"")->Increment(stats.changed);
+  metrics::GetCounter("library_scan_files_total", kHelp, "change=\"moved\"")->Increment(stats.moved);
+  metrics::GetCounter("library_scan_files_total", kHelp, "change=\"restored\"")->Increment(stats.restored);
+  metrics::GetCounter("library_scan_files_total", kHelp, "change=\"missing\"")->Increment(stats.missing);
+  metrics::GetCounter("library_scan_files_total", kHelp, "change=\"failed\"")->Increment(stats.failed);
+  return stats;
+}
+
+LibraryWatcher::LibraryWatcher(sqlite3 *db, const std::vector<std::string>& roots) :
+  db_(db),
+  scanner_(db),
+  roots_(roots),
+  fd_(inotify_init1(IN_CLOEXEC | IN_NONBLOCK)),
+  stop_(false) {
+  CHECK(fd_ >= 0) << "Unable to start watching the library: " << strerror(errno);
+  thread_ = boost::thread([this]() { Run(); });
+}
+
+LibraryWatcher::~LibraryWatcher() {
+  stop_ = true;
+  thread_.join();
+  close(fd_);
+  sqlite3_close(db_);
+}
+
+void LibraryWatcher::AddWatches(const std::string& dir) {
+  const uint32_t kEvents = IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE |
+                           IN_ONLYDIR | IN_DONT_FOLLOW;
+  std::vector<std::string> dirs(1, StripSlashes(dir));
+  while (!dirs.empty()) {
+    const std::string path = std::move(dirs.back());
+    dirs.pop_back();
+    const int wd = inotify_add_watch(fd_, path.empty() ? "/" : path.c_str(), kEvents);
+    if (wd < 0) {
+      // Usually ENOSPC: see /proc/sys/fs/inotify/max_user_watches.
+      LOG(WARNING) << "Unable to watch " << path << ": " << strerror(errno);
+      continue;
+    }
+    dirs_[wd] = path;
+    DIR *handle = opendir(path.empty() ? "/" : path.c_str());
+    if (!handle) {
+      continue;
+    }
+    while (struct dirent *entry = readdir(handle)) {
+      if (entry->d_name[0] == '.') {
+        continue;
+      }
+      struct stat st;
+      if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN &&
+          !fstatat(dirfd(handle), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode))) {
+        dirs.push_back(path + "/" + entry->d_name);
+      }
+    }
+    closedir(handle);
+  }
+}
+
+void LibraryWatcher::RemoveWatches(const std::string& dir) {
+  for (auto it = dirs_.begin(); it != dirs_.end();) {
+    if (it->second == dir || Under(it->second, dir)) {
+      inotify_rm_watch(fd_, it->first);
+      it = dirs_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void LibraryWatcher::ScanAndLog(const std::vector<std::string>& paths, int threads) {
+  try {
+    const LibraryScanner::Stats stats = scanner_.Scan(paths, threads);
+    LOG(INFO) << "Scanned " << paths.size() << " library paths: " << stats.files << " files, "
+              << stats.added << " added, " << stats.changed << " changed, " << stats.moved
+              << " moved, " << stats.restored << " restored, " << stats.missing << " missing, "
+              << stats.failed << " unplayable.";
+  } catch (const std::exception& e) {
+    // Most likely the database was busy for too long; the files will be
+    // picked up by the next change to them, or the next restart.
+    LOG(ERROR) << "Library scan failed: " << e.what();
+  }
+}
+
+void LibraryWatcher::Run() {
+  // Watches go on before the first scan, so nothing changed in between is lost.
+  for (const std::string& root : roots_) {
+    AddWatches(root);
+  }
+  ScanAndLog(roots_, 0);
+
+  std::set<std::string> changed;
+  std::chrono::steady_clock::time_point first_change;
+  // Big enough for a good many events at once.
+  alignas(struct inotify_event) char buf[64 * 1024];
+  while (!stop_) {
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    poll(&pfd, 1, 1000);
+    ssize_t length;
+    while ((length = read(fd_, buf, sizeof(buf))) > 0) {
+      for (char *p = buf; p < buf + length;) {
+        const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>(p);
+        p += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          // Events were dropped; the only way to be sure is to look again.
+          LOG(WARNING) << "Library watch queue overflowed; rescanning everything.";
+          changed.insert(roots_.begin(), roots_.end());
+          continue;
+        }
+        if (event->mask & IN_IGNORED) {
+          dirs_.erase(event->wd);
+          continue;
+        }
+        auto dir = dirs_.find(event->wd);
+        if (dir == dirs_.end() || !event->len) {
+          continue;
+        }
+        const std::string path = dir->second + "/" + event->name;
+        if (event->mask & IN_ISDIR) {
+          if (event->mask & IN_MOVED_FROM) {
+            RemoveWatches(path);
+          } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            AddWatches(path);
+          }
+        }
+        if (changed.empty()) {
+          first_change = std::chrono::steady_clock::now();
+        }
+        changed.insert(path);
+      }
+    }
+    if (!changed.empty() && std::chrono::steady_clock::now() - first_change >=
+                            std::chrono::seconds(FLAGS_watch_batch_seconds)) {
+      const std::vector<std::string> paths(changed.begin(), changed.end());
+      changed.clear();
+      ScanAndLog(paths, 1);
+    }
+  }
+}
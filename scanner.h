@@ -0,0 +1,107 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include "sqlite3.h"
+#include "base.h"
+
+// LibraryScanner brings PlayableItem up to date with what is on disk under
+// some paths.  Files are told apart by path, size and modification time: new
+// ones are added, changed ones measured again, ones that turn up elsewhere
+// with the same size and time are treated as moved (keeping their ID, and so
+// their playlists), and ones that are gone are marked missing rather than
+// deleted, so that they come back in their playlists if they reappear.
+class LibraryScanner {
+ public:
+  struct Stats {
+    int64_t files = 0;      // Files found on disk.
+    int64_t unchanged = 0;
+    int64_t added = 0;
+    int64_t changed = 0;    // Includes rows that only lacked a size and time.
+    int64_t moved = 0;
+    int64_t restored = 0;   // Were missing, and are back.
+    int64_t missing = 0;    // Newly missing.
+    int64_t failed = 0;     // New or changed files that couldn't be measured.
+  };
+
+  explicit LibraryScanner(sqlite3 *db);
+
+  // Scans each of paths: directories are walked recursively, and anything in
+  // the database under a path that no longer exists is marked missing.  The
+  // walk and the measuring of new files are spread over threads (0 for one per
+  // core).  Throws std::runtime_error if the database can't be written.
+  Stats Scan(const std::vector<std::string>& paths, int threads);
+
+ private:
+  struct File {
+    std::string filename;
+    int64_t size;
+    int64_t mtime;
+  };
+
+  // Collects the files under paths that look like audio, and the directories
+  // that couldn't be read, whose contents are left as they are.
+  std::vector<File> Walk(const std::vector<std::string>& paths, int threads,
+                         std::vector<std::string>* unreadable);
+  bool IsAudio(const char *name) const;
+
+  sqlite3 *db_;
+  std::set<std::string> extensions_;
+
+  DISALLOW_COPY_AND_ASSIGN(LibraryScanner);
+};
+
+// LibraryWatcher keeps PlayableItem up to date in the background: it scans
+// roots once, to catch up on what changed while nothing was watching, and
+// then rescans just the paths inotify reports changes to, a batch at a time.
+class LibraryWatcher {
+ public:
+  // Takes ownership of db, which should be a connection of its own.
+  LibraryWatcher(sqlite3 *db, const std::vector<std::string>& roots);
+  ~LibraryWatcher();
+
+ private:
+  void Run();
+  // Watches dir and every directory under it.
+  void AddWatches(const std::string& dir);
+  // Forgets the watches on dir and under it, which has moved or gone.
+  void RemoveWatches(const std::string& dir);
+  // Scans paths, logging rather than throwing on failure.
+  void ScanAndLog(const std::vector<std::string>& paths, int threads);
+
+  sqlite3 *db_;
+  LibraryScanner scanner_;
+  const std::vector<std::string> roots_;
+  int fd_;
+  // Watch descriptor to the directory it watches.  Only touched by thread_.
+  std::unordered_map<int, std::string> dirs_;
+  std::atomic<bool> stop_;
+  boost::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(LibraryWatcher);
+};
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "simulatedplayer.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <time.h>
+
+SimulatedPlayer::SimulatedPlayer(VirtualClock* clock, FILE* log) :
+  MplayerSession(nullptr),
+  clock_(clock),
+  log_(log),
+  items_played_(0),
+  seconds_played_(0) {
+}
+
+bool SimulatedPlayer::Play(PlayableItem& item) {
+  return Play(*item.snapshot());
+}
+
+bool SimulatedPlayer::Play(const automation::PlayableItem& item) {
+  {
+    boost::mutex::scoped_lock state_lock(state_mutex_);
+    state_.mutable_now_playing()->CopyFrom(item);
+  }
+  if (log_) {
+    const time_t now = clock_->Now();
+    struct tm start;
+    localtime_r(&now, &start);
+    char when[32];
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &start);
+    fprintf(log_, "%s\t%" PRId64 "\t%" PRId64 "\t%s\t%s\n", when, (int64_t)item.duration(),
+            (int64_t)item.playableitemid(), item.filename().c_str(), item.description().c_str());
+  }
+  // A zero-length item would stop time; treat it as taking a second.
+  last_start_micros_ = clock_->NowMicros();
+  const int64_t duration = std::max<int64_t>(item.duration(), 1);
+  clock_->Advance(duration * 1000000);
+  ++items_played_;
+  seconds_played_ += duration;
+  return true;
+}
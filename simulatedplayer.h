@@ -0,0 +1,50 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef SIMULATED_PLAYER_H
+#define SIMULATED_PLAYER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "base.h"
+#include "clock.h"
+#include "mplayersession.h"
+
+// A player for simulations: instead of playing an item it writes it to the
+// as-run log and advances the VirtualClock by the item's duration.  It never
+// touches the database, so play counts are left alone.
+class SimulatedPlayer : public MplayerSession {
+ public:
+  // log may be null.  Neither is owned.
+  SimulatedPlayer(VirtualClock* clock, FILE* log);
+
+  bool Play(PlayableItem &item) override;
+  bool Play(const automation::PlayableItem &item) override;
+  // Everything is instantly ready in a simulation.
+  bool Preload(const automation::PlayableItem &item) override { return true; }
+
+  int64_t items_played() const { return items_played_; }
+  int64_t seconds_played() const { return seconds_played_; }
+
+ private:
+  VirtualClock* const clock_;
+  FILE* const log_;
+  int64_t items_played_;
+  int64_t seconds_played_;
+
+  DISALLOW_COPY_AND_ASSIGN(SimulatedPlayer);
+};
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_bool(trace, false, "If true, record tracing spans from startup.  Tracing can also be "
+            "switched on and off at runtime through /trace.");
+DEFINE_int32(trace_buffer_events, 16384, "Number of spans each thread keeps for tracing.");
+
+namespace trace {
+
+std::atomic<bool> enabled(false);
+
+namespace {
+
+struct Event {
+  const char* name;
+  int64_t start;
+  int64_t duration;
+  char detail[120];
+};
+
+// One per thread that has recorded a span.  The mutex is only ever contended
+// while an export is copying the buffer out.
+struct Buffer {
+  boost::mutex mutex;
+  std::vector<Event> events;
+  size_t next = 0;
+  bool wrapped = false;
+  int tid = 0;
+};
+
+boost::mutex& buffers_mutex() {
+  static boost::mutex mutex;
+  return mutex;
+}
+// Buffers are never freed, so spans from threads that have exited can still
+// be exported.
+std::vector<Buffer*>& buffers() {
+  static std::vector<Buffer*> buffers;
+  return buffers;
+}
+
+Buffer* LocalBuffer() {
+  thread_local Buffer* buffer = nullptr;
+  if (!buffer) {
+    buffer = new Buffer();
+    buffer->events.resize(std::max(1, FLAGS_trace_buffer_events));
+    boost::mutex::scoped_lock lock(buffers_mutex());
+    buffers().push_back(buffer);
+    buffer->tid = buffers().size();
+  }
+  return buffer;
+}
+
+void AppendJsonString(const char* value, std::ostringstream* out) {
+  *out << '"';
+  for (const char* c = value; *c; ++c) {
+    switch (*c) {
+     case '"':
+      *out << "\\\"";
+      break;
+     case '\\':
+      *out << "\\\\";
+      break;
+     default:
+      if ((unsigned char)*c < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof escaped, "\\u%04x", *c);
+        *out << escaped;
+      } else {
+        *out << *c;
+      }
+    }
+  }
+  *out << '"';
+}
+
+}  // namespace
+
+void SetEnabled(bool enable) {
+  enabled.store(enable, std::memory_order_relaxed);
+}
+
+int64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Record(const char* name, int64_t start_usec, int64_t duration_usec, const char* detail) {
+  Buffer* buffer = LocalBuffer();
+  boost::mutex::scoped_lock lock(buffer->mutex);
+  Event& event = buffer->events[buffer->next];
+  event.name = name;
+  event.start = start_usec;
+  event.duration = duration_usec;
+  if (detail) {
+    strncpy(event.detail, detail, sizeof event.detail - 1);
+    event.detail[sizeof event.detail - 1] = '\0';
+  } else {
+    event.detail[0] = '\0';
+  }
+  if (++buffer->next == buffer->events.size()) {
+    buffer->next = 0;
+    buffer->wrapped = true;
+  }
+}
+
+std::string ExportChromeJson() {
+  std::vector<Buffer*> all;
+  {
+    boost::mutex::scoped_lock lock(buffers_mutex());
+    all = buffers();
+  }
+  std::ostringstream out;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (Buffer* buffer : all) {
+    std::vector<Event> events;
+    {
+      boost::mutex::scoped_lock lock(buffer->mutex);
+      if (buffer->wrapped) {
+        events.assign(buffer->events.begin() + buffer->next, buffer->events.end());
+      }
+      events.insert(events.end(), buffer->events.begin(), buffer->events.begin() + buffer->next);
+    }
+    for (const Event& event : events) {
+      out << (first ? "\n" : ",\n");
+      first = false;
+      out << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid << ",\"ts\":" << event.start
+          << ",\"dur\":" << event.duration << ",\"name\":";
+      AppendJsonString(event.name, &out);
+      if (event.detail[0]) {
+        out << ",\"args\":{\"detail\":";
+        AppendJsonString(event.detail, &out);
+        out << "}";
+      }
+      out << "}";
+    }
+  }
+  out << "\n]}\n";
+  return out.str();
+}
+
+bool DumpToFile(const std::string& path) {
+  std::ofstream file(path.c_str(), std::ios::out | std::ios::trunc);
+  file << ExportChromeJson();
+  file.close();
+  if (!file) {
+    LOG(WARNING) << "Unable to write trace to " << path;
+    return false;
+  }
+  LOG(INFO) << "Wrote trace to " << path;
+  return true;
+}
+
+}  // namespace trace
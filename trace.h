@@ -0,0 +1,76 @@
+/*
+ *   Copyright 2012-2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include "base.h"
+
+// A span tracer for the track transition path.  TRACE_SCOPE("name") records
+// how long the enclosing scope took into a ring buffer owned by the current
+// thread; the last FLAGS_trace_buffer_events spans of every thread can then be
+// exported in the Chrome trace-event format (load it in chrome://tracing or
+// Perfetto).  While tracing is off a scope costs one relaxed atomic load.
+//
+// Names must be string literals, or otherwise outlive the process.
+namespace trace {
+
+extern std::atomic<bool> enabled;
+
+inline bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+void SetEnabled(bool enable);
+
+// Records a completed span.  detail, if any, is truncated and shown as the
+// span's argument.
+void Record(const char* name, int64_t start_usec, int64_t duration_usec,
+            const char* detail = nullptr);
+
+// Microseconds on the clock spans are stamped with.
+int64_t NowMicros();
+
+class Scope {
+ public:
+  explicit Scope(const char* name) :
+    name_(Enabled() ? name : nullptr),
+    start_(name_ ? NowMicros() : 0) {
+  }
+  ~Scope() {
+    if (name_) {
+      Record(name_, start_, NowMicros() - start_);
+    }
+  }
+
+ private:
+  const char* name_;
+  const int64_t start_;
+  DISALLOW_COPY_AND_ASSIGN(Scope);
+};
+
+// All buffered spans as a Chrome trace-event JSON document.
+std::string ExportChromeJson();
+
+// Writes ExportChromeJson() to path.
+bool DumpToFile(const std::string& path);
+
+}  // namespace trace
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif
@@ -16,18 +16,27 @@
 
 
 #include "automationstate.h"
+#include <climits>
+#include <chrono>
 #include <exception>
 #include <gflags/gflags.h>
 #include <glog/logging.h>  
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <google/protobuf/util/json_util.h>
 #include "http.h"
+#include "jobqueue.h"
+#include "metrics.h"
 #include "mplayersession.h"
 #include <ostream>
+#include <stdexcept>
 #include "playableitem.h"
 #include "playlist.h"
 #include "requirementengine.h"
+#include "trace.h"
 
 #include "db.h"
+#include "job.pb.h"
 #include "playlist.pb.h"
 #include "requirement.pb.h"
 #include "sql.pb.h"
@@ -35,22 +44,29 @@
 #include "protostore.h"
 
 DEFINE_bool(expose_sql, true, "If false, disable the /sql webapi endpoint.");
+DEFINE_bool(sql_allow_writes, false, "If true, /sql may modify the database.  Otherwise it runs "
+  "on a read-only connection and rejects statements that would write.");
+DEFINE_int64(sql_max_rows, 100000, "Most rows a single /sql request returns; its max_rows "
+  "parameter may only lower this.");
+DEFINE_int32(sql_timeout_ms, 5000, "Longest a single /sql request may run before it is "
+  "interrupted; its timeout_ms parameter may only lower this.");
 
 DECLARE_string(legalid);
+DECLARE_int32(filter_threads);
 std::string WebAPI::apikey;
 
 
 class OverrideCommand : public WebCommand {
   const std::string get_command() { return "/override"; }
-  void handle_command(HTTPRequestPtr& request, HTTPResponseWriterPtr writer, const std::string& remote_user) {
-    AutomationState *as = AutomationState::get_state();
-    if (request->get_resource() == "/override/enable") {
-      writer->write("Override enabled\n");
+  void handle_command(WebRequest& request) {
+    AutomationState *as = AutomationState::get_state(request.channel);
+    if (request.resource() == "/override/enable") {
+      request.writer->write("Override enabled\n");
       as->set_manual_override(true);
-    } else if (request->get_resource() == "/override/disable") {
+    } else if (request.resource() == "/override/disable") {
       as->get_mainplayer()->Unpause();
       as->get_mainplayer()->SetSpeed(1.0);
-      writer->write("Override disabled\n");
+      request.writer->write("Override disabled\n");
       as->set_manual_override(false);
     }
   }
@@ -58,116 +74,350 @@ class OverrideCommand : public WebCommand {
 REGISTER_COMMAND(OverrideCommand);
 class RequirementsCommand : public WebCommand {
   const std::string get_command() { return "/requirements"; }
-  void handle_command(HTTPRequestPtr& request, HTTPResponseWriterPtr writer, const std::string& remote_user) {
-    AutomationState *as = AutomationState::get_state();
-    DatabaseHandle db(DatabaseOpen());
-    if (request->get_resource() == "/requirements/fetch") {
-      automation::Schedule output;
-      as->get_requirement_engine()->CopyTo(&output);
-      ReturnMessage(output);
-    } else if(request->get_resource() == "/requirements/update") {
-      automation::Schedule update_request = LoadMessage<automation::Schedule>();
-      VLOG(5) << "Updating with schedule " << update_request.DebugString();
-      as->get_requirement_engine()->CopyFrom(update_request);
-      as->get_requirement_engine()->Save();
-    } else if(request->get_resource() == "/requirements/runonce") {
-      RequirementEngine re_isolated(db);
+  bool IsCacheable(const WebRequest& request) { return request.resource() == "/requirements/fetch"; }
+  void handle_command(WebRequest& request) {
+    AutomationState *as = AutomationState::get_state(request.channel);
+    if (request.resource() == "/requirements/fetch") {
+      automation::Schedule* output =
+          google::protobuf::Arena::CreateMessage<automation::Schedule>(RequestArena());
+      as->get_requirement_engine()->CopyTo(output);
+      request.ReturnMessage(*output);
+    } else if(request.resource() == "/requirements/update") {
+      automation::Schedule* update_request =
+          google::protobuf::Arena::CreateMessage<automation::Schedule>(RequestArena());
+      request.LoadMessage(update_request);
+      VLOG(5) << "Updating with schedule " << update_request->DebugString();
+      DatabaseHandle db(DatabaseOpen());
+      as->get_requirement_engine()->Replace(db, *update_request);
+    } else if (request.resource() == "/requirements/add") {
+      automation::Schedule* added =
+          google::protobuf::Arena::CreateMessage<automation::Schedule>(RequestArena());
+      request.LoadMessage(added->add_schedule());
+      DatabaseHandle db(DatabaseOpen());
+      as->get_requirement_engine()->Import(db, added);
+      request.ReturnMessage(added->schedule(0));
+    } else if (request.resource() == "/requirements/remove") {
+      DatabaseHandle db(DatabaseOpen());
+      if (!as->get_requirement_engine()->Remove(db, request.ArgumentOrDefault<int64_t>("id", 0))) {
+        NotFound(request);
+        return;
+      }
+      request.writer->write("Removed\n");
+    } else if (request.resource() == "/requirements/patch") {
+      automation::Requirement* patch =
+          google::protobuf::Arena::CreateMessage<automation::Requirement>(RequestArena());
+      request.LoadMessage(patch);
+      automation::Requirement* patched =
+          google::protobuf::Arena::CreateMessage<automation::Requirement>(RequestArena());
+      DatabaseHandle db(DatabaseOpen());
+      switch (as->get_requirement_engine()->Patch(db, request.ArgumentOrDefault<int64_t>("id", 0),
+                                                   *patch, patched)) {
+        case RequirementEngine::PATCHED:
+          request.ReturnMessage(*patched);
+          break;
+        case RequirementEngine::NOT_FOUND:
+          NotFound(request);
+          break;
+        case RequirementEngine::CONFLICT:
+          request.writer->get_response().set_status_code(409);
+          request.writer->get_response().set_status_message("Conflict");
+          request.writer->write("Version mismatch; fetch the requirement again.\n");
+          break;
+      }
+    } else if (request.resource() == "/requirements/import") {
+      Import(request, as);
+    } else if(request.resource() == "/requirements/runonce") {
+      // Running a requirement typically means playing audio, which can take
+      // minutes; do it on the job queue rather than on this HTTP thread.
       automation::Schedule run_now;
-      run_now.add_schedule()->CopyFrom(LoadMessage<automation::Requirement>());
-      LOG(INFO) << remote_user << " requests command " << run_now.DebugString();
-      re_isolated.RunBlock(0, &run_now);
+      request.LoadMessage(run_now.add_schedule());
+      LOG(INFO) << request.remote_user << " requests command " << run_now.DebugString();
+      // Anything it plays waits its turn on the channel's player (see
+      // MplayerSession::Play), rather than racing the channel's own thread.
+      automation::Job job;
+      if (!JobQueue::Get()->Submit(
+          "runonce " + run_now.ShortDebugString(), request.remote_user, [run_now, as]() {
+        // On the request's channel, which MakeCurrent selects for the
+        // commands it runs.
+        as->MakeCurrent();
+        RequirementEngine::RunNow(run_now);
+      }, &job)) {
+        request.writer->get_response().set_status_code(503);
+        request.writer->get_response().set_status_message("Service Unavailable");
+        request.writer->write("Too many jobs queued; try again later.\n");
+        return;
+      }
+      request.writer->get_response().set_status_code(HTTPTypes::RESPONSE_CODE_ACCEPTED);
+      request.writer->get_response().set_status_message(HTTPTypes::RESPONSE_MESSAGE_ACCEPTED);
+      request.writer->get_response().add_header("Location", "/jobs/" + std::to_string(job.jobid()));
+      request.ReturnMessage(job);
     }
   }
-};
-REGISTER_COMMAND(RequirementsCommand);
-class SQLResult {
- private:
 
- public:
-  static int AddRow(void * arg, int ncol, char **fields, char **columns) {
-    automation::SQLResult *data = (automation::SQLResult *)arg;
-    automation::SQLRow row;
-    if (!data->has_column()) {
-      for(int i = 0; i < ncol; ++i) {
-        row.add_data(columns[i]);
+  // Parses the whole upload before anything is stored, so a bad line or
+  // record leaves the schedule alone.
+  void Import(WebRequest& request, AutomationState *as) {
+    automation::Schedule* imported =
+        google::protobuf::Arena::CreateMessage<automation::Schedule>(RequestArena());
+    std::string error;
+    if (request.params.count("csv")) {
+      const std::string log(request.http->get_content(), request.http->get_content_length());
+      RequirementEngine::ParseSpotLog(log, imported, &error);
+    } else if (request.Format() == "json") {
+      request.LoadMessage(imported);
+    } else {
+      // A sequence of varint length-delimited automation::Requirement records.
+      google::protobuf::io::ArrayInputStream input(request.http->get_content(),
+                                                   request.http->get_content_length());
+      google::protobuf::io::CodedInputStream coded(&input);
+      coded.SetTotalBytesLimit(INT_MAX);
+      uint32_t size;
+      while (error.empty() && coded.ReadVarint32(&size)) {
+        google::protobuf::io::CodedInputStream::Limit limit = coded.PushLimit(size);
+        if (!imported->add_schedule()->ParseFromCodedStream(&coded) || !coded.ConsumedEntireMessage()) {
+          error = "record " + std::to_string(imported->schedule_size()) + " is malformed";
+        }
+        coded.PopLimit(limit);
       }
-      data->mutable_column()->CopyFrom(row);
     }
-    row.Clear();
-    for(int i = 0; i < ncol; ++i) {
-      if (fields[i]) {
-        row.add_data(fields[i]);
-      } else {
-        row.add_data("");
-      }
+    if (!error.empty()) {
+      request.writer->get_response().set_status_code(HTTPTypes::RESPONSE_CODE_BAD_REQUEST);
+      request.writer->get_response().set_status_message(HTTPTypes::RESPONSE_MESSAGE_BAD_REQUEST);
+      request.writer->write(error + "\n");
+      return;
     }
-    data->add_row()->CopyFrom(row);
-    return 0;
+    DatabaseHandle db(DatabaseOpen());
+    as->get_requirement_engine()->Import(db, imported);
+    LOG(INFO) << "Imported " << imported->schedule_size() << " requirements";
+    request.writer->write("Imported " + std::to_string(imported->schedule_size()) + " requirements\n");
   }
 
+  void NotFound(WebRequest& request) {
+    request.writer->get_response().set_status_code(HTTPTypes::RESPONSE_CODE_NOT_FOUND);
+    request.writer->get_response().set_status_message(HTTPTypes::RESPONSE_MESSAGE_NOT_FOUND);
+    request.writer->write("No such requirement\n");
+  }
 };
-
+REGISTER_COMMAND(RequirementsCommand);
+class JobsCommand : public WebCommand {
+  const std::string get_command() { return "/jobs"; }
+  void handle_command(WebRequest& request) {
+    const std::string& resource = request.resource();
+    if (resource == "/jobs" || resource == "/jobs/") {
+      automation::Jobs* jobs = google::protobuf::Arena::CreateMessage<automation::Jobs>(RequestArena());
+      JobQueue::Get()->List(jobs);
+      request.ReturnMessage(*jobs);
+      return;
+    }
+    automation::Job* job = google::protobuf::Arena::CreateMessage<automation::Job>(RequestArena());
+    int64_t id = atoll(resource.substr(strlen("/jobs/")).c_str());
+    if (!JobQueue::Get()->Status(id, job)) {
+      request.writer->get_response().set_status_code(HTTPTypes::RESPONSE_CODE_NOT_FOUND);
+      request.writer->get_response().set_status_message(HTTPTypes::RESPONSE_MESSAGE_NOT_FOUND);
+      request.writer << "No such job.";
+      return;
+    }
+    request.ReturnMessage(*job);
+  }
+};
+REGISTER_COMMAND(JobsCommand);
 class SQLCommand : public WebCommand {
   const std::string get_command() { return "/sql"; }
-  void handle_command(HTTPRequestPtr& request, HTTPResponseWriterPtr writer, const std::string& remote_user) {
+  void handle_command(WebRequest& request) {
     if (!FLAGS_expose_sql) {
       return;
     }
-    const char *cmd = request_->get_content();
-    char *errmsg;
-    DatabaseHandle db(DatabaseOpen());
-    automation::SQLResult result;
-    LOG(INFO) << "SQL API: " << cmd;
-    if (sqlite3_exec(db, cmd, &SQLResult::AddRow, &result, &errmsg) != SQLITE_OK) {
+    const std::string sql(request.http->get_content(), request.http->get_content_length());
+    const int64_t max_rows = std::max<int64_t>(0,
+        std::min(request.ArgumentOrDefault<int64_t>("max_rows", FLAGS_sql_max_rows), FLAGS_sql_max_rows));
+    const int64_t timeout_ms = std::max<int64_t>(0,
+        std::min(request.ArgumentOrDefault<int64_t>("timeout_ms", FLAGS_sql_timeout_ms),
+                 (int64_t)FLAGS_sql_timeout_ms));
+    LOG(INFO) << "SQL API: " << sql;
+    DatabaseHandle db(FLAGS_sql_allow_writes ? DatabaseOpen() : DatabaseOpenReadOnly());
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    sqlite3_progress_handler(db, 1000, &SQLCommand::PastDeadline, (void*)&deadline);
+
+    bool truncated = false;
+    std::string error;
+    if (request.params.count("stream")) {
+      // The stream starts with the first row, so that errors in preparing the
+      // statements can still be reported as a plain response.
+      bool began = false;
+      error = Run(db, sql, max_rows, &truncated, [&request, &began](automation::SQLRow* row, bool header) {
+        if (!began) {
+          request.BeginStream();
+          began = true;
+        }
+        return request.StreamMessage(*row);
+      });
+      if (!error.empty() && began) {
+        // Part of the result is already out; cut it short so the client can tell.
+        throw std::runtime_error(error);
+      }
+      if (error.empty()) {
+        if (!began) {
+          request.BeginStream();
+        }
+        if (truncated) {
+          automation::SQLRow* trailer =
+              google::protobuf::Arena::CreateMessage<automation::SQLRow>(RequestArena());
+          trailer->set_truncated(true);
+          request.StreamMessage(*trailer);
+        }
+        request.EndStream();
+        return;
+      }
+    } else {
+      automation::SQLResult* result =
+          google::protobuf::Arena::CreateMessage<automation::SQLResult>(RequestArena());
+      // Rows are built on the request arena, so swapping them into the result
+      // moves them without copying.
+      error = Run(db, sql, max_rows, &truncated, [result](automation::SQLRow* row, bool header) {
+        if (!header) {
+          result->add_row()->Swap(row);
+        } else if (!result->has_column()) {
+          result->mutable_column()->Swap(row);
+        }
+        return true;
+      });
+      if (error.empty()) {
+        result->set_truncated(truncated);
+        request.ReturnMessage(*result);
+        return;
+      }
+    }
+    if (FLAGS_sql_allow_writes) {
       sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
     }
-    if (errmsg) {
-      writer << errmsg;
-      sqlite3_free(errmsg);
-      return;
+    if (error == "interrupted") {
+      error = "Query exceeded its time limit of " + std::to_string(timeout_ms) + "ms.";
     }
-    ReturnMessage(result);
+    request.writer << error;
+  }
+
+  // Steps through each statement in sql, handing emit the column names of each
+  // statement that returns rows (with header set) and then each of its rows,
+  // until emit returns false or max_rows rows have been produced.  Returns an
+  // error message, or the empty string on success.
+  std::string Run(sqlite3 *db, const std::string& sql, int64_t max_rows, bool* truncated,
+                  const std::function<bool(automation::SQLRow*, bool)>& emit) {
+    automation::SQLRow* row =
+        google::protobuf::Arena::CreateMessage<automation::SQLRow>(RequestArena());
+    const char *tail = sql.c_str();
+    const char *const end = tail + sql.size();
+    int64_t rows = 0;
+    while (tail < end) {
+      sqlite3_stmt *statement = nullptr;
+      if (sqlite3_prepare_v2(db, tail, end - tail, &statement, &tail) != SQLITE_OK) {
+        return sqlite3_errmsg(db);
+      }
+      if (!statement) {
+        // Nothing but whitespace or a comment.
+        continue;
+      }
+      std::unique_ptr<sqlite3_stmt, int(*)(sqlite3_stmt*)> finalize(statement, &sqlite3_finalize);
+      if (!FLAGS_sql_allow_writes && !sqlite3_stmt_readonly(statement)) {
+        return "Only read-only statements are allowed; see --sql_allow_writes.";
+      }
+      const int columns = sqlite3_column_count(statement);
+      bool header = true;
+      int status;
+      while ((status = sqlite3_step(statement)) == SQLITE_ROW) {
+        if (header) {
+          row->Clear();
+          for (int i = 0; i < columns; ++i) {
+            row->add_data(sqlite3_column_name(statement, i));
+          }
+          if (!emit(row, true)) {
+            return "";
+          }
+          header = false;
+        }
+        if (rows >= max_rows) {
+          *truncated = true;
+          return "";
+        }
+        row->Clear();
+        for (int i = 0; i < columns; ++i) {
+          const char *text = (const char*)sqlite3_column_text(statement, i);
+          row->add_data(text ? text : "", sqlite3_column_bytes(statement, i));
+        }
+        ++rows;
+        if (!emit(row, false)) {
+          return "";
+        }
+      }
+      if (status != SQLITE_DONE) {
+        return sqlite3_errmsg(db);
+      }
+    }
+    return "";
+  }
+
+  static int PastDeadline(void *deadline) {
+    return std::chrono::steady_clock::now() >= *(const std::chrono::steady_clock::time_point*)deadline;
   }
 };
 REGISTER_COMMAND(SQLCommand);
 
 class PlaylistCommand : public WebCommand {
   const std::string get_command() { return "/playlist"; }
-  void handle_command(HTTPRequestPtr& request, HTTPResponseWriterPtr writer, const std::string& remote_user) {
+  bool IsCacheable(const WebRequest& request) {
+    if (request.resource() == "/playlist/all") {
+      return !request.params.count("stream");
+    }
+    if (request.resource() != "/playlist/fetch" || !request.params.count("id")) {
+      return false;
+    }
+    // These select in-memory lists (which take precedence over id), write, or stream.
+    for (const char *param : {"fetchall", "mainshow", "override", "bumperlist", "new", "alsosave", "stream"}) {
+      if (request.params.count(param)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  void handle_command(WebRequest& request) {
     using automation::ProtoStore;
-    auto params = request->get_queries();
+    auto params = request.http->get_queries();
     DatabaseHandle db(DatabaseOpen());
     ProtoStore<automation::Playlist> pstore(db);
 
     PlaylistPtr ptr;
 
-    if (request->get_resource().find("/playlist/fetch") != std::string::npos) {
+    if (request.resource().find("/playlist/fetch") != std::string::npos) {
       Playlist lookup(db);
-      if ((ptr = FetchPlaylistFromParams(db)) && ptr.get()) {
-        if (params_.count("alsosave")) {
-          automation::Playlist temp = Filter(ptr.get());
-          temp.clear_playlistid();
+      if (request.params.count("fetchall") && (request.params.count("stream") || request.params.count("cursor"))) {
+        PageAllItems(request, db);
+      } else if ((ptr = FetchPlaylistFromParams(request, db)) && ptr.get()) {
+        if (request.params.count("alsosave")) {
+          automation::Playlist* temp = Filter(request, ptr.get());
+          temp->clear_playlistid();
           PlaylistPtr newlist = GetNewlist(db);
-          VLOG(5) << "Newlist prepared" << newlist->data().DebugString();
-          newlist->MergeFrom(temp);
-          VLOG(5) << "About to save " << newlist->data().DebugString();
+          VLOG(5) << "Newlist prepared" << newlist->snapshot()->DebugString();
+          newlist->MergeFrom(*temp);
+          VLOG(5) << "About to save " << newlist->snapshot()->DebugString();
           newlist->Replace();
-          ReturnMessage(newlist->data());
+          request.ReturnMessage(*newlist->snapshot());
         } else {
-          FilterAndReturn(ptr.get());
+          FilterAndReturn(request, ptr.get());
         }
       } else {
-        LOG(INFO) << "Nope " << lookup.data().DebugString();
+        LOG(INFO) << "Nope " << lookup.snapshot()->DebugString();
       }
-    } else if (request->get_resource().find("/playlist/all") != std::string::npos) {
-      ReturnMessage(Playlist::FetchAllLists(db));
-    } else if (request->get_resource().find("/playlist/update") != std::string::npos) {
-      automation::PlaylistMergeRequest update_request = LoadMessage<automation::PlaylistMergeRequest>();
+    } else if (request.resource().find("/playlist/all") != std::string::npos) {
+      PageAllLists(request, db);
+    } else if (request.resource().find("/playlist/update") != std::string::npos) {
+      automation::PlaylistMergeRequest& update_request =
+          *google::protobuf::Arena::CreateMessage<automation::PlaylistMergeRequest>(RequestArena());
+      request.LoadMessage(&update_request);
       bool overwrite = false;
       if (params.count("overwrite")) {
         overwrite = true;
       }
-      PlaylistPtr ptr = FetchPlaylistFromParams(db);
+      PlaylistPtr ptr = FetchPlaylistFromParams(request, db);
       if (!ptr.get() && update_request.has_playlistid()) {
         ptr.reset(new Playlist(db));
         ptr->Fetch(update_request.playlistid());
@@ -180,51 +430,163 @@ class PlaylistCommand : public WebCommand {
         ptr->ApplyMergeRequest(update_request, overwrite);
         VLOG(5) << "replacing now";
         ptr->Replace();
-        automation::Playlist output;
-        ptr->CopyTo(&output);
-        ReturnMessage(output);
+        if (ptr == AutomationState::get_state(request.channel)->get_override_playlist()) {
+          AutomationState::get_state(request.channel)->WakeOverride();
+        }
+        automation::Playlist* output =
+            google::protobuf::Arena::CreateMessage<automation::Playlist>(RequestArena());
+        ptr->CopyTo(output);
+        request.ReturnMessage(*output);
       } else {
-        writer << "Invalid request.";
+        request.writer << "Invalid request.";
+      }
+    } else if (request.resource().find("/playlist/delta") != std::string::npos) {
+      automation::PlaylistDelta& delta =
+          *google::protobuf::Arena::CreateMessage<automation::PlaylistDelta>(RequestArena());
+      request.LoadMessage(&delta);
+      PlaylistPtr ptr = FetchPlaylistFromParams(request, db);
+      if (!ptr.get() && delta.has_playlistid()) {
+        ptr.reset(new Playlist(db));
+        if (!ptr->Fetch(delta.playlistid())) {
+          // Fetch only finds lists with members; an empty one is still there.
+          ptr->Mutate([&delta](automation::Playlist* playlist) {
+            playlist->set_playlistid(delta.playlistid());
+          });
+        }
+      }
+      if (!ptr.get() || request.params.count("fetchall") || request.params.count("new")) {
+        request.writer << "Invalid request.";
+        return;
       }
+      ptr->ApplyDelta(delta);
+      if (ptr == AutomationState::get_state(request.channel)->get_override_playlist()) {
+        AutomationState::get_state(request.channel)->WakeOverride();
+      }
+      automation::Playlist* output =
+          google::protobuf::Arena::CreateMessage<automation::Playlist>(RequestArena());
+      ptr->CopyTo(output);
+      request.ReturnMessage(*output);
     } else {
-      LOG(WARNING) << "Unknown resource " << request->get_resource();
+      LOG(WARNING) << "Unknown resource " << request.resource();
+    }
+  }
+  // /playlist/all, optionally paginated by PlaylistID with cursor and limit.
+  void PageAllLists(WebRequest& request, sqlite3 *db) {
+    automation::ProtoStore<automation::Playlist> pstore(db, "Playlists_with_size");
+    int64_t cursor = request.ArgumentOrDefault<int64_t>("cursor", 0);
+    int64_t limit = request.ArgumentOrDefault<int64_t>("limit", LLONG_MAX);
+
+    if (request.params.count("stream")) {
+      request.BeginStream();
+      pstore.LoadAfter(cursor, limit, [&request](const automation::Playlist& playlist) {
+        return request.StreamMessage(playlist);
+      });
+      request.EndStream();
+      return;
+    }
+
+    automation::Playlists* list =
+        google::protobuf::Arena::CreateMessage<automation::Playlists>(RequestArena());
+    if (!request.params.count("cursor") && !request.params.count("limit")) {
+      Playlist::FetchAllLists(db, list);
+      request.ReturnMessage(*list);
+      return;
     }
+    cursor = pstore.LoadAfter(cursor, limit, [list](const automation::Playlist& playlist) {
+      list->add_item()->CopyFrom(playlist);
+      return true;
+    });
+    SetNextCursor(request, list->item_size(), limit, cursor);
+    request.ReturnMessage(*list);
   }
+
+  // fetchall with stream or cursor set: walks PlayableItem in PlayableItemID order
+  // instead of materializing the whole library as one playlist.  Streamed
+  // responses are a sequence of PlayableItems; paged ones a Playlist of them.
+  void PageAllItems(WebRequest& request, sqlite3 *db) {
+    automation::ProtoStore<automation::PlayableItem> pstore(db);
+    int64_t cursor = request.ArgumentOrDefault<int64_t>("cursor", 0);
+    int64_t limit = request.ArgumentOrDefault<int64_t>("limit", LLONG_MAX);
+    std::unique_ptr<ItemMatcher> matcher;
+    if (request.params.count("filter")) {
+      matcher.reset(new ItemMatcher(request.params.equal_range("filter").first->second));
+      if (!matcher->ok()) {
+        request.writer << "Invalid filter.";
+        return;
+      }
+    }
+
+    if (request.params.count("stream")) {
+      request.BeginStream();
+      pstore.LoadAfter(cursor, limit, [&request, &matcher](const automation::PlayableItem& item) {
+        return (matcher && !matcher->Matches(item)) || request.StreamMessage(item);
+      });
+      request.EndStream();
+      return;
+    }
+
+    // limit bounds the rows scanned rather than the rows returned, so that a
+    // selective filter can't turn one page into a scan of the whole library.
+    automation::Playlist* output =
+        google::protobuf::Arena::CreateMessage<automation::Playlist>(RequestArena());
+    int64_t scanned = 0;
+    cursor = pstore.LoadAfter(cursor, limit, [&](const automation::PlayableItem& item) {
+      ++scanned;
+      if (!matcher || matcher->Matches(item)) {
+        if (request.params.count("noitems")) {
+          output->add_playableitemid(item.playableitemid());
+        } else {
+          output->add_items()->CopyFrom(item);
+        }
+      }
+      return true;
+    });
+    SetNextCursor(request, scanned, limit, cursor);
+    request.ReturnMessage(*output);
+  }
+
+  // A full page means there may be more rows; tell the client where to resume.
+  void SetNextCursor(WebRequest& request, int64_t rows, int64_t limit, int64_t cursor) {
+    if (rows >= limit) {
+      request.writer->get_response().add_header("X-Next-Cursor", std::to_string(cursor));
+    }
+  }
+
   PlaylistPtr GetNewlist(sqlite3 *db) {
     char buf[128];
     int newnum = 0;
     PlaylistPtr newlist(new Playlist(db));
     do {
       snprintf(buf, sizeof(buf), "New Playlist %d", ++newnum);
-      VLOG(20) << "About to lookup" << newlist->data().DebugString();
+      VLOG(20) << "About to lookup" << newlist->snapshot()->DebugString();
     } while (newlist->Fetch(buf));
     return newlist;
   }
 
-  PlaylistPtr FetchPlaylistFromParams(sqlite3 *db) {
-    if (params_.count("fetchall")) {
+  PlaylistPtr FetchPlaylistFromParams(const WebRequest& request, sqlite3 *db) {
+    if (request.params.count("fetchall")) {
       PlaylistPtr lookup(new Playlist(db));
-      int64_t limit = ArgumentOrDefault<int64_t>("limit", LLONG_MAX);
-      int64_t offset = ArgumentOrDefault<int64_t>("offset", 0);
+      int64_t limit = request.ArgumentOrDefault<int64_t>("limit", LLONG_MAX);
+      int64_t offset = request.ArgumentOrDefault<int64_t>("offset", 0);
       lookup->FetchSuperlist(limit, offset);
       return lookup; 
     }
-    if (params_.count("mainshow")) {
-      return AutomationState::get_state()->GetMainshow();
+    if (request.params.count("mainshow")) {
+      return AutomationState::get_state(request.channel)->GetMainshow();
     }
-    if (params_.count("override")) {
-      return AutomationState::get_state()->get_override_playlist();
+    if (request.params.count("override")) {
+      return AutomationState::get_state(request.channel)->get_override_playlist();
     }
-    if (params_.count("bumperlist")) {
-      return AutomationState::get_state()->get_bumperlist();
+    if (request.params.count("bumperlist")) {
+      return AutomationState::get_state(request.channel)->get_bumperlist();
     }
-    if (params_.count("new")) {
+    if (request.params.count("new")) {
       return GetNewlist(db);
     }
-    if (!params_.count("id")) {
+    if (!request.params.count("id")) {
       return PlaylistPtr();
     }
-    sqlite3_int64 id = std::stoll(params_.equal_range("id").first->second);
+    sqlite3_int64 id = std::stoll(request.params.equal_range("id").first->second);
 
     PlaylistPtr copy(new Playlist(db));
     if (copy->Fetch(id)) {
@@ -233,28 +595,32 @@ class PlaylistCommand : public WebCommand {
 
     return PlaylistPtr();
   }
-  automation::Playlist Filter(Playlist *input) {
-    automation::Playlist output;
-    if (params_.count("filter")) {
-      output = input->Filter(params_.equal_range("filter").first->second);
-      if (params_.count("noitems") || params_.count("alsosave")) {
-        output.clear_items();
+  // Builds the response for input on the request arena, so that nothing in it
+  // has to be copied again on the way out.
+  automation::Playlist* Filter(const WebRequest& request, Playlist *input) {
+    automation::Playlist* output =
+        google::protobuf::Arena::CreateMessage<automation::Playlist>(RequestArena());
+    if (request.params.count("filter")) {
+      input->Filter(request.params.equal_range("filter").first->second, FLAGS_filter_threads, output);
+      if (request.params.count("noitems") || request.params.count("alsosave")) {
+        output->clear_items();
       } else {
-        output.clear_playableitemid();
+        output->clear_playableitemid();
       }
     } else {
-      input->CopyTo(&output);
-      output.clear_items();
+      input->CopyTo(output);
+      output->clear_items();
     }
     return output;
   }
-  void FilterAndReturn(Playlist* input) {
-    automation::Playlist output = Filter(input);
-    while(output.items_size() > ArgumentOrDefault<int64_t>("truncate", LLONG_MAX)) {
-      output.mutable_items()->RemoveLast();
+  void FilterAndReturn(WebRequest& request, Playlist* input) {
+    automation::Playlist* output = Filter(request, input);
+    int64_t truncate = request.ArgumentOrDefault<int64_t>("truncate", LLONG_MAX);
+    if (output->items_size() > truncate) {
+      output->mutable_items()->DeleteSubrange(truncate, output->items_size() - truncate);
     }
 
-    ReturnMessage(output);
+    request.ReturnMessage(*output);
   }
   
 
@@ -263,25 +629,26 @@ REGISTER_COMMAND(PlaylistCommand);
       
 class PlayerCommand : public WebCommand {
   const std::string get_command() { return "/player"; }
-  void handle_command(HTTPRequestPtr& request, HTTPResponseWriterPtr writer, const std::string& remote_user) {
-    AutomationState *as = AutomationState::get_state();
-    if (request->get_resource() == "/player/pause" && as->get_manual_override()) {
+  void handle_command(WebRequest& request) {
+    AutomationState *as = AutomationState::get_state(request.channel);
+    if (request.resource() == "/player/pause" && as->get_manual_override()) {
       as->get_mainplayer()->PauseToggle();
-    } else if (request->get_resource() == "/player/onlypause" && as->get_manual_override()) {
+    } else if (request.resource() == "/player/onlypause" && as->get_manual_override()) {
       as->get_mainplayer()->Pause();
-    } else if (request->get_resource() == "/player/stop") {
+    } else if (request.resource() == "/player/stop") {
       as->get_player()->Stop();
-    } else if (request->get_resource() == "/player/unpause") {
+    } else if (request.resource() == "/player/unpause") {
       as->get_player()->Unpause();
-    } else if (request->get_resource() == "/player/state") {
-      automation::PlayerState ps;
-      as->get_mainplayer()->MergeState(&ps);
-      ReturnMessage(ps);
-    } else if (request->get_resource() == "/player/speed") {
-      double speed = ArgumentOrDefault<double>("speed", 1.0);
+    } else if (request.resource() == "/player/state") {
+      automation::PlayerState* ps =
+          google::protobuf::Arena::CreateMessage<automation::PlayerState>(RequestArena());
+      as->get_mainplayer()->MergeState(ps);
+      request.ReturnMessage(*ps);
+    } else if (request.resource() == "/player/speed") {
+      double speed = request.ArgumentOrDefault<double>("speed", 1.0);
       as->get_mainplayer()->SetSpeed(speed);
-    } else if (request->get_resource() == "/player/seek") {
-      double timepos = ArgumentOrDefault<double>("seek", 0.0);
+    } else if (request.resource() == "/player/seek") {
+      double timepos = request.ArgumentOrDefault<double>("seek", 0.0);
       as->get_mainplayer()->Seek(timepos);
     }
   }
@@ -289,3 +656,24 @@ class PlayerCommand : public WebCommand {
 };
 REGISTER_COMMAND(PlayerCommand);
 
+class MetricsCommand : public WebCommand {
+  const std::string get_command() { return "/metrics"; }
+  void handle_command(WebRequest& request) {
+    request.writer->get_response().set_content_type("text/plain; version=0.0.4");
+    request.writer << metrics::ExportPrometheus();
+  }
+};
+REGISTER_COMMAND(MetricsCommand);
+
+class TraceCommand : public WebCommand {
+  const std::string get_command() { return "/trace"; }
+  void handle_command(WebRequest& request) {
+    if (request.params.count("enable")) {
+      trace::SetEnabled(request.ArgumentOrDefault<int64_t>("enable", 0) != 0);
+      LOG(INFO) << request.remote_user << " turned tracing " << (trace::Enabled() ? "on" : "off");
+    }
+    request.writer->get_response().set_content_type("application/json");
+    request.writer << trace::ExportChromeJson();
+  }
+};
+REGISTER_COMMAND(TraceCommand);